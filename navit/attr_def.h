@@ -182,7 +182,7 @@ ATTR(street_count)
 ATTR(min_dist)
 ATTR(max_dist)
 ATTR(cache_size)
-ATTR_UNUSED
+ATTR(tile_cache_size)
 ATTR_UNUSED
 ATTR_UNUSED
 ATTR_UNUSED
@@ -255,6 +255,8 @@ ATTR(waypoints_flag) /* toggle for "set as destination" to switch between start
 ATTR(no_warning_if_map_file_missing)
 ATTR(duplicate)
 ATTR(has_menu_button)
+ATTR(concurrent)
+ATTR(map_fanout)
 ATTR2(0x0002ffff,type_int_end)
 ATTR2(0x00030000,type_string_begin)
 ATTR(type)
@@ -407,6 +409,9 @@ ATTR(ch_edge)
 ATTR(zipfile_ref_block)
 ATTR(item_id)
 ATTR(pdl_gps_update)
+ATTR(speed_index)
+ATTR(type_ranges)
+ATTR(bbox)
 ATTR2(0x0004ffff,type_special_end)
 ATTR2(0x00050000,type_double_begin)
 ATTR(position_height)
@@ -6,9 +6,17 @@
 #include "debug.h"
 #include "cache.h"
 
+/* Upper limit for the number of shards, a power of two */
+#define CACHE_SHARDS_MAX 16
+/* A cache is only split into shards if every shard can hold at least this many bytes */
+#define CACHE_SHARD_SIZE_MIN 262144
+/* Initial number of slots of the hash table of a shard, a power of two */
+#define CACHE_SLOTS_MIN 64
+
 struct cache_entry {
 	int usage;
 	unsigned int size;
+	unsigned int hash;
 	struct cache_entry_list *where;
 	struct cache_entry *next;
 	struct cache_entry *prev;
@@ -20,13 +28,34 @@ struct cache_entry_list {
 	int size;
 };
 
-struct cache {
+struct cache_slot {
+	unsigned int hash;
+	struct cache_entry *entry;
+};
+
+/**
+ * @brief An independently locked part of a cache
+ *
+ * Every id belongs to the shard selected by the upper bits of its hash. Each shard is an
+ * ARC cache of its own with an open addressed hash table, so threads looking up ids of
+ * different shards do not wait for each other.
+ */
+struct cache_shard {
+	GMutex mutex;			/**< Protects all members of the shard */
 	struct cache_entry_list t1,b1,t2,b2,*insert;
-	int size,id_size,entry_size;
+	int size;
 	int t1_target;
 	unsigned int misses;
 	unsigned int hits;
-	GHashTable *hash;
+	struct cache_slot *slots;	/**< Linear probing, the slot of an entry is selected by the lower bits of its hash */
+	int mask;			/**< Number of slots - 1 */
+	int count;			/**< Number of used slots */
+};
+
+struct cache {
+	int id_size,entry_size;
+	int shard_bits;
+	struct cache_shard *shards;
 };
 
 static void
@@ -54,73 +83,167 @@ cache_list_dump(char *str, struct cache *cache, struct cache_entry_list *list)
 	}
 }
 
-static guint
-cache_hash4(gconstpointer key)
+static unsigned int
+cache_hash(struct cache *cache, int *id)
+{
+	unsigned int h=0;
+	int i;
+
+	for (i = 0 ; i < cache->id_size ; i++)
+		h=(h ^ id[i])*0x9e3779b1;
+	h^=h >> 16;
+	h*=0x85ebca6b;
+	h^=h >> 13;
+	h*=0xc2b2ae35;
+	h^=h >> 16;
+	return h;
+}
+
+static struct cache_shard *
+cache_shard(struct cache *cache, unsigned int hash)
 {
-	int *id=(int *)key;
-	return id[0];
+	return &cache->shards[cache->shard_bits ? hash >> (32-cache->shard_bits) : 0];
+}
+
+static struct cache_entry *
+cache_table_lookup(struct cache *cache, struct cache_shard *shard, unsigned int hash, int *id)
+{
+	struct cache_slot *slot;
+	int i=hash & shard->mask;
+
+	while ((slot=&shard->slots[i])->entry) {
+		if (slot->hash == hash && !memcmp(slot->entry->id, id, cache->id_size*sizeof(int)))
+			return slot->entry;
+		i=(i+1) & shard->mask;
+	}
+	return NULL;
+}
+
+static int
+cache_table_find(struct cache_shard *shard, struct cache_entry *entry)
+{
+	int i=entry->hash & shard->mask;
+
+	while (shard->slots[i].entry != entry) {
+		dbg_assert(shard->slots[i].entry != NULL);
+		i=(i+1) & shard->mask;
+	}
+	return i;
 }
 
-static guint
-cache_hash20(gconstpointer key)
+static void
+cache_table_put(struct cache_shard *shard, struct cache_entry *entry)
 {
-	int *id=(int *)key;
-	return id[0]^id[1]^id[2]^id[3]^id[4];
+	int i=entry->hash & shard->mask;
+
+	while (shard->slots[i].entry)
+		i=(i+1) & shard->mask;
+	shard->slots[i].hash=entry->hash;
+	shard->slots[i].entry=entry;
 }
 
-static gboolean
-cache_equal4(gconstpointer a, gconstpointer b)
+static void
+cache_table_insert(struct cache_shard *shard, struct cache_entry *entry)
 {
-	int *ida=(int *)a;
-	int *idb=(int *)b;
+	struct cache_slot *old=shard->slots;
+	int i,old_size=shard->mask+1;
+
+	if (2*(shard->count+1) > old_size) {
+		shard->slots=g_new0(struct cache_slot, 2*old_size);
+		shard->mask=2*old_size-1;
+		for (i = 0 ; i < old_size ; i++) {
+			if (old[i].entry)
+				cache_table_put(shard, old[i].entry);
+		}
+		g_free(old);
+	}
+	cache_table_put(shard, entry);
+	shard->count++;
+}
 
-	return ida[0] == idb[0];
+/**
+ * @brief Removes an entry from the hash table
+ *
+ * Following entries are moved back into the gap, so lookups never have to skip deleted slots.
+ */
+static void
+cache_table_remove(struct cache_shard *shard, struct cache_entry *entry)
+{
+	int i=cache_table_find(shard, entry), j=i, k;
+
+	for (;;) {
+		j=(j+1) & shard->mask;
+		if (!shard->slots[j].entry)
+			break;
+		k=shard->slots[j].hash & shard->mask;
+		/* Move the entry unless its home slot lies cyclically in (i,j] */
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			shard->slots[i]=shard->slots[j];
+			i=j;
+		}
+	}
+	shard->slots[i].entry=NULL;
+	shard->count--;
 }
 
-static gboolean
-cache_equal20(gconstpointer a, gconstpointer b)
+static void
+cache_shards_resize(struct cache *cache, int size)
 {
-	int *ida=(int *)a;
-	int *idb=(int *)b;
+	int i,shards=1 << cache->shard_bits;
 
-	return(ida[0] == idb[0] &&
-	       ida[1] == idb[1] &&
-	       ida[2] == idb[2] &&
-	       ida[3] == idb[3] &&
-	       ida[4] == idb[4]);
+	for (i = 0 ; i < shards ; i++) {
+		g_mutex_lock(&cache->shards[i].mutex);
+		cache->shards[i].size=size/shards;
+		g_mutex_unlock(&cache->shards[i].mutex);
+	}
 }
 
+/**
+ * @brief Creates a cache
+ *
+ * All functions may be called from several threads at the same time.
+ *
+ * @param id_size Size of the ids in bytes, a multiple of 4
+ * @param size Size of the cache in bytes, split evenly among its shards
+ */
 struct cache *
 cache_new(int id_size, int size)
 {
-	struct cache *cache=g_new0(struct cache, 1);
-	
+	struct cache *cache;
+	int i;
+
+	if (id_size <= 0 || id_size % 4) {
+		dbg(lvl_error,"cache with id_size of %d not supported\n", id_size);
+		return NULL;
+	}
+	cache=g_new0(struct cache, 1);
 	cache->id_size=id_size/4;
 	cache->entry_size=cache->id_size*sizeof(int)+sizeof(struct cache_entry);
-	cache->size=size;
-	switch (id_size) {
-	case 4:
-		cache->hash=g_hash_table_new(cache_hash4, cache_equal4);
-		break;
-	case 20:
-		cache->hash=g_hash_table_new(cache_hash20, cache_equal20);
-		break;
-	default:
-		dbg(lvl_error,"cache with id_size of %d not supported\n", id_size);
-		g_free(cache);
-		cache=NULL;
+	while ((1 << cache->shard_bits) < CACHE_SHARDS_MAX && size >> (cache->shard_bits+1) >= CACHE_SHARD_SIZE_MIN)
+		cache->shard_bits++;
+	cache->shards=g_new0(struct cache_shard, 1 << cache->shard_bits);
+	for (i = 0 ; i < 1 << cache->shard_bits ; i++) {
+		g_mutex_init(&cache->shards[i].mutex);
+		cache->shards[i].slots=g_new0(struct cache_slot, CACHE_SLOTS_MIN);
+		cache->shards[i].mask=CACHE_SLOTS_MIN-1;
 	}
+	cache_shards_resize(cache, size);
 	return cache;
 }
 
+/**
+ * @brief Changes the size of a cache
+ *
+ * The number of shards stays as chosen by cache_new().
+ */
 void
 cache_resize(struct cache *cache, int size)
 {
-	cache->size=size;
+	cache_shards_resize(cache, size);
 }
 
 static void
-cache_insert_mru(struct cache *cache, struct cache_entry_list *list, struct cache_entry *entry)
+cache_insert_mru(struct cache_shard *shard, struct cache_entry_list *list, struct cache_entry *entry)
 {
 	entry->prev=NULL;
 	entry->next=list->first;
@@ -131,14 +254,14 @@ cache_insert_mru(struct cache *cache, struct cache_entry_list *list, struct cach
 	if (! list->last)
 		list->last=entry;
 	list->size+=entry->size;
-	if (cache) 
-		g_hash_table_insert(cache->hash, (gpointer)entry->id, entry);
+	if (shard)
+		cache_table_insert(shard, entry);
 }
 
 static void
 cache_remove_from_list(struct cache_entry_list *list, struct cache_entry *entry)
 {
-	if (entry->prev) 
+	if (entry->prev)
 		entry->prev->next=entry->next;
 	else
 		list->first=entry->next;
@@ -150,10 +273,10 @@ cache_remove_from_list(struct cache_entry_list *list, struct cache_entry *entry)
 }
 
 static void
-cache_remove(struct cache *cache, struct cache_entry *entry)
+cache_remove(struct cache_shard *shard, struct cache_entry *entry)
 {
 	dbg(lvl_debug,"remove 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	g_hash_table_remove(cache->hash, (gpointer)(entry->id));
+	cache_table_remove(shard, entry);
 	g_slice_free1(entry->size, entry);
 }
 
@@ -173,22 +296,22 @@ cache_remove_lru_helper(struct cache_entry_list *list)
 }
 
 static struct cache_entry *
-cache_remove_lru(struct cache *cache, struct cache_entry_list *list)
+cache_remove_lru(struct cache_shard *shard, struct cache_entry_list *list)
 {
 	struct cache_entry *last;
 	int seen=0;
-	while (list->last && list->last->usage && seen < list->size) {
+	while (list->last && g_atomic_int_get(&list->last->usage) && seen < list->size) {
 		last=cache_remove_lru_helper(list);
 		cache_insert_mru(NULL, list, last);
 		seen+=last->size;
 	}
 	last=list->last;
-	if (! last || last->usage || seen >= list->size) 
+	if (! last || g_atomic_int_get(&last->usage) || seen >= list->size)
 		return NULL;
 	dbg(lvl_debug,"removing %d\n", last->id[0]);
 	cache_remove_lru_helper(list);
-	if (cache) {
-		cache_remove(cache, last);
+	if (shard) {
+		cache_remove(shard, last);
 		return NULL;
 	}
 	return last;
@@ -199,70 +322,85 @@ cache_entry_new(struct cache *cache, void *id, int size)
 {
 	struct cache_entry *ret;
 	size+=cache->entry_size;
-	cache->misses+=size;
 	ret=(struct cache_entry *)g_slice_alloc0(size);
 	ret->size=size;
 	ret->usage=1;
 	memcpy(ret->id, id, cache->id_size*sizeof(int));
+	ret->hash=cache_hash(cache, ret->id);
 	return &ret->id[cache->id_size];
 }
 
+/**
+ * @brief Frees an entry created by cache_entry_new() which was not inserted
+ */
+void
+cache_entry_free(struct cache *cache, void *data)
+{
+	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
+	g_slice_free1(entry->size, entry);
+}
+
+/**
+ * @brief Releases data returned by the cache
+ *
+ * Does not lock the shard, entries are only evicted once their usage has dropped to 0.
+ */
 void
 cache_entry_destroy(struct cache *cache, void *data)
 {
 	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
 	dbg(lvl_debug,"destroy 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	entry->usage--;
+	g_atomic_int_add(&entry->usage, -1);
 }
 
 static struct cache_entry *
-cache_trim(struct cache *cache, struct cache_entry *entry)
+cache_trim(struct cache *cache, struct cache_shard *shard, struct cache_entry *entry)
 {
 	struct cache_entry *new_entry;
 	dbg(lvl_debug,"trim 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	dbg(lvl_debug,"Trim %x from %d -> %d\n", entry->id[0], entry->size, cache->size);
+	dbg(lvl_debug,"Trim %x from %d -> %d\n", entry->id[0], entry->size, shard->size);
 	if ( cache->entry_size < entry->size )
 	{
-	    g_hash_table_remove(cache->hash, (gpointer)(entry->id));
+	    int slot=cache_table_find(shard, entry);
 
 	    new_entry = g_slice_alloc0(cache->entry_size);
 	    memcpy(new_entry, entry, cache->entry_size);
 	    g_slice_free1( entry->size, entry);
 	    new_entry->size = cache->entry_size;
 
-	    g_hash_table_insert(cache->hash, (gpointer)new_entry->id, new_entry);
+	    shard->slots[slot].entry=new_entry;
 	}
 	else
 	{
-	    new_entry = entry; 
+	    new_entry = entry;
 	}
-	
+
 	return new_entry;
 }
 
 static struct cache_entry *
-cache_move(struct cache *cache, struct cache_entry_list *old, struct cache_entry_list *new)
+cache_move(struct cache *cache, struct cache_shard *shard, struct cache_entry_list *old, struct cache_entry_list *new)
 {
 	struct cache_entry *entry;
 	entry=cache_remove_lru(NULL, old);
 	if (! entry)
 		return NULL;
-	entry=cache_trim(cache, entry);
+	entry=cache_trim(cache, shard, entry);
 	cache_insert_mru(NULL, new, entry);
 	return entry;
 }
 
 static int
-cache_replace(struct cache *cache)
+cache_replace(struct cache *cache, struct cache_shard *shard)
 {
-	if (cache->t1.size >= MAX(1,cache->t1_target)) {
+	if (shard->t1.size >= MAX(1,shard->t1_target)) {
 		dbg(lvl_debug,"replace 12\n");
-		if (!cache_move(cache, &cache->t1, &cache->b1))
-			cache_move(cache, &cache->t2, &cache->b2);
+		if (!cache_move(cache, shard, &shard->t1, &shard->b1))
+			cache_move(cache, shard, &shard->t2, &shard->b2);
 	} else {
 		dbg(lvl_debug,"replace t2\n");
-		if (!cache_move(cache, &cache->t2, &cache->b2))
-			cache_move(cache, &cache->t1, &cache->b1);
+		if (!cache_move(cache, shard, &shard->t2, &shard->b2))
+			cache_move(cache, shard, &shard->t1, &shard->b1);
 	}
 	return 1;
 }
@@ -270,32 +408,81 @@ cache_replace(struct cache *cache)
 void
 cache_flush(struct cache *cache, void *id)
 {
-	struct cache_entry *entry=g_hash_table_lookup(cache->hash, id);
+	unsigned int hash=cache_hash(cache, id);
+	struct cache_shard *shard=cache_shard(cache, hash);
+	struct cache_entry *entry;
+
+	g_mutex_lock(&shard->mutex);
+	entry=cache_table_lookup(cache, shard, hash, id);
 	if (entry) {
 		cache_remove_from_list(entry->where, entry);
-		cache_remove(cache, entry);
+		cache_remove(shard, entry);
 	}
+	g_mutex_unlock(&shard->mutex);
 }
 
 void
 cache_flush_data(struct cache *cache, void *data)
 {
 	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
-	if (entry) {
-		cache_remove_from_list(entry->where, entry);
-		cache_remove(cache, entry);
-	}
+	struct cache_shard *shard=cache_shard(cache, entry->hash);
+
+	g_mutex_lock(&shard->mutex);
+	cache_remove_from_list(entry->where, entry);
+	cache_remove(shard, entry);
+	g_mutex_unlock(&shard->mutex);
 }
 
 
+static void *
+cache_hit(struct cache *cache, struct cache_shard *shard, struct cache_entry *entry)
+{
+	shard->hits+=entry->size;
+#ifdef DEBUG_CACHE
+	if (entry->where == &shard->t1)
+		fprintf(stderr,"h");
+	else
+		fprintf(stderr,"H");
+#endif
+	dbg(lvl_debug,"in cache %s\n", entry->where == &shard->t1 ? "T1" : "T2");
+	cache_remove_from_list(entry->where, entry);
+	cache_insert_mru(NULL, &shard->t2, entry);
+	g_atomic_int_inc(&entry->usage);
+	return &entry->id[cache->id_size];
+}
+
+/**
+ * @brief Looks up cached data like cache_lookup(), but leaves entries which were evicted alone
+ *
+ * Meant for callers which create missing data without holding the lock protecting the cache
+ * and insert it with cache_insert_unique(), which does the full lookup.
+ */
 void *
-cache_lookup(struct cache *cache, void *id) {
+cache_peek(struct cache *cache, void *id)
+{
+	unsigned int hash=cache_hash(cache, id);
+	struct cache_shard *shard=cache_shard(cache, hash);
+	struct cache_entry *entry;
+	void *ret=NULL;
+
+	g_mutex_lock(&shard->mutex);
+	entry=cache_table_lookup(cache, shard, hash, id);
+	if (entry && (entry->where == &shard->t1 || entry->where == &shard->t2))
+		ret=cache_hit(cache, shard, entry);
+	g_mutex_unlock(&shard->mutex);
+	return ret;
+}
+
+/* Must be called with the mutex of the shard held */
+static void *
+cache_lookup_shard(struct cache *cache, struct cache_shard *shard, unsigned int hash, void *id)
+{
 	struct cache_entry *entry;
 
 	dbg(lvl_debug,"get %d\n", ((int *)id)[0]);
-	entry=g_hash_table_lookup(cache->hash, id);
+	entry=cache_table_lookup(cache, shard, hash, id);
 	if (entry == NULL) {
-		cache->insert=&cache->t1;
+		shard->insert=&shard->t1;
 #ifdef DEBUG_CACHE
 		fprintf(stderr,"-");
 #endif
@@ -303,66 +490,85 @@ cache_lookup(struct cache *cache, void *id) {
 		return NULL;
 	}
 	dbg(lvl_debug,"found 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	if (entry->where == &cache->t1 || entry->where == &cache->t2) {
-		cache->hits+=entry->size;
-#ifdef DEBUG_CACHE
-		if (entry->where == &cache->t1)
-			fprintf(stderr,"h");
-		else
-			fprintf(stderr,"H");
-#endif
-		dbg(lvl_debug,"in cache %s\n", entry->where == &cache->t1 ? "T1" : "T2");
-		cache_remove_from_list(entry->where, entry);
-		cache_insert_mru(NULL, &cache->t2, entry);
-		entry->usage++;
-		return &entry->id[cache->id_size];
+	if (entry->where == &shard->t1 || entry->where == &shard->t2) {
+		return cache_hit(cache, shard, entry);
 	} else {
-		if (entry->where == &cache->b1) {
+		if (entry->where == &shard->b1) {
 #ifdef DEBUG_CACHE
 			fprintf(stderr,"m");
 #endif
 			dbg(lvl_debug,"in phantom cache B1\n");
-			cache->t1_target=MIN(cache->t1_target+MAX(cache->b2.size/cache->b1.size, 1),cache->size);
-			cache_remove_from_list(&cache->b1, entry);
-		} else if (entry->where == &cache->b2) {
+			shard->t1_target=MIN(shard->t1_target+MAX(shard->b2.size/shard->b1.size, 1),shard->size);
+			cache_remove_from_list(&shard->b1, entry);
+		} else if (entry->where == &shard->b2) {
 #ifdef DEBUG_CACHE
 			fprintf(stderr,"M");
 #endif
 			dbg(lvl_debug,"in phantom cache B2\n");
-			cache->t1_target=MAX(cache->t1_target-MAX(cache->b1.size/cache->b2.size, 1),0);
-			cache_remove_from_list(&cache->b2, entry);
+			shard->t1_target=MAX(shard->t1_target-MAX(shard->b1.size/shard->b2.size, 1),0);
+			cache_remove_from_list(&shard->b2, entry);
 		} else {
 			dbg(lvl_error,"**ERROR** invalid where\n");
 		}
-		cache_replace(cache);
-		cache_remove(cache, entry);
-		cache->insert=&cache->t2;
+		cache_replace(cache, shard);
+		cache_remove(shard, entry);
+		shard->insert=&shard->t2;
 		return NULL;
 	}
 }
 
-void
-cache_insert(struct cache *cache, void *data)
+void *
+cache_lookup(struct cache *cache, void *id) {
+	unsigned int hash=cache_hash(cache, id);
+	struct cache_shard *shard=cache_shard(cache, hash);
+	void *ret;
+
+	g_mutex_lock(&shard->mutex);
+	ret=cache_lookup_shard(cache, shard, hash, id);
+	g_mutex_unlock(&shard->mutex);
+	return ret;
+}
+
+/* Must be called with the mutex of the shard held */
+static void
+cache_insert_shard(struct cache *cache, struct cache_shard *shard, struct cache_entry *entry)
 {
-	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
 	dbg(lvl_debug,"insert 0x%x 0x%x 0x%x 0x%x 0x%x\n", entry->id[0], entry->id[1], entry->id[2], entry->id[3], entry->id[4]);
-	if (cache->insert == &cache->t1) {
-		if (cache->t1.size + cache->b1.size >= cache->size) {
-			if (cache->t1.size < cache->size) {
-				cache_remove_lru(cache, &cache->b1);
-				cache_replace(cache);
+	shard->misses+=entry->size;
+	if (shard->insert == &shard->t1) {
+		if (shard->t1.size + shard->b1.size >= shard->size) {
+			if (shard->t1.size < shard->size) {
+				cache_remove_lru(shard, &shard->b1);
+				cache_replace(cache, shard);
 			} else {
-				cache_remove_lru(cache, &cache->t1);
+				cache_remove_lru(shard, &shard->t1);
 			}
 		} else {
-			if (cache->t1.size + cache->t2.size + cache->b1.size + cache->b2.size >= cache->size) {
-				if (cache->t1.size + cache->t2.size + cache->b1.size + cache->b2.size >= 2*cache->size) 
-					cache_remove_lru(cache, &cache->b2);
-				cache_replace(cache);
+			if (shard->t1.size + shard->t2.size + shard->b1.size + shard->b2.size >= shard->size) {
+				if (shard->t1.size + shard->t2.size + shard->b1.size + shard->b2.size >= 2*shard->size)
+					cache_remove_lru(shard, &shard->b2);
+				cache_replace(cache, shard);
 			}
 		}
 	}
-	cache_insert_mru(cache, cache->insert, entry);
+	cache_insert_mru(shard, shard->insert ? shard->insert : &shard->t1, entry);
+}
+
+/**
+ * @brief Inserts an entry created by cache_entry_new()
+ *
+ * The list the entry goes to is decided by the last cache_lookup() of the shard, so
+ * callers inserting from several threads should use cache_insert_unique() instead.
+ */
+void
+cache_insert(struct cache *cache, void *data)
+{
+	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
+	struct cache_shard *shard=cache_shard(cache, entry->hash);
+
+	g_mutex_lock(&shard->mutex);
+	cache_insert_shard(cache, shard, entry);
+	g_mutex_unlock(&shard->mutex);
 }
 
 void *
@@ -370,26 +576,60 @@ cache_insert_new(struct cache *cache, void *id, int size)
 {
 	void *data=cache_entry_new(cache, id, size);
 	cache_insert(cache, data);
-	return data;	
+	return data;
+}
+
+/**
+ * @brief Inserts an entry created by cache_entry_new() unless its id was cached in the meantime
+ *
+ * @param cache The cache
+ * @param data The data of the new entry, freed if it is not inserted
+ * @return The cached data, data if it was inserted
+ */
+void *
+cache_insert_unique(struct cache *cache, void *data)
+{
+	struct cache_entry *entry=(struct cache_entry *)((char *)data-cache->entry_size);
+	struct cache_shard *shard=cache_shard(cache, entry->hash);
+	void *ret;
+
+	g_mutex_lock(&shard->mutex);
+	ret=cache_lookup_shard(cache, shard, entry->hash, entry->id);
+	if (!ret) {
+		cache_insert_shard(cache, shard, entry);
+		ret=data;
+	}
+	g_mutex_unlock(&shard->mutex);
+	if (ret != data)
+		cache_entry_free(cache, data);
+	return ret;
 }
 
 static void
-cache_stats(struct cache *cache)
+cache_stats(struct cache *cache, struct cache_shard *shard)
 {
-	dbg(lvl_debug,"hits %d misses %d hitratio %d size %d entry_size %d id_size %d T1 target %d\n", cache->hits, cache->misses, cache->hits*100/(cache->hits+cache->misses), cache->size, cache->entry_size, cache->id_size, cache->t1_target);
-	dbg(lvl_debug,"T1:%d B1:%d T2:%d B2:%d\n", cache->t1.size, cache->b1.size, cache->t2.size, cache->b2.size);
-	cache->hits=0;
-	cache->misses=0;
+	dbg(lvl_debug,"hits %d misses %d hitratio %d size %d entry_size %d id_size %d T1 target %d\n", shard->hits, shard->misses, shard->hits*100/(shard->hits+shard->misses), shard->size, cache->entry_size, cache->id_size, shard->t1_target);
+	dbg(lvl_debug,"T1:%d B1:%d T2:%d B2:%d\n", shard->t1.size, shard->b1.size, shard->t2.size, shard->b2.size);
+	shard->hits=0;
+	shard->misses=0;
 }
 
 void
 cache_dump(struct cache *cache)
 {
-	cache_stats(cache);
-	cache_list_dump("T1", cache, &cache->t1);
-	cache_list_dump("B1", cache, &cache->b1);
-	cache_list_dump("T2", cache, &cache->t2);
-	cache_list_dump("B2", cache, &cache->b2);
+	struct cache_shard *shard;
+	int i;
+
+	for (i = 0 ; i < 1 << cache->shard_bits ; i++) {
+		shard=&cache->shards[i];
+		g_mutex_lock(&shard->mutex);
+		dbg(lvl_debug,"shard %d\n", i);
+		cache_stats(cache, shard);
+		cache_list_dump("T1", cache, &shard->t1);
+		cache_list_dump("B1", cache, &shard->b1);
+		cache_list_dump("T2", cache, &shard->t2);
+		cache_list_dump("B2", cache, &shard->b2);
+		g_mutex_unlock(&shard->mutex);
+	}
 	dbg(lvl_debug,"dump end\n");
 }
-
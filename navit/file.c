@@ -24,6 +24,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <wordexp.h>
 #include <glib.h>
@@ -35,6 +36,9 @@
 #include "item.h"
 #include "util.h"
 #include "zipfile.h"
+#include "lz4.h"
+#include "tilecache.h"
+#include "endianess.h"
 #include <sys/socket.h>
 #include <netdb.h>
 
@@ -42,7 +46,12 @@ extern char *version;
 
 static GHashTable *file_name_hash;
 
+/* Can be used from several threads, data is read and inflated outside of it, so map data can be read from worker threads */
 static struct cache *file_cache;
+/* Protects file_uncompressed_bytes and serializes writes */
+static GMutex file_mutex;
+/* Number of bytes decompressed when reading compressed data, protected by file_mutex */
+static long long file_uncompressed_bytes;
 
 struct file_cache_id {
 	long long offset;
@@ -268,40 +277,140 @@ file_mmap(struct file *file)
 	int mmap_size=file->size;
 	file->begin=mmap(NULL, mmap_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, file->fd, 0);
 	dbg_assert(file->begin != NULL);
-	if (file->begin == (void *)0xffffffff) {
+	if (file->begin == MAP_FAILED) {
 		perror("mmap");
+		file->begin=NULL;
 		return 0;
 	}
-	dbg_assert(file->begin != (void *)0xffffffff);
 	file->mmap_end=file->begin+mmap_size;
 	file->end=file->begin+file->size;
 
 	return 1;
 }
 
+/**
+ * @brief Tells the kernel that a memory mapped file is accessed in random order
+ *
+ * This disables the readahead, so a page fault reads only the page faulted. Ranges
+ * which will be needed can be announced with file_data_prefetch(). Has no effect
+ * if the file is not memory mapped.
+ */
+void
+file_advise_random(struct file *file)
+{
+	if (file->begin)
+		madvise(file->begin, file->mmap_end-file->begin, MADV_RANDOM);
+}
+
+/**
+ * @brief Starts reading a range of a memory mapped file in the background
+ *
+ * Has no effect if the file is not memory mapped.
+ *
+ * @param file The file
+ * @param offset Offset of the range
+ * @param size Size of the range
+ */
+void
+file_data_prefetch(struct file *file, long long offset, int size)
+{
+	unsigned char *start,*end;
+
+	if (!file->begin)
+		return;
+	start=file->begin+(offset & ~(long long)(getpagesize()-1));
+	end=MIN(file->begin+offset+size, file->mmap_end);
+	if (start < end)
+		madvise(start, end-start, MADV_WILLNEED);
+}
+
+static void
+file_data_release(struct file *file, unsigned char *data)
+{
+	if (file->cache && data) {
+		cache_entry_destroy(file_cache, data);
+	} else
+		g_free(data);
+}
+
+/**
+ * @brief Looks up data of a file in the cache
+ *
+ * @param file The file
+ * @param id The id of the data
+ * @param size The size of the data
+ * @param cached Returns 1 if the data is cached, 0 if it has to be read
+ * @return The cached data, or a buffer for the data which is to be filled and passed
+ * to file_cache_insert() or file_cache_discard()
+ */
+static void *
+file_cache_lookup(struct file *file, struct file_cache_id *id, int size, int *cached)
+{
+	void *ret=NULL;
+
+	if (file->cache)
+		ret=cache_peek(file_cache, id);
+	*cached=ret != NULL;
+	if (ret)
+		return ret;
+	if (file->cache)
+		return cache_entry_new(file_cache, id, size);
+	return g_malloc(size);
+}
+
+/**
+ * @brief Caches data which was read after file_cache_lookup() did not find it
+ *
+ * If another thread cached the same data in the meantime, that data is returned and data is freed.
+ *
+ * @param file The file
+ * @param data The data
+ * @param uncompressed Number of bytes decompressed to get the data
+ * @return The data to use
+ */
+static void *
+file_cache_insert(struct file *file, void *data, int uncompressed)
+{
+	if (file->cache)
+		data=cache_insert_unique(file_cache, data);
+	if (uncompressed) {
+		g_mutex_lock(&file_mutex);
+		file_uncompressed_bytes+=uncompressed;
+		g_mutex_unlock(&file_mutex);
+	}
+	return data;
+}
+
+/**
+ * @brief Frees a buffer returned by file_cache_lookup() which could not be filled
+ */
+static void
+file_cache_discard(struct file *file, void *data)
+{
+	if (file->cache)
+		cache_entry_free(file_cache, data);
+	else
+		g_free(data);
+}
+
 unsigned char *
 file_data_read(struct file *file, long long offset, int size)
 {
+	struct file_cache_id id={offset,size,file->name_id,0};
 	void *ret;
+	int cached;
 	if (file->special)
 		return NULL;
 	if (file->begin)
 		return file->begin+offset;
-	if (file->cache) {
-		struct file_cache_id id={offset,size,file->name_id,0};
-		ret=cache_lookup(file_cache,&id); 
-		if (ret)
-			return ret;
-		ret=cache_insert_new(file_cache,&id,size);
-	} else
-		ret=g_malloc(size);
-	lseek(file->fd, offset, SEEK_SET);
-	if (read(file->fd, ret, size) != size) {
-		file_data_free(file, ret);
-		ret=NULL;
+	ret=file_cache_lookup(file, &id, size, &cached);
+	if (cached)
+		return ret;
+	if (pread(file->fd, ret, size, offset) != size) {
+		file_cache_discard(file, ret);
+		return NULL;
 	}
-	return ret;
-
+	return file_cache_insert(file, ret, 0);
 }
 
 static void
@@ -414,13 +523,16 @@ file_data_flush(struct file *file, long long offset, int size)
 int
 file_data_write(struct file *file, long long offset, int size, const void *data)
 {
+	int ret=1;
 	file_data_flush(file, offset, size);
+	g_mutex_lock(&file_mutex);
 	lseek(file->fd, offset, SEEK_SET);
 	if (write(file->fd, data, size) != size)
-		return 0;
-	if (file->size < offset+size)
+		ret=0;
+	else if (file->size < offset+size)
 		file->size=offset+size;
-	return 1;
+	g_mutex_unlock(&file_mutex);
+	return ret;
 }
 
 int
@@ -438,69 +550,357 @@ file_get_contents(char *name, unsigned char **buffer, int *size)
 }
 
 
+/* Input buffers of up to this size are kept by a thread for the next read, larger ones are freed after use */
+#define FILE_INFLATE_BUFFER_KEEP 262144
+
+/**
+ * @brief Per-thread state for reading and inflating compressed data
+ *
+ * The zlib stream is initialized once and reset between reads, and the buffer for
+ * the compressed data is reused, so a read does not allocate anything.
+ */
+struct file_inflate {
+	z_stream stream;
+	unsigned char *buffer;
+	int buffer_size;
+};
+
+static void
+file_inflate_free(gpointer data)
+{
+	struct file_inflate *ctx=data;
+
+	inflateEnd(&ctx->stream);
+	g_free(ctx->buffer);
+	g_free(ctx);
+}
+
+static GPrivate file_inflate_private=G_PRIVATE_INIT(file_inflate_free);
+
+/**
+ * @brief Returns the inflate state of the calling thread, creating it on first use
+ *
+ * @return The state, or NULL if zlib could not be initialized
+ */
+static struct file_inflate *
+file_inflate_get(void)
+{
+	struct file_inflate *ctx=g_private_get(&file_inflate_private);
+
+	if (ctx)
+		return ctx;
+	ctx=g_new0(struct file_inflate, 1);
+	if (inflateInit2(&ctx->stream, -MAX_WBITS) != Z_OK) {
+		dbg(lvl_error,"inflateInit2 failed\n");
+		g_free(ctx);
+		return NULL;
+	}
+	g_private_set(&file_inflate_private, ctx);
+	return ctx;
+}
+
+/**
+ * @brief Returns a buffer of at least size bytes, which is valid until file_inflate_release()
+ */
+static unsigned char *
+file_inflate_buffer(struct file_inflate *ctx, int size)
+{
+	if (size > ctx->buffer_size) {
+		g_free(ctx->buffer);
+		ctx->buffer=g_malloc(size);
+		ctx->buffer_size=size;
+	}
+	return ctx->buffer;
+}
+
+static void
+file_inflate_release(struct file_inflate *ctx)
+{
+	if (ctx->buffer_size > FILE_INFLATE_BUFFER_KEEP) {
+		g_free(ctx->buffer);
+		ctx->buffer=NULL;
+		ctx->buffer_size=0;
+	}
+}
+
+/**
+ * @brief Inflates raw deflate data
+ *
+ * @param ctx The inflate state of the calling thread
+ * @param dest Buffer for the inflated data
+ * @param destLen Size of dest
+ * @param source The deflated data
+ * @param sourceLen Size of the deflated data
+ * @return The number of bytes inflated, or -1 if the data is corrupt or does not fit into dest
+ */
 static int
-uncompress_int(Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen)
+file_inflate(struct file_inflate *ctx, unsigned char *dest, int destLen, unsigned char *source, int sourceLen)
 {
-	z_stream stream;
+	z_stream *stream=&ctx->stream;
 	int err;
 
-	stream.next_in = (Bytef*)source;
-	stream.avail_in = (uInt)sourceLen;
-	stream.next_out = dest;
-	stream.avail_out = (uInt)*destLen;
+	if (inflateReset(stream) != Z_OK)
+		return -1;
+	stream->next_in = source;
+	stream->avail_in = (uInt)sourceLen;
+	stream->next_out = dest;
+	stream->avail_out = (uInt)destLen;
 
-	stream.zalloc = (alloc_func)0;
-	stream.zfree = (free_func)0;
+	err = inflate(stream, Z_FINISH);
+	if (err != Z_STREAM_END) {
+		dbg(lvl_error,"uncompress failed: %d\n", err);
+		return -1;
+	}
+	return stream->total_out;
+}
 
-	err = inflateInit2(&stream, -MAX_WBITS);
-	if (err != Z_OK) return err;
+/**
+ * @brief Decompresses data stored with a zip compression method
+ *
+ * @param method 8 for deflate or zip_method_lz4
+ * @return The number of bytes decompressed, or -1 on failure
+ */
+static int
+file_decode(struct file_inflate *ctx, int method, unsigned char *dest, int destLen, unsigned char *source, int sourceLen)
+{
+	int ret;
 
-	err = inflate(&stream, Z_FINISH);
-	if (err != Z_STREAM_END) {
-	inflateEnd(&stream);
-	if (err == Z_NEED_DICT || (err == Z_BUF_ERROR && stream.avail_in == 0))
-		return Z_DATA_ERROR;
-		return err;
+	if (method == 8)
+		return file_inflate(ctx, dest, destLen, source, sourceLen);
+	if (method != zip_method_lz4) {
+		dbg(lvl_error,"unknown compression method %d\n", method);
+		return -1;
+	}
+	ret=lz4_decompress(source, sourceLen, dest, destLen);
+	if (ret < 0)
+		dbg(lvl_error,"lz4 decompression failed\n");
+	return ret;
+}
+
+/**
+ * @brief Reads and decompresses data into a buffer owned by the caller
+ *
+ * The data is not cached.
+ *
+ * @param file The file
+ * @param offset Offset of the compressed data
+ * @param size Size of the compressed data
+ * @param dest Buffer for the decompressed data
+ * @param size_uncomp Size of dest
+ * @param method The zip compression method, 8 for deflate or zip_method_lz4
+ * @return The number of bytes decompressed, or -1 on failure
+ */
+static int
+file_read_decode(struct file *file, long long offset, int size, unsigned char *dest, int size_uncomp, int method)
+{
+	struct file_inflate *ctx=file_inflate_get();
+	unsigned char *buffer;
+	int ret=-1;
+
+	if (!ctx)
+		return -1;
+	if (file->begin && file->begin+offset+size <= file->end)
+		buffer=file->begin+offset;
+	else {
+		buffer=file_inflate_buffer(ctx, size);
+		if (pread(file->fd, buffer, size, offset) != size)
+			buffer=NULL;
+	}
+	if (buffer)
+		ret=file_decode(ctx, method, dest, size_uncomp, buffer, size);
+	file_inflate_release(ctx);
+	return ret;
+}
+
+/**
+ * @brief Reads deflated data and inflates it into a buffer owned by the caller
+ *
+ * Unlike file_data_read_compressed(), the data is neither looked up in nor added to
+ * the cache, so this suits callers which keep the data themselves.
+ *
+ * @param file The file
+ * @param offset Offset of the deflated data
+ * @param size Size of the deflated data
+ * @param dest Buffer for the inflated data
+ * @param size_uncomp Size of dest
+ * @return The number of bytes inflated, or -1 on failure
+ */
+int
+file_data_read_compressed_into(struct file *file, long long offset, int size, unsigned char *dest, int size_uncomp)
+{
+	int ret;
+
+	if (file->special)
+		return -1;
+	ret=file_read_decode(file, offset, size, dest, size_uncomp, 8);
+	if (ret > 0) {
+		g_mutex_lock(&file_mutex);
+		file_uncompressed_bytes+=ret;
+		g_mutex_unlock(&file_mutex);
 	}
-	*destLen = stream.total_out;
+	return ret;
+}
 
-	err = inflateEnd(&stream);
-	return err;
+static unsigned char *
+file_data_read_decoded(struct file *file, long long offset, int size, int size_uncomp, int method)
+{
+	struct file_cache_id id={offset,size,file->name_id,method};
+	void *ret;
+	int cached,len;
+
+	ret=file_cache_lookup(file, &id, size_uncomp, &cached);
+	if (cached)
+		return ret;
+	if (file->tile_cache && tile_cache_get(file->tile_cache, offset, ret, size_uncomp))
+		return file_cache_insert(file, ret, 0);
+	len=file_read_decode(file, offset, size, ret, size_uncomp, method);
+	if (len < 0) {
+		file_cache_discard(file, ret);
+		return NULL;
+	}
+	if (file->tile_cache && len == size_uncomp)
+		tile_cache_put(file->tile_cache, offset, ret, len);
+	return file_cache_insert(file, ret, len);
 }
 
 unsigned char *
 file_data_read_compressed(struct file *file, long long offset, int size, int size_uncomp)
 {
-	void *ret;
-	char *buffer = 0;
-	uLongf destLen=size_uncomp;
+	return file_data_read_decoded(file, offset, size, size_uncomp, 8);
+}
 
-	if (file->cache) {
-		struct file_cache_id id={offset,size,file->name_id,1};
-		ret=cache_lookup(file_cache,&id); 
-		if (ret)
-			return ret;
-		ret=cache_insert_new(file_cache,&id,size_uncomp);
-	} else 
-		ret=g_malloc(size_uncomp);
-	lseek(file->fd, offset, SEEK_SET);
+/**
+ * @brief Reads and caches data compressed with zip_method_lz4
+ *
+ * @param file The file
+ * @param offset Offset of the compressed data
+ * @param size Size of the compressed data
+ * @param size_uncomp Size of the data after decompression
+ * @return The data, or NULL on failure
+ */
+unsigned char *
+file_data_read_lz4(struct file *file, long long offset, int size, int size_uncomp)
+{
+	return file_data_read_decoded(file, offset, size, size_uncomp, zip_method_lz4);
+}
 
-	buffer = (char *)g_malloc(size);
-	if (read(file->fd, buffer, size) != size) {
-		g_free(ret);
+static int
+file_zip_lfh_check(unsigned char *data, int header)
+{
+	struct zip_lfh *lfh=(struct zip_lfh *)data;
+	return le32_to_cpu(lfh->ziplocsig) == zip_lfh_sig &&
+	       (int)sizeof(*lfh)+le16_to_cpu(lfh->zipfnln)+le16_to_cpu(lfh->zipxtraln) == header;
+}
+
+/**
+ * @brief Checks the local file header of a member read by file_data_read_zip_member()
+ *
+ * Stored members of page aligned maps have an extra field which was not expected. If
+ * the file is not mapped, their data is read again from behind the extra field.
+ *
+ * @param data The local file header read
+ * @param header The expected length of the local file header without extra field
+ * @param dest Buffer of size bytes the stored data was read to
+ * @return 1 if the header is valid and dest holds the data
+ */
+static int
+file_zip_lfh_check_aligned(struct file *file, unsigned char *data, int header, int method, long long offset, int size,
+			   void *dest)
+{
+	struct zip_lfh *lfh=(struct zip_lfh *)data;
+	int extra=le16_to_cpu(lfh->zipxtraln);
+
+	if (file_zip_lfh_check(data, header))
+		return 1;
+	if (method || !extra || !file_zip_lfh_check(data, header+extra))
+		return 0;
+	return pread(file->fd, dest, size, offset+header+extra) == size;
+}
+
+/**
+ * @brief Reads a member of a zip file with a single read
+ *
+ * The local file header is read together with the data of the member, so no separate
+ * reads of the header and the file name are needed. The data is cached like the data
+ * returned by file_data_read(), file_data_read_compressed() and file_data_read_lz4().
+ *
+ * @param file The zip file
+ * @param offset Offset of the local file header of the member
+ * @param header Expected length of the local file header including the file name. Only stored
+ * members may have an extra field, it is skipped.
+ * @param size Size of the data as stored in the file
+ * @param size_uncomp Size of the data after decompression
+ * @param method The zip compression method: 0 if the data is stored, 8 if it is deflated or zip_method_lz4
+ * @return The data, or NULL if it could not be read or the local file header
+ * is not as long as expected
+ */
+unsigned char *
+file_data_read_zip_member(struct file *file, long long offset, int header, int size, int size_uncomp, int method)
+{
+	struct file_cache_id id={offset+header,size,file->name_id,method};
+	struct file_inflate *ctx;
+	void *ret;
+	unsigned char *buffer;
+	struct iovec iov[2];
+	int cached,len=0;
+
+	if (file->special)
+		return NULL;
+	if (file->begin && !method) {
+		/* Used in place, the extra field may pad the header to align the data */
+		struct zip_lfh *lfh=(struct zip_lfh *)(file->begin+offset);
+		if (!file_zip_lfh_check(file->begin+offset, header+le16_to_cpu(lfh->zipxtraln)))
+			return NULL;
+		header+=le16_to_cpu(lfh->zipxtraln);
+		if (file->begin+offset+header+size > file->end)
+			return NULL;
+		return file->begin+offset+header;
+	}
+	ctx=file_inflate_get();
+	if (!ctx)
+		return NULL;
+	ret=file_cache_lookup(file, &id, size_uncomp, &cached);
+	if (cached)
+		return ret;
+	if (method && file->tile_cache && tile_cache_get(file->tile_cache, offset+header, ret, size_uncomp)) {
+		file_inflate_release(ctx);
+		return file_cache_insert(file, ret, 0);
+	}
+	/* Compressed data goes to a buffer together with the header, stored data directly to its destination */
+	buffer=file_inflate_buffer(ctx, header+(method ? size:0));
+	iov[0].iov_base=buffer;
+	iov[0].iov_len=header+(method ? size:0);
+	iov[1].iov_base=ret;
+	iov[1].iov_len=method ? 0:size;
+	if (preadv(file->fd, iov, 2, offset) != header+size || !file_zip_lfh_check_aligned(file, buffer, header, method, offset, size, ret)
+	    || (method && (len=file_decode(ctx, method, ret, size_uncomp, buffer+header, size)) < 0)) {
+		file_cache_discard(file, ret);
 		ret=NULL;
 	} else {
-		if (uncompress_int(ret, &destLen, (Bytef *)buffer, size) != Z_OK) {
-			dbg(lvl_error,"uncompress failed\n");
-			g_free(ret);
-			ret=NULL;
-		}
+		if (method && file->tile_cache && len == size_uncomp)
+			tile_cache_put(file->tile_cache, offset+header, ret, len);
+		ret=file_cache_insert(file, ret, len);
 	}
-	g_free(buffer);
+	file_inflate_release(ctx);
 
 	return ret;
 }
 
+/**
+ * @brief Returns the number of bytes decompressed since startup
+ *
+ * Cache hits are not counted, so this measures the decompression work actually done.
+ */
+long long
+file_get_uncompressed_bytes(void)
+{
+	long long ret;
+	g_mutex_lock(&file_mutex);
+	ret=file_uncompressed_bytes;
+	g_mutex_unlock(&file_mutex);
+	return ret;
+}
+
 unsigned char *
 file_data_read_encrypted(struct file *file, long long offset, int size, int size_uncomp, int compressed, char *passwd)
 {
@@ -516,10 +916,7 @@ file_data_free(struct file *file, unsigned char *data)
 		if (data >= file->begin && data < file->end)
 			return;
 	}
-	if (file->cache && data) {
-		cache_entry_destroy(file_cache, data);
-	} else
-		g_free(data);
+	file_data_release(file, data);
 }
 
 void
@@ -46,6 +46,7 @@ struct file {
 	unsigned char *buffer;
 	int buffer_len;
 	GHashTable *headers;
+	struct tile_cache *tile_cache;	/**< Persistent cache of decompressed data, may be NULL */
 };
 
 struct attr;
@@ -58,6 +59,8 @@ int file_is_dir(char *name);
 long long file_size(struct file *file);
 int file_mkdir(char *name, int pflag);
 int file_mmap(struct file *file);
+void file_advise_random(struct file *file);
+void file_data_prefetch(struct file *file, long long offset, int size);
 unsigned char *file_data_read(struct file *file, long long offset, int size);
 unsigned char *file_data_read_special(struct file *file, int size, int *size_ret);
 unsigned char *file_data_read_all(struct file *file);
@@ -65,6 +68,10 @@ void file_data_flush(struct file *file, long long offset, int size);
 int file_data_write(struct file *file, long long offset, int size, const void *data);
 int file_get_contents(char *name, unsigned char **buffer, int *size);
 unsigned char *file_data_read_compressed(struct file *file, long long offset, int size, int size_uncomp);
+int file_data_read_compressed_into(struct file *file, long long offset, int size, unsigned char *dest, int size_uncomp);
+unsigned char *file_data_read_lz4(struct file *file, long long offset, int size, int size_uncomp);
+unsigned char *file_data_read_zip_member(struct file *file, long long offset, int header, int size, int size_uncomp, int method);
+long long file_get_uncompressed_bytes(void);
 unsigned char *file_data_read_encrypted(struct file *file, long long offset, int size, int size_uncomp, int compressed, char *passwd);
 void file_data_free(struct file *file, unsigned char *data);
 int file_exists(char const *name);
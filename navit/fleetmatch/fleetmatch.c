@@ -0,0 +1,266 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2011 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file fleetmatch.c
+ *
+ * @brief Matches recorded traces of many vehicles to the streets of binfile maps
+ *
+ * Every trace is matched by its own tracking object created with tracking_new_batch(),
+ * so the fixes are scored exactly like navit does while driving. The traces are matched
+ * in parallel by a pool of worker threads sharing the maps. Each worker takes the next
+ * unmatched trace when it is done with the previous one, largest traces first, so the
+ * workers stay busy until the last trace is taken.
+ *
+ * For every fix one tab separated line is written to stdout, in the order of the traces
+ * on the command line:
+ * trace, fix number, time, latitude, longitude, speed, street type, street id (hi, lo, both 0 if
+ * the street was read from a speed index), maxspeed (-1 if unknown) and 1 if the speed was above
+ * the maxspeed.
+ */
+
+struct navit;
+void module_map_binfile_init(void);
+void builtin_init(void) {
+    module_map_binfile_init();
+}
+void graphics_new(struct navit *nav) {
+    (void)nav;
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "debug.h"
+#include "item.h"
+#include "attr.h"
+#include "coord.h"
+#include "map.h"
+#include "mapset.h"
+#include "main.h"
+#include "file.h"
+#include "track.h"
+#include "trace.h"
+
+struct fleetmatch_trace {
+	char *filename;
+	long long size;
+	GString *out;			/**< Output of the trace, set once it is matched */
+	int fixes;
+	int matched;
+	int speeding;
+};
+
+struct fleetmatch {
+	struct mapset *ms;
+	struct fleetmatch_trace *traces;
+	int count;
+	int *order;			/**< Indices of the traces, largest first */
+	int next;			/**< Position in order of the next trace to match */
+	GMutex out_mutex;		/**< Protects next_out, the output and the totals */
+	int next_out;			/**< Index of the next trace to write */
+	int fixes;
+	int matched;
+	int speeding;
+};
+
+static void
+usage(void)
+{
+	FILE *f=stdout;
+	fprintf(f,"\n");
+	fprintf(f,"navit-fleetmatch - match recorded GPS traces to the streets of binfile maps\n\n");
+	fprintf(f,"Usage:\n");
+	fprintf(f,"navit-fleetmatch -m map.bin [-m map2.bin] trace.nmea trace.gpx ...\n");
+	fprintf(f,"Available switches:\n");
+	fprintf(f,"-h (--help)                       : this screen\n");
+	fprintf(f,"-j (--threads) <count>            : number of worker threads, default is the number of processors\n");
+	fprintf(f,"-m (--map) <file>                 : binfile map to match against, may be given several times\n");
+}
+
+static int
+fleetmatch_compare_size(const void *a, const void *b, void *data)
+{
+	struct fleetmatch_trace *traces=data;
+	long long sa=traces[*(const int *)a].size, sb=traces[*(const int *)b].size;
+
+	if (sa != sb)
+		return sa > sb ? -1 : 1;
+	return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Matches all fixes of a trace
+ *
+ * @return The output lines of the trace
+ */
+static GString *
+fleetmatch_trace_match(struct fleetmatch *fm, struct fleetmatch_trace *t)
+{
+	GArray *fixes=trace_load(t->filename);
+	GString *out=g_string_new(NULL);
+	struct tracking *tr;
+	struct tracking_match m;
+	struct trace_fix *fix;
+	int i,speeding;
+
+	if (!fixes)
+		return out;
+	tr=tracking_new_batch(fm->ms);
+	for (i = 0 ; i < fixes->len ; i++) {
+		fix=&g_array_index(fixes, struct trace_fix, i);
+		/* Off the road the street is only the nearest one, not the one driven on */
+		if (tracking_match_position(tr, &fix->geo, fix->speed, fix->direction, &m) && !m.offroad)
+			t->matched++;
+		else {
+			memset(&m.item, 0, sizeof(m.item));
+			m.maxspeed=-1;
+		}
+		speeding=m.maxspeed > 0 && fix->speed > m.maxspeed;
+		t->speeding+=speeding;
+		g_string_append_printf(out, "%s\t%d\t%s\t%.6f\t%.6f\t%.1f\t%s\t%d\t%d\t%d\t%d\n", t->filename, i, fix->time,
+				       fix->geo.lat, fix->geo.lng, fix->speed, item_to_name(m.item.type), m.item.id_hi, m.item.id_lo,
+				       m.maxspeed, speeding);
+	}
+	t->fixes=fixes->len;
+	tracking_destroy(tr);
+	g_array_free(fixes, TRUE);
+	return out;
+}
+
+/**
+ * @brief Stores the output of a matched trace and writes the output of all traces
+ * which are matched and not preceded by an unmatched one
+ */
+static void
+fleetmatch_output(struct fleetmatch *fm, struct fleetmatch_trace *t, GString *out)
+{
+	g_mutex_lock(&fm->out_mutex);
+	t->out=out;
+	fm->fixes+=t->fixes;
+	fm->matched+=t->matched;
+	fm->speeding+=t->speeding;
+	while (fm->next_out < fm->count && fm->traces[fm->next_out].out) {
+		t=&fm->traces[fm->next_out++];
+		fwrite(t->out->str, t->out->len, 1, stdout);
+		g_string_free(t->out, TRUE);
+		t->out=NULL;
+	}
+	g_mutex_unlock(&fm->out_mutex);
+}
+
+static gpointer
+fleetmatch_worker(gpointer data)
+{
+	struct fleetmatch *fm=data;
+	struct fleetmatch_trace *t;
+	int i;
+
+	while ((i=g_atomic_int_add(&fm->next, 1)) < fm->count) {
+		t=&fm->traces[fm->order[i]];
+		fleetmatch_output(fm, t, fleetmatch_trace_match(fm, t));
+	}
+	return NULL;
+}
+
+static struct map *
+fleetmatch_map_new(char *filename)
+{
+	struct attr type={attr_type,{"binfile"}}, data={attr_data,{filename}};
+	struct attr *attrs[]={&type,&data,NULL};
+
+	return map_new(NULL, attrs);
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"help", 0, 0, 'h'},
+		{"threads", 1, 0, 'j'},
+		{"map", 1, 0, 'm'},
+		{0, 0, 0, 0}
+	};
+	struct fleetmatch fm;
+	struct attr map_attr;
+	struct stat st;
+	GThread **workers;
+	gint64 start;
+	double elapsed;
+	int c,i,threads=g_get_num_processors(),maps=0;
+
+	main_init(argv[0]);
+	file_init();
+	builtin_init();
+	memset(&fm, 0, sizeof(fm));
+	fm.ms=mapset_new(NULL, NULL);
+	while ((c=getopt_long(argc, argv, "hj:m:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			threads=atoi(optarg);
+			break;
+		case 'm':
+			map_attr.type=attr_map;
+			map_attr.u.map=fleetmatch_map_new(optarg);
+			if (!map_attr.u.map) {
+				fprintf(stderr,"Failed to open map %s\n", optarg);
+				exit(1);
+			}
+			mapset_add_attr(fm.ms, &map_attr);
+			maps++;
+			break;
+		default:
+			usage();
+			exit(c == 'h' ? 0 : 1);
+		}
+	}
+	if (!maps || optind >= argc) {
+		usage();
+		exit(1);
+	}
+	if (threads < 1)
+		threads=1;
+	fm.count=argc-optind;
+	fm.traces=g_new0(struct fleetmatch_trace, fm.count);
+	fm.order=g_new(int, fm.count);
+	for (i = 0 ; i < fm.count ; i++) {
+		fm.traces[i].filename=argv[optind+i];
+		fm.traces[i].size=stat(argv[optind+i], &st) ? 0 : st.st_size;
+		fm.order[i]=i;
+	}
+	g_qsort_with_data(fm.order, fm.count, sizeof(int), fleetmatch_compare_size, fm.traces);
+	g_mutex_init(&fm.out_mutex);
+	threads=MIN(threads, fm.count);
+	workers=g_new(GThread *, threads);
+	start=g_get_monotonic_time();
+	for (i = 0 ; i < threads ; i++)
+		workers[i]=g_thread_new("fleetmatch", fleetmatch_worker, &fm);
+	for (i = 0 ; i < threads ; i++)
+		g_thread_join(workers[i]);
+	elapsed=(g_get_monotonic_time()-start)/1000000.0;
+	fprintf(stderr,"fleetmatch: %d traces, %d fixes, %d matched, %d speeding, %d threads, %.3f s, %.0f fixes/s\n",
+		fm.count, fm.fixes, fm.matched, fm.speeding, threads, elapsed, elapsed > 0 ? fm.fixes/elapsed : 0);
+	g_mutex_clear(&fm.out_mutex);
+	g_free(workers);
+	g_free(fm.order);
+	g_free(fm.traces);
+	return 0;
+}
@@ -628,4 +628,5 @@ ITEM(poly_orchard)
 ITEM(poly_plantnursery)
 ITEM(poly_port)
 ITEM(poly_saltpond)
+ITEM(tile_type_index)
 ITEM2(0xffffffff,last)
@@ -0,0 +1,245 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2011 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file navit_lookup.c
+ *
+ * @brief Looks up the speed limits of positions read from stdin
+ *
+ * Every input line holds a latitude, a longitude and optionally a heading in degrees,
+ * separated by blanks or commas. For every line, including empty and unparsable ones which
+ * are reported as not matched, the line is written to stdout followed
+ * by the type and id of the matched street (0 0 if it was read from a speed index), its
+ * maxspeed (-1 if unknown) and the distance to it in meters, separated by tabs. The lines
+ * are read in chunks which are looked up by a pool of worker threads, the output keeps the
+ * order of the input.
+ */
+
+struct navit;
+void builtin_init(void) {
+}
+void graphics_new(struct navit *nav) {
+    (void)nav;
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <glib.h>
+#include "item.h"
+#include "main.h"
+#include "speedlimit.h"
+
+/* Number of input lines looked up by a worker at once */
+#define LOOKUP_CHUNK_LINES 4096
+/* Number of chunks which may be read ahead of the output */
+#define LOOKUP_CHUNKS_PENDING 64
+
+struct lookup_chunk {
+	int seq;
+	char **lines;
+	int count;
+	GString *out;
+};
+
+struct lookup {
+	struct speedlimit *sl;
+	GAsyncQueue *todo;
+	GMutex mutex;			/**< Protects the members below */
+	GCond cond;
+	struct lookup_chunk *done[LOOKUP_CHUNKS_PENDING];
+	int next_out;			/**< Sequence number of the next chunk to write */
+	long long lookups;
+	long long matched;
+};
+
+/* Chunk which terminates a worker */
+static struct lookup_chunk lookup_quit;
+
+static void
+usage(void)
+{
+	FILE *f=stdout;
+	fprintf(f,"\n");
+	fprintf(f,"navit-lookup - look up the speed limits of the positions read from stdin\n\n");
+	fprintf(f,"Usage:\n");
+	fprintf(f,"navit-lookup -m map.bin [-m map2.bin] < positions.txt\n");
+	fprintf(f,"Input lines consist of latitude, longitude and optionally the heading in degrees.\n");
+	fprintf(f,"Available switches:\n");
+	fprintf(f,"-h (--help)                       : this screen\n");
+	fprintf(f,"-j (--threads) <count>            : number of worker threads, default is the number of processors\n");
+	fprintf(f,"-m (--map) <file>                 : binfile map to look up in, may be given several times\n");
+}
+
+static void
+lookup_line(struct lookup *l, char *line, GString *out, int *matched)
+{
+	struct speedlimit_result r;
+	double lat,lng,heading=0;
+	char *p=line,*end;
+
+	memset(&r, 0, sizeof(r));
+	r.type=type_none;
+	r.maxspeed=-1;
+	lat=g_ascii_strtod(p, &end);
+	if (end != p) {
+		p=end+strspn(end, " \t,");
+		lng=g_ascii_strtod(p, &end);
+		if (end != p) {
+			p=end+strspn(end, " \t,");
+			if (*p)
+				heading=g_ascii_strtod(p, NULL);
+			if (speedlimit_lookup(l->sl, lat, lng, heading, &r))
+				(*matched)++;
+		}
+	}
+	g_string_append_printf(out, "%s\t%s\t%d\t%d\t%d\t%d\n", line, item_to_name(r.type), r.id_hi, r.id_lo,
+			       r.maxspeed, r.distance);
+}
+
+static gpointer
+lookup_worker(gpointer data)
+{
+	struct lookup *l=data;
+	struct lookup_chunk *c;
+	int i,matched;
+
+	while ((c=g_async_queue_pop(l->todo)) != &lookup_quit) {
+		c->out=g_string_new(NULL);
+		matched=0;
+		for (i = 0 ; i < c->count ; i++)
+			lookup_line(l, c->lines[i], c->out, &matched);
+		g_mutex_lock(&l->mutex);
+		l->lookups+=c->count;
+		l->matched+=matched;
+		l->done[c->seq % LOOKUP_CHUNKS_PENDING]=c;
+		while ((c=l->done[l->next_out % LOOKUP_CHUNKS_PENDING]) && c->seq == l->next_out) {
+			fwrite(c->out->str, c->out->len, 1, stdout);
+			l->done[l->next_out++ % LOOKUP_CHUNKS_PENDING]=NULL;
+			g_string_free(c->out, TRUE);
+			g_strfreev(c->lines);
+			g_free(c);
+		}
+		g_cond_broadcast(&l->cond);
+		g_mutex_unlock(&l->mutex);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Reads the next chunk of input lines
+ *
+ * @return The chunk or NULL at the end of the input
+ */
+static struct lookup_chunk *
+lookup_read_chunk(int seq)
+{
+	struct lookup_chunk *c=g_new0(struct lookup_chunk, 1);
+	char *line=NULL;
+	size_t size=0;
+
+	c->seq=seq;
+	c->lines=g_new0(char *, LOOKUP_CHUNK_LINES+1);
+	while (c->count < LOOKUP_CHUNK_LINES && getline(&line, &size, stdin) != -1) {
+		g_strchomp(line);
+		c->lines[c->count++]=g_strdup(line);
+	}
+	free(line);
+	if (!c->count) {
+		g_strfreev(c->lines);
+		g_free(c);
+		return NULL;
+	}
+	return c;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{"help", 0, 0, 'h'},
+		{"threads", 1, 0, 'j'},
+		{"map", 1, 0, 'm'},
+		{0, 0, 0, 0}
+	};
+	struct lookup l;
+	struct lookup_chunk *c;
+	GPtrArray *maps=g_ptr_array_new();
+	GThread **workers;
+	gint64 start;
+	double elapsed;
+	int i,seq=0,threads=g_get_num_processors();
+
+	main_init(argv[0]);
+	speedlimit_init();
+	while ((i=getopt_long(argc, argv, "hj:m:", long_options, NULL)) != -1) {
+		switch (i) {
+		case 'j':
+			threads=atoi(optarg);
+			break;
+		case 'm':
+			g_ptr_array_add(maps, optarg);
+			break;
+		default:
+			usage();
+			exit(i == 'h' ? 0 : 1);
+		}
+	}
+	if (!maps->len || optind != argc) {
+		usage();
+		exit(1);
+	}
+	g_ptr_array_add(maps, NULL);
+	memset(&l, 0, sizeof(l));
+	l.sl=speedlimit_open((char **)maps->pdata);
+	if (!l.sl)
+		exit(1);
+	if (threads < 1)
+		threads=1;
+	l.todo=g_async_queue_new();
+	g_mutex_init(&l.mutex);
+	g_cond_init(&l.cond);
+	workers=g_new(GThread *, threads);
+	start=g_get_monotonic_time();
+	for (i = 0 ; i < threads ; i++)
+		workers[i]=g_thread_new("lookup", lookup_worker, &l);
+	while ((c=lookup_read_chunk(seq))) {
+		g_mutex_lock(&l.mutex);
+		while (seq-l.next_out >= LOOKUP_CHUNKS_PENDING)
+			g_cond_wait(&l.cond, &l.mutex);
+		g_mutex_unlock(&l.mutex);
+		g_async_queue_push(l.todo, c);
+		seq++;
+	}
+	for (i = 0 ; i < threads ; i++)
+		g_async_queue_push(l.todo, &lookup_quit);
+	for (i = 0 ; i < threads ; i++)
+		g_thread_join(workers[i]);
+	elapsed=(g_get_monotonic_time()-start)/1000000.0;
+	fflush(stdout);
+	fprintf(stderr,"navit-lookup: %lld lookups, %lld matched, %d threads, %.3f s, %.0f lookups/s\n",
+		l.lookups, l.matched, threads, elapsed, elapsed > 0 ? l.lookups/elapsed : 0);
+	speedlimit_close(l.sl);
+	g_async_queue_unref(l.todo);
+	g_mutex_clear(&l.mutex);
+	g_cond_clear(&l.cond);
+	g_free(workers);
+	g_ptr_array_free(maps, TRUE);
+	return 0;
+}
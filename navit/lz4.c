@@ -0,0 +1,235 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+/* The last match has to start this many bytes before the end of the block */
+#define LZ4_MF_LIMIT 12
+/* The last bytes of a block are always literals */
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+static unsigned int
+lz4_read32(const unsigned char *p)
+{
+	unsigned int ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+static int
+lz4_hash(const unsigned char *p)
+{
+	return (lz4_read32(p)*2654435761U) >> (32-LZ4_HASH_BITS);
+}
+
+static unsigned char *
+lz4_write_length(unsigned char *op, int len)
+{
+	while (len >= 255) {
+		*op++=255;
+		len-=255;
+	}
+	*op++=len;
+	return op;
+}
+
+/**
+ * @brief Writes a sequence of literals and optionally a match
+ *
+ * @param match_len Length of the match, 0 for the literals at the end of the block
+ */
+static unsigned char *
+lz4_write_sequence(unsigned char *op, const unsigned char *literals, int literal_len, int offset, int match_len)
+{
+	unsigned char *token=op++;
+
+	if (literal_len >= 15) {
+		*token=15 << 4;
+		op=lz4_write_length(op, literal_len-15);
+	} else
+		*token=literal_len << 4;
+	memcpy(op, literals, literal_len);
+	op+=literal_len;
+	if (!match_len)
+		return op;
+	*op++=offset & 0xff;
+	*op++=offset >> 8;
+	match_len-=LZ4_MIN_MATCH;
+	if (match_len >= 15) {
+		*token|=15;
+		op=lz4_write_length(op, match_len-15);
+	} else
+		*token|=match_len;
+	return op;
+}
+
+/**
+ * @brief Returns the size of the buffer lz4_compress() needs in the worst case
+ */
+int
+lz4_compress_bound(int size)
+{
+	return size+size/255+16;
+}
+
+/**
+ * @brief Compresses a block
+ *
+ * Matches are found greedily with a hash table of the last position of every 4 byte
+ * sequence. The further the last match lies behind, the more positions are skipped,
+ * so incompressible data is passed over quickly.
+ *
+ * @param src The data to compress
+ * @param size The size of the data
+ * @param dst Buffer for the compressed data
+ * @param capacity The size of dst, at least lz4_compress_bound(size)
+ * @return The size of the compressed data, or 0 if dst is too small
+ */
+int
+lz4_compress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+	int table[1 << LZ4_HASH_BITS];
+	const unsigned char *ip=src, *anchor=src, *end=src+size;
+	const unsigned char *mf_limit=end-LZ4_MF_LIMIT, *match_limit=end-LZ4_LAST_LITERALS;
+	const unsigned char *ref;
+	unsigned char *op=dst;
+	int h,len;
+
+	if (capacity < lz4_compress_bound(size))
+		return 0;
+	if (size > LZ4_MF_LIMIT) {
+		/* Stale entries are harmless, every candidate is compared before it is used */
+		memset(table, 0, sizeof(table));
+		ip++;
+		while (ip < mf_limit) {
+			h=lz4_hash(ip);
+			ref=src+table[h];
+			table[h]=ip-src;
+			if (ip-ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)) {
+				ip+=1+((ip-anchor) >> 6);
+				continue;
+			}
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			len=LZ4_MIN_MATCH;
+			while (ip+len < match_limit && ip[len] == ref[len])
+				len++;
+			op=lz4_write_sequence(op, anchor, ip-anchor, ip-ref, len);
+			ip+=len;
+			anchor=ip;
+			if (ip < mf_limit)
+				table[lz4_hash(ip-2)]=ip-2-src;
+		}
+	}
+	op=lz4_write_sequence(op, anchor, end-anchor, 0, 0);
+	return op-dst;
+}
+
+/**
+ * @brief Reads the extension bytes of a literal or match length
+ *
+ * @return The length, or -1 if the input ends or the length exceeds limit
+ */
+static int
+lz4_read_length(const unsigned char **ip, const unsigned char *end, int len, int limit)
+{
+	int b;
+
+	do {
+		if (*ip >= end)
+			return -1;
+		b=*(*ip)++;
+		len+=b;
+		if (len > limit)
+			return -1;
+	} while (b == 255);
+	return len;
+}
+
+/**
+ * @brief Decompresses a block
+ *
+ * Corrupt input is detected and never causes reads or writes outside of src and dst.
+ *
+ * @param src The compressed data
+ * @param size The size of the compressed data
+ * @param dst Buffer for the decompressed data
+ * @param capacity The size of dst
+ * @return The size of the decompressed data, or -1 if the data is corrupt or does not fit into dst
+ */
+int
+lz4_decompress(const unsigned char *src, int size, unsigned char *dst, int capacity)
+{
+	const unsigned char *ip=src, *end=src+size;
+	unsigned char *op=dst, *oend=dst+capacity;
+	const unsigned char *match;
+	int token,len,offset;
+
+	for (;;) {
+		if (ip >= end)
+			return -1;
+		token=*ip++;
+		len=token >> 4;
+		if (len == 15 && (len=lz4_read_length(&ip, end, len, capacity)) < 0)
+			return -1;
+		if (len <= 16 && end-ip >= 16 && oend-op >= 16)
+			memcpy(op, ip, 16);
+		else if (len <= end-ip && len <= oend-op)
+			memcpy(op, ip, len);
+		else
+			return -1;
+		op+=len;
+		ip+=len;
+		if (ip == end)
+			break;
+		if (end-ip < 2)
+			return -1;
+		offset=ip[0] | (ip[1] << 8);
+		ip+=2;
+		if (!offset || offset > op-dst)
+			return -1;
+		len=token & 15;
+		if (len == 15 && (len=lz4_read_length(&ip, end, len, capacity)) < 0)
+			return -1;
+		len+=LZ4_MIN_MATCH;
+		if (len > oend-op)
+			return -1;
+		match=op-offset;
+		if (offset >= 8 && oend-op >= len+8) {
+			/* Copy in words, overrunning the end of the match by up to 7 bytes */
+			unsigned char *cpy=op+len;
+			do {
+				memcpy(op, match, 8);
+				op+=8;
+				match+=8;
+			} while (op < cpy);
+			op=cpy;
+		} else {
+			while (len--)
+				*op++=*match++;
+		}
+	}
+	return op-dst;
+}
@@ -0,0 +1,38 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_LZ4_H
+#define NAVIT_LZ4_H
+
+/** @file lz4.h
+ *
+ * @brief Compressor and decompressor for the LZ4 block format
+ *
+ * Used for zip members stored with method zip_method_lz4. Decoding is several times
+ * faster than inflate at the cost of somewhat larger tiles. Only the block format is
+ * implemented, without the frame format and its checksums.
+ */
+
+/* prototypes */
+int lz4_compress_bound(int size);
+int lz4_compress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+int lz4_decompress(const unsigned char *src, int size, unsigned char *dst, int capacity);
+/* end of prototypes */
+
+#endif
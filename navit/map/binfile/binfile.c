@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "debug.h"
 #include "plugin.h"
 #include "projection.h"
@@ -38,9 +40,109 @@
 #include "endianess.h"
 #include "callback.h"
 #include "geom.h"
+#include "speedindex.h"
+#include "tilecache.h"
 
 static int map_id;
 
+/* Number of central directory entries decoded per read */
+#define BINFILE_MEMBERS_CHUNK 1024
+/* Size of the windows the central directory is read in to index the names of the members */
+#define BINFILE_NAMES_WINDOW 65536
+/* Identifies a snapshot of an opened map, "BSNP" */
+#define BINFILE_SNAPSHOT_MAGIC 0x504e5342
+#define BINFILE_SNAPSHOT_VERSION 2
+/* Number of records appended to the change journal after which it is synced to disk */
+#define BINFILE_CHANGES_SYNC 64
+
+/**
+ * @brief A member of the zip file as far as needed to load it, decoded from its central directory entry
+ */
+struct binfile_member {
+	long long offset;		//!< Offset of the local file header
+	unsigned int zipsize;		//!< Size of the data as stored
+	unsigned int zipuncmp;		//!< Size of the data after decompression
+	unsigned short zipfnln;		//!< Length of the file name following the local file header
+	unsigned short zipmthd;		//!< Compression method
+	unsigned short zipdsk;		//!< Disk (split file) the member is stored on
+	unsigned short leaf;		//!< Set if no other tile lies within this one, so it holds no submaps
+};
+
+/**
+ * @brief The name of a member of the zip file
+ */
+struct binfile_name {
+	int name;			//!< Offset of the name within binfile_names.strings
+	int len;			//!< Length of the name
+	int offset;			//!< Offset of the member within the central directory
+};
+
+/**
+ * @brief The names of all members of the zip file, sorted by name and offset
+ */
+struct binfile_names {
+	int count;
+	struct binfile_name *entries;
+	char *strings;			//!< The names, not terminated
+};
+
+/**
+ * @brief Header of the snapshot of an opened map
+ *
+ * The snapshot holds what map_binfile_open() learns about a map which is costly to
+ * find out: the decoded central directory and the contents of the map information
+ * item. The header is followed by release_len bytes of the map release and by
+ * zip_members entries of struct binfile_member. It is stored in the byte order of
+ * the host and only used for a map of the same size and modification time.
+ */
+struct binfile_snapshot {
+	int magic;			//!< BINFILE_SNAPSHOT_MAGIC
+	int version;			//!< BINFILE_SNAPSHOT_VERSION
+	long long size;			//!< Size of the map file
+	long long mtime;		//!< Modification time of the map file
+	int map_version;
+	int zip_members;
+	int cde_size;
+	int index_offset;
+	struct coord_rect bbox;
+	int release_len;		//!< Length of the map release including the terminating 0, 0 if there is none
+};
+
+/* Maximum depth of the quadtree over the submaps of a tile */
+#define BINFILE_QUADTREE_DEPTH 16
+
+/**
+ * @brief A submap item of a tile, decoded once per map
+ */
+struct binfile_submap {
+	struct coord_rect r;		//!< Area covered by the referenced tile
+	struct range order;		//!< Orders for which the referenced tile is needed
+	int zipfile;			//!< Member number of the referenced tile
+	int pos;			//!< Offset of the submap item within its tile
+	int next;			//!< Offset of the item following the submap item
+	int run_end;			//!< Index of the last submap of the run of adjacent submaps this one is part of
+};
+
+/**
+ * @brief A node of the quadtree over the submaps of a tile
+ *
+ * A node covers the area tile_bbox() returns for the tile name leading to it.
+ * Every submap is stored in the deepest node which contains its area.
+ */
+struct binfile_quadtree {
+	struct coord_rect r;
+	struct binfile_quadtree *children[4];
+	GArray *submaps;		//!< Indices of the submaps stored in this node
+};
+
+/**
+ * @brief The submap items of a tile
+ */
+struct binfile_submaps {
+	int count;
+	struct binfile_submap *submaps;	//!< Ordered by their position within the tile
+	struct binfile_quadtree *root;
+};
 
 /**
  * @brief A map tile, a rectangular region of the world.
@@ -81,6 +183,15 @@ struct tile {
 	struct file *fi;        //!< The file from which this tile was loaded.
 	int zipfile_num;
 	int mode;
+	struct binfile_submaps *submaps;	//!< Decoded submap items of the tile, NULL if not used
+	int submap;		//!< Index of the next submap in submaps
+	int *matches;		//!< Sorted indices of the submaps matching the selection
+	int match_count;	//!< Number of matches, -1 if all submaps match
+	int match;		//!< Index of the next match in matches
+	int *spans;		//!< Start and end offsets of the item type groups to visit, NULL to visit all items
+	int span_count;
+	int span;		//!< Index of the next span in spans
+	int *span_end;		//!< End of the span being visited
 };
 
 
@@ -100,6 +211,12 @@ struct map_download {
 /**
  * @brief Represents the map from a single binfile.
  *
+ * Map rects keep all their state in struct map_rect_priv, and the members of the map are
+ * not changed after it is opened, except for the submaps and the names of the members which
+ * are published atomically.
+ * A map with a valid snapshot is only opened when it is first used, under open_mutex.
+ * So if binmap_get_attr() reports attr_concurrent, map rects may be used on several
+ * threads at the same time, as long as no items of the map are changed meanwhile.
  */
 struct map_priv {
 	int id;
@@ -113,13 +230,19 @@ struct map_priv {
 	struct zip_eoc *eoc;
 	struct zip64_eoc *eoc64;
 	int zip_members;
-	unsigned char *search_data;
-	int search_offset;
-	int search_size;
+	struct binfile_member *members;	//!< Decoded central directory, zip_members entries
+	struct binfile_names *names;	//!< Names of the members, read when a member is first looked up by name
+	struct binfile_submaps **submaps;	//!< Decoded submap items per member, filled when a tile is first entered
+	struct coord_rect bbox;		//!< Area covered by the tiles of the map
+	int deferred;			//!< Set while the map is only known from its snapshot and not opened yet
+	GMutex open_mutex;		//!< Serializes opening a deferred map
 	int version;
 	int check_version;
 	int map_version;
 	GHashTable *changes;
+	GPtrArray *changes_dirty;	//!< Entries of changes which are not yet written to the journal
+	struct file *changes_journal;	//!< The journal <map>.log, opened when changes are first written
+	int changes_unsynced;		//!< Number of records written to the journal since it was synced
 	char *passwd;
 	char *map_release;
 	int flags;
@@ -132,6 +255,9 @@ struct map_priv {
 	long download_enabled;
 	int last_searched_town_id_hi;	
 	int last_searched_town_id_lo;
+	struct speed_index *speed_index;	//!< Speed limit index written by maptool next to the map, if any
+	int tile_cache_size;		//!< Budget of the persistent tile cache in bytes, 0 to disable it
+	struct tile_cache *tile_cache;	//!< Persistent cache of decompressed tiles, if enabled
 };
 
 struct map_rect_priv {
@@ -178,9 +304,16 @@ struct map_search_priv {
 
 
 static void push_tile(struct map_rect_priv *mr, struct tile *t, int offset, int length);
+static void binfile_tile_submaps(struct map_rect_priv *mr);
+static void binfile_tile_spans(struct map_rect_priv *mr);
+static void binfile_submaps_destroy(struct binfile_submaps *submaps);
+static void binfile_names_destroy(struct binfile_names *names);
+static void tile_bbox(char *tile, int len, struct coord_rect *r);
 static void setup_pos(struct map_rect_priv *mr);
 static void map_binfile_close(struct map_priv *m);
+static void binfile_changes_destroy(struct map_priv *m);
 static int map_binfile_open(struct map_priv *m);
+static void binfile_open_deferred(struct map_priv *m);
 static void map_binfile_destroy(struct map_priv *m);
 
 static void lfh_to_cpu(struct zip_lfh *lfh) {
@@ -205,6 +338,7 @@ static void cd_to_cpu(struct zip_cd *zcd) {
 	if (zcd->zipcensig != zip_cd_sig) {
 		zcd->zipcensig = le32_to_cpu(zcd->zipcensig);
 		zcd->zipccrc   = le32_to_cpu(zcd->zipccrc);
+		zcd->zipcmthd  = le16_to_cpu(zcd->zipcmthd);
 		zcd->zipcsiz   = le32_to_cpu(zcd->zipcsiz);
 		zcd->zipcunc   = le32_to_cpu(zcd->zipcunc);
 		zcd->zipcfnl   = le16_to_cpu(zcd->zipcfnl);
@@ -343,6 +477,122 @@ binfile_cd_offset(struct zip_cd *cd)
 		return cd->zipofst;
 }
 
+static void
+binfile_member_set(struct binfile_member *mb, struct zip_cd *cd)
+{
+	mb->offset=binfile_cd_offset(cd);
+	mb->zipsize=cd->zipcsiz;
+	mb->zipuncmp=cd->zipcunc;
+	mb->zipfnln=cd->zipcfnl;
+	mb->zipmthd=cd->zipcmthd;
+	mb->zipdsk=cd->zipdsk;
+}
+
+/**
+ * @brief Returns the length of the quadtree path at the start of a tile name
+ */
+static int
+binfile_tile_name_len(char *name, int len)
+{
+	int ret=0;
+
+	while (ret < len && name[ret] >= 'a' && name[ret] <= 'd')
+		ret++;
+	return ret;
+}
+
+/**
+ * @brief Marks the members whose tile does not contain the tile of any other member
+ *
+ * Submap items are only stored in tiles containing the tiles they refer to, so the
+ * tiles of these members need not be searched for submaps.
+ *
+ * @param paths The quadtree paths of the tile names, in member order
+ */
+static void
+binfile_members_set_leaf(struct map_priv *m, GPtrArray *paths)
+{
+	GHashTable *inner=g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	char *path;
+	int i,len;
+
+	for (i = 0 ; i < paths->len ; i++) {
+		path=paths->pdata[i];
+		for (len = strlen(path)-1 ; len >= 0 ; len--)
+			g_hash_table_insert(inner, g_strndup(path, len), GINT_TO_POINTER(1));
+	}
+	for (i = 0 ; i < paths->len ; i++)
+		m->members[i].leaf=!g_hash_table_lookup(inner, paths->pdata[i]);
+	g_hash_table_destroy(inner);
+}
+
+static void
+binfile_paths_free(GPtrArray *paths)
+{
+	int i;
+
+	for (i = 0 ; i < paths->len ; i++)
+		g_free(paths->pdata[i]);
+	g_ptr_array_free(paths, TRUE);
+}
+
+/**
+ * @brief Decodes the central directory into m->members
+ *
+ * The entries of the tiles all have the size of the first one, the last
+ * entry is the one of the index which is already read. The area covered
+ * by the tiles is stored in m->bbox.
+ *
+ * @return 1 on success, 0 if the central directory could not be read
+ */
+static int
+binfile_read_members(struct map_priv *m)
+{
+	long long cdoffset=m->eoc64?m->eoc64->zip64eofst:m->eoc->zipeofst;
+	GPtrArray *paths=g_ptr_array_new();
+	unsigned char *data;
+	struct zip_cd *cd;
+	struct coord_rect r;
+	int i,j,count;
+
+	m->members=g_new0(struct binfile_member, m->zip_members);
+	for (i = 0 ; i < m->zip_members-1 ; i+=count) {
+		count=MIN(m->zip_members-1-i, BINFILE_MEMBERS_CHUNK);
+		data=file_data_read(m->fi, cdoffset+(long long)i*m->cde_size, count*m->cde_size);
+		if (!data)
+			break;
+		for (j = 0 ; j < count ; j++) {
+			cd=(struct zip_cd *)(data+j*m->cde_size);
+			cd_to_cpu(cd);
+			if (cd->zipcensig != zip_cd_sig)
+				break;
+			binfile_member_set(&m->members[i+j], cd);
+			g_ptr_array_add(paths, g_strndup((char *)(cd+1), binfile_tile_name_len((char *)(cd+1), cd->zipcfnl)));
+			tile_bbox((char *)(cd+1), cd->zipcfnl, &r);
+			if (i+j) {
+				coord_rect_extend(&m->bbox, &r.lu);
+				coord_rect_extend(&m->bbox, &r.rl);
+			} else
+				m->bbox=r;
+		}
+		/* Read only once, so keep it out of the cache */
+		file_data_remove(m->fi, data);
+		if (j < count)
+			break;
+	}
+	if (i < m->zip_members-1) {
+		binfile_paths_free(paths);
+		g_free(m->members);
+		m->members=NULL;
+		return 0;
+	}
+	binfile_member_set(&m->members[m->zip_members-1], m->index_cd);
+	g_ptr_array_add(paths, g_strndup(m->index_cd->zipcfn, binfile_tile_name_len(m->index_cd->zipcfn, m->index_cd->zipcfnl)));
+	binfile_members_set_leaf(m, paths);
+	binfile_paths_free(paths);
+	return 1;
+}
+
 static struct zip_lfh *
 binfile_read_lfh(struct file *fi, long long offset)
 {
@@ -359,6 +609,26 @@ binfile_read_lfh(struct file *fi, long long offset)
 	return lfh;
 }
 
+/**
+ * @brief Checks if the data of the members starts on page boundaries, see maptool --page-align
+ */
+static int
+binfile_page_aligned(struct file *fi)
+{
+	struct zip_lfh *lfh=binfile_read_lfh(fi, 0);
+	unsigned char *extra;
+	int ret=0;
+
+	if (!lfh)
+		return 0;
+	if (lfh->zipxtraln >= 6 && (extra=file_data_read(fi, sizeof(*lfh)+lfh->zipfnln, 6))) {
+		ret=(extra[0] | (extra[1] << 8)) == zip_extra_header_id_align;
+		file_data_free(fi, extra);
+	}
+	file_data_free(fi, (unsigned char *)lfh);
+	return ret;
+}
+
 static unsigned char *
 binfile_read_content(struct map_priv *m, struct file *fi, long long offset, struct zip_lfh *lfh)
 {
@@ -375,6 +645,10 @@ binfile_read_content(struct map_priv *m, struct file *fi, long long offset, stru
 		offset+=lfh->zipxtraln;
 		ret=file_data_read_compressed(fi,offset, lfh->zipsize, lfh->zipuncmp);
 		break;
+	case zip_method_lz4:
+		offset+=lfh->zipxtraln;
+		ret=file_data_read_lz4(fi,offset, lfh->zipsize, lfh->zipuncmp);
+		break;
 	case 99:
 		if (!m->passwd)
 			break;
@@ -399,46 +673,183 @@ binfile_read_content(struct map_priv *m, struct file *fi, long long offset, stru
 }
 
 static int
-binfile_search_cd(struct map_priv *m, int offset, char *name, int partial, int skip)
+binfile_compare_names(const void *a, const void *b, void *data)
+{
+	const struct binfile_name *na=a,*nb=b;
+	char *strings=data;
+	int ret=memcmp(strings+na->name, strings+nb->name, MIN(na->len, nb->len));
+
+	if (ret)
+		return ret;
+	if (na->len != nb->len)
+		return na->len-nb->len;
+	return na->offset-nb->offset;
+}
+
+/**
+ * @brief Reads the names of all members of the central directory
+ *
+ * The central directory is read in windows of BINFILE_NAMES_WINDOW bytes, the names
+ * are sorted so they can be looked up by binfile_search_cd() with a binary search.
+ *
+ * @return The names, or NULL if the central directory could not be read
+ */
+static struct binfile_names *
+binfile_read_names(struct map_priv *m)
 {
-	int size=4096;
 	int end=m->eoc64?m->eoc64->zip64ecsz:m->eoc->zipecsz;
-	int len=strlen(name);
 	long long cdoffset=m->eoc64?m->eoc64->zip64eofst:m->eoc->zipeofst;
-	struct zip_cd *cd;
+	struct binfile_names *names=g_new0(struct binfile_names, 1);
+	unsigned char *data=NULL;
+	int offset=0,data_offset=0,data_size=0,alloc=0,strings_size=0,strings_alloc=0;
+	struct zip_cd cd;
+
 	while (offset < end) {
-		cd=(struct zip_cd *)(m->search_data+offset-m->search_offset);
-		if (! m->search_data ||
-		      m->search_offset > offset ||
-		      offset-m->search_offset+sizeof(*cd) > m->search_size ||
-		      offset-m->search_offset+sizeof(*cd)+cd->zipcfnl+cd->zipcxtl > m->search_size
-		   ) {
-			if (m->search_data)
-				file_data_free(m->fi,m->search_data);
-			m->search_offset=offset;
-			m->search_size=end-offset;
-			if (m->search_size > size)
-				m->search_size=size;
-			m->search_data=file_data_read(m->fi,cdoffset+m->search_offset,m->search_size);
-			cd=(struct zip_cd *)m->search_data;
+		if (!data || offset-data_offset+sizeof(cd) > data_size) {
+			if (data)
+				file_data_remove(m->fi, data);
+			data_offset=offset;
+			data_size=MIN(end-offset, BINFILE_NAMES_WINDOW);
+			data=file_data_read(m->fi, cdoffset+data_offset, data_size);
+			if (!data)
+				break;
+		}
+		memcpy(&cd, data+offset-data_offset, sizeof(cd));
+		cd_to_cpu(&cd);
+		if (cd.zipcensig != zip_cd_sig)
+			break;
+		if (offset-data_offset+sizeof(cd)+cd.zipcfnl > data_size) {
+			if (offset == data_offset)
+				break;
+			/* The name crosses the end of the window, read it again starting at this entry */
+			file_data_remove(m->fi, data);
+			data=NULL;
+			continue;
+		}
+		if (names->count == alloc) {
+			alloc=alloc ? alloc*2 : 1024;
+			names->entries=g_renew(struct binfile_name, names->entries, alloc);
 		}
-		if (!skip &&
-		    (partial || cd->zipcfnl == len) &&
-		    !strncmp(cd->zipcfn, name, len))
-			return offset;
-		skip=0;
-		offset+=sizeof(*cd)+cd->zipcfnl+cd->zipcxtl+cd->zipccml;
-;
+		if (strings_size+cd.zipcfnl > strings_alloc) {
+			strings_alloc=MAX(strings_alloc*2, strings_size+cd.zipcfnl);
+			names->strings=g_realloc(names->strings, strings_alloc);
+		}
+		memcpy(names->strings+strings_size, data+offset-data_offset+sizeof(cd), cd.zipcfnl);
+		names->entries[names->count].name=strings_size;
+		names->entries[names->count].len=cd.zipcfnl;
+		names->entries[names->count].offset=offset;
+		names->count++;
+		strings_size+=cd.zipcfnl;
+		offset+=sizeof(cd)+cd.zipcfnl+cd.zipcxtl+cd.zipccml;
+	}
+	if (data)
+		file_data_remove(m->fi, data);
+	if (offset < end) {
+		dbg(lvl_error,"map file %s: unable to read central directory at %d\n", m->filename, offset);
+		binfile_names_destroy(names);
+		return NULL;
 	}
-	return -1;
+	g_qsort_with_data(names->entries, names->count, sizeof(struct binfile_name), binfile_compare_names, names->strings);
+	dbg(lvl_debug,"%d names\n", names->count);
+	return names;
+}
+
+static void
+binfile_names_destroy(struct binfile_names *names)
+{
+	if (!names)
+		return;
+	g_free(names->entries);
+	g_free(names->strings);
+	g_free(names);
+}
+
+/**
+ * @brief Returns the names of the members, reading them the first time they are needed
+ *
+ * Map rects on other threads may read the names at the same time, so they are
+ * published atomically like the submaps.
+ *
+ * @return The names, or NULL if the central directory could not be read
+ */
+static struct binfile_names *
+binfile_get_names(struct map_priv *m)
+{
+	struct binfile_names *names=g_atomic_pointer_get(&m->names);
+
+	if (names)
+		return names;
+	names=binfile_read_names(m);
+	if (!names)
+		return NULL;
+	/* Another map rect may have read them meanwhile */
+	if (!g_atomic_pointer_compare_and_exchange(&m->names, NULL, names)) {
+		binfile_names_destroy(names);
+		names=g_atomic_pointer_get(&m->names);
+	}
+	return names;
+}
+
+/**
+ * @brief Finds a member of the central directory by its name
+ *
+ * @param offset Offset within the central directory to start searching at
+ * @param name The name of the member
+ * @param partial If set, name only needs to be a prefix of the name of the member
+ * @param skip If set, the member at offset is not returned
+ * @return The offset of the first matching member at or behind offset within the
+ * central directory, or -1 if there is none
+ */
+static int
+binfile_search_cd(struct map_priv *m, int offset, char *name, int partial, int skip)
+{
+	struct binfile_names *names;
+	struct binfile_name *entry;
+	int len=strlen(name);
+	int lo=0,hi,mid,cmp,ret=-1;
+
+	names=binfile_get_names(m);
+	if (!names)
+		return -1;
+	hi=names->count;
+	/* First name which is not less than name */
+	while (lo < hi) {
+		mid=(lo+hi)/2;
+		entry=&names->entries[mid];
+		cmp=memcmp(names->strings+entry->name, name, MIN(entry->len, len));
+		if (cmp < 0 || (!cmp && entry->len < len))
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	/* Matches are sorted by offset within the same name */
+	for (; lo < names->count ; lo++) {
+		entry=&names->entries[lo];
+		if (entry->len < len || memcmp(names->strings+entry->name, name, len))
+			break;
+		if (!partial && entry->len != len)
+			break;
+		if (entry->offset < offset || (skip && entry->offset == offset))
+			continue;
+		if (ret == -1 || entry->offset < ret)
+			ret=entry->offset;
+		if (!partial)
+			break;
+	}
+	return ret;
 }
 
 static void
 map_destroy_binfile(struct map_priv *m)
 {
 	dbg(lvl_debug,"map_destroy_binfile\n");
+	binfile_changes_destroy(m);
 	if (m->fi)
 		map_binfile_close(m);
+	else if (m->deferred) {
+		g_free(m->members);
+		g_free(m->map_release);
+	}
 	map_binfile_destroy(m);
 }
 
@@ -548,6 +959,36 @@ binfile_extract(struct map_priv *m, char *dir, char *filename, int partial)
 	return g_strdup_printf("%s/%s",dir,filename);
 }
 
+/**
+ * @brief Gets attr_flags or attr_maxspeed of an item of a map of version 2 or later
+ *
+ * maptool writes these attributes ahead of all others, flags before maxspeed, so
+ * they are found without scanning the attributes of the item.
+ */
+static int
+binfile_attr_get_hot(struct map_rect_priv *mr, enum attr_type attr_type, struct attr *attr)
+{
+	struct tile *t=mr->t;
+	int *pos=t->pos_attr_start;
+	enum attr_type type;
+	int i;
+
+	for (i = 0 ; i < 2 && pos < t->pos_next ; i++) {
+		type=le32_to_cpu(pos[1]);
+		if (type == attr_type) {
+			attr->type=type;
+			attr_data_set_le(attr, pos+2);
+			t->pos_attr=pos+le32_to_cpu(pos[0])+1;
+			return 1;
+		}
+		if (type != attr_flags)
+			break;
+		pos+=le32_to_cpu(pos[0])+1;
+	}
+	t->pos_attr=t->pos_next;
+	return 0;
+}
+
 static int
 binfile_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
 {
@@ -560,6 +1001,10 @@ binfile_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
 		t->pos_attr=t->pos_attr_start;
 		mr->attr_last=attr_type;
 	}
+	/* Items changed on the device may have their attributes in any order */
+	if (t->pos_attr == t->pos_attr_start && (attr_type == attr_flags || attr_type == attr_maxspeed)
+	        && mr->m->map_version >= 2 && t->mode < 2)
+		return binfile_attr_get_hot(mr, attr_type, attr);
 	while (t->pos_attr < t->pos_next) {
 		size=le32_to_cpu(*(t->pos_attr++));
 		type=le32_to_cpu(t->pos_attr[0]);
@@ -628,7 +1073,7 @@ binfile_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
 
 struct binfile_hash_entry {
 	struct item_id id;
-	int flags;
+	int flags;		//!< Position in changes_dirty plus 1, 0 once written to the journal
 	int data[0];
 };
 
@@ -651,15 +1096,25 @@ binfile_item_dup(struct map_priv *m, struct item *item, struct tile *t, int exte
 {
 	int size=le32_to_cpu(t->pos[0]);
 	struct binfile_hash_entry *entry=g_malloc(sizeof(struct binfile_hash_entry)+(size+1+extend)*sizeof(int));
+	struct binfile_hash_entry *old;
 	void *ret=entry->data;
 	entry->id.id_hi=item->id_hi;
 	entry->id.id_lo=item->id_lo;
-	entry->flags=1;
 	dbg(lvl_debug,"id 0x%x,0x%x\n",entry->id.id_hi,entry->id.id_lo);
 
 	memcpy(ret, t->pos, (size+1)*sizeof(int));
 	if (!m->changes)
 		m->changes=g_hash_table_new_full(binfile_hash_entry_hash, binfile_hash_entry_equal, g_free, NULL);
+	if (!m->changes_dirty)
+		m->changes_dirty=g_ptr_array_new();
+	old=g_hash_table_lookup(m->changes, entry);
+	if (old && old->flags) {
+		entry->flags=old->flags;
+		g_ptr_array_index(m->changes_dirty, entry->flags-1)=entry;
+	} else {
+		g_ptr_array_add(m->changes_dirty, entry);
+		entry->flags=m->changes_dirty->len;
+	}
 	g_hash_table_replace(m->changes, entry, entry);
 	dbg(lvl_debug,"ret %p\n",ret);
 	return ret;
@@ -677,8 +1132,8 @@ binfile_coord_set(void *priv_data, struct coord *c, int count, enum change_mode
 	{
 		int *i=t->pos,j=0;
 		dbg(lvl_debug,"Before: pos_coord=%td\n",t->pos_coord-i);
-		while (i < t->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < t->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 
 	}
 	aoffset=t->pos_attr-t->pos_attr_start;
@@ -738,8 +1193,8 @@ binfile_coord_set(void *priv_data, struct coord *c, int count, enum change_mode
 	{
 		int *i=tn->pos,j=0;
 		dbg(lvl_debug,"After move: pos_coord=%td\n",tn->pos_coord-i);
-		while (i < tn->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < tn->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 	}
 	if (mode != change_mode_append)
 		tn->pos_coord+=move_offset;
@@ -754,8 +1209,8 @@ binfile_coord_set(void *priv_data, struct coord *c, int count, enum change_mode
 	{
 		int *i=tn->pos,j=0;
 		dbg(lvl_debug,"After: pos_coord=%td\n",tn->pos_coord-i);
-		while (i < tn->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < tn->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 	}
 	return 1;
 }
@@ -773,8 +1228,8 @@ binfile_attr_set(void *priv_data, struct attr *attr, enum change_mode mode)
 	{
 		int *i=t->pos,j=0;
 		dbg(lvl_debug,"Before: pos_attr=%td\n",t->pos_attr-i);
-		while (i < t->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < t->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 
 	}
 
@@ -845,8 +1300,8 @@ binfile_attr_set(void *priv_data, struct attr *attr, enum change_mode mode)
 	{
 		int *i=tn->pos,j=0;
 		dbg(lvl_debug,"After move: pos_attr=%td\n",tn->pos_attr-i);
-		while (i < tn->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < tn->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 	}
 	if (nattr_len) {
 		int *nattr=tn->pos_attr_start+write_offset;
@@ -859,10 +1314,8 @@ binfile_attr_set(void *priv_data, struct attr *attr, enum change_mode mode)
 	{
 		int *i=tn->pos,j=0;
 		dbg(lvl_debug,"After: pos_attr=%td\n",tn->pos_attr-i);
-		while (i < tn->pos_next)
-		dbg(lvl_debug,"After: pos_attr=%td\n",tn->pos_attr-i);
-		while (i < tn->pos_next)
-			dbg(lvl_debug,"%d:0x%x\n",j++,*i++);
+		for (; i < tn->pos_next ; i++, j++)
+			dbg(lvl_debug,"%d:0x%x\n",j,*i);
 	}
 	return 1;
 }
@@ -883,6 +1336,9 @@ push_tile(struct map_rect_priv *mr, struct tile *t, int offset, int length)
 	dbg_assert(mr->tile_depth < 8);
 	mr->t=&mr->tiles[mr->tile_depth++];
 	*(mr->t)=*t;
+	mr->t->submaps=NULL;
+	mr->t->matches=NULL;
+	mr->t->spans=NULL;
 	mr->t->pos=mr->t->pos_next=mr->t->start+offset;
 	if (length == -1)
 		length=le32_to_cpu(mr->t->pos[0])+1;
@@ -897,6 +1353,8 @@ pop_tile(struct map_rect_priv *mr)
 		return 0;
 	if (mr->t->mode < 2)
 		file_data_free(mr->m->fi, (unsigned char *)(mr->t->start));
+	g_free(mr->t->matches);
+	g_free(mr->t->spans);
 #ifdef DEBUG_SIZE
 #if DEBUG_SIZE > 0
 	dbg(lvl_debug,"leave %d\n",mr->t->zipfile_num);
@@ -908,29 +1366,35 @@ pop_tile(struct map_rect_priv *mr)
 
 
 static int
-zipfile_to_tile(struct map_priv *m, struct zip_cd *cd, struct tile *t)
+zipfile_to_tile(struct map_priv *m, int zipfile, struct tile *t)
 {
-	char buffer[1024];
+	struct binfile_member *mb=&m->members[zipfile];
 	struct zip_lfh *lfh;
-	char *zipfn;
 	struct file *fi;
-	dbg(lvl_debug,"enter %p %p %p\n", m, cd, t);
-	dbg(lvl_debug,"cd->zipofst=0x%llx\n", binfile_cd_offset(cd));
+	dbg(lvl_debug,"enter %p %d %p\n", m, zipfile, t);
+	dbg(lvl_debug,"offset=0x%llx\n", mb->offset);
 	t->start=NULL;
 	t->mode=1;
 	if (m->fis)
-		fi=m->fis[cd->zipdsk];
+		fi=m->fis[mb->zipdsk];
 	else
 		fi=m->fi;
-	lfh=binfile_read_lfh(fi, binfile_cd_offset(cd));
-	zipfn=(char *)(file_data_read(fi,binfile_cd_offset(cd)+sizeof(struct zip_lfh), lfh->zipfnln));
-	strncpy(buffer, zipfn, lfh->zipfnln);
-	buffer[lfh->zipfnln]='\0';
-	t->start=(int *)binfile_read_content(m, fi, binfile_cd_offset(cd), lfh);
-	t->end=t->start+lfh->zipuncmp/4;
+	if (mb->zipmthd == 0 || mb->zipmthd == 8 || mb->zipmthd == zip_method_lz4)
+		t->start=(int *)file_data_read_zip_member(fi, mb->offset, sizeof(struct zip_lfh)+mb->zipfnln,
+							   mb->zipsize, mb->zipuncmp, mb->zipmthd);
+	/* A stored tile of a mapped map is used in place, fault in all of its pages at once */
+	if (t->start && fi->begin && !mb->zipmthd)
+		file_data_prefetch(fi, (unsigned char *)t->start-fi->begin, mb->zipuncmp);
+	if (!t->start) {
+		/* Encrypted, or the local file header differs from the central directory */
+		lfh=binfile_read_lfh(fi, mb->offset);
+		if (lfh) {
+			t->start=(int *)binfile_read_content(m, fi, mb->offset, lfh);
+			file_data_free(fi, (unsigned char *)lfh);
+		}
+	}
+	t->end=t->start+mb->zipuncmp/4;
 	t->fi=fi;
-	file_data_free(fi, (unsigned char *)zipfn);
-	file_data_free(fi, (unsigned char *)lfh);
 	return t->start != NULL;
 }
 
@@ -1281,21 +1745,25 @@ push_zipfile_tile_do(struct map_rect_priv *mr, struct zip_cd *cd, int zipfile, i
 	struct file *f=m->fi;
 
 	dbg(lvl_debug,"enter %p %d\n", mr, zipfile);
+	/* A downloaded tile has a new central directory entry */
+	if (cd) {
+		binfile_member_set(&m->members[zipfile], cd);
+		file_data_free(f, (unsigned char *)cd);
+	}
 #ifdef DEBUG_SIZE
 #if DEBUG_SIZE > 0
-	{
-		char filename[cd->zipcfnl+1];
-		memcpy(filename, cd+1, cd->zipcfnl);
-		filename[cd->zipcfnl]='\0';
-		dbg(lvl_debug,"enter %d (%s) %d\n",zipfile, filename, cd->zipcunc);
-	}
+	dbg(lvl_debug,"enter %d %d\n",zipfile, m->members[zipfile].zipuncmp);
 #endif
-	mr->size+=cd->zipcunc;
+	mr->size+=m->members[zipfile].zipuncmp;
 #endif
 	t.zipfile_num=zipfile;
-	if (zipfile_to_tile(m, cd, &t))
+	if (zipfile_to_tile(m, zipfile, &t)) {
 		push_tile(mr, &t, offset, length);
-	file_data_free(f, (unsigned char *)cd);
+		if (!offset && !length) {
+			binfile_tile_submaps(mr);
+			binfile_tile_spans(mr);
+		}
+	}
 }
 
 
@@ -1444,10 +1912,11 @@ push_zipfile_tile(struct map_rect_priv *mr, int zipfile, int offset, int length,
         struct map_priv *m=mr->m;
 	struct file *f=m->fi;
 	long long cdoffset=m->eoc64?m->eoc64->zip64eofst:m->eoc->zipeofst;
-	struct zip_cd *cd=(struct zip_cd *)(file_data_read(f, cdoffset + zipfile*m->cde_size, m->cde_size));
-	dbg(lvl_debug,"read from %lld %d bytes\n",cdoffset + zipfile*m->cde_size, m->cde_size);
-	cd_to_cpu(cd);
-	if (!cd->zipcunc && m->url) {
+	struct zip_cd *cd=NULL;
+	if (!m->members[zipfile].zipuncmp && m->url) {
+		cd=(struct zip_cd *)(file_data_read(f, cdoffset + zipfile*m->cde_size, m->cde_size));
+		dbg(lvl_debug,"read from %lld %d bytes\n",cdoffset + zipfile*m->cde_size, m->cde_size);
+		cd_to_cpu(cd);
 		cd=download(m, mr, cd, zipfile, offset, length, async);
 		if (!cd)
 			return 1;
@@ -1461,6 +1930,7 @@ map_rect_new_binfile_int(struct map_priv *map, struct map_selection *sel)
 {
 	struct map_rect_priv *mr;
 
+	binfile_open_deferred(map);
 	binfile_check_version(map);
 	dbg(lvl_debug,"map_rect_new_binfile\n");
 	if (!map->fi && !map->url)
@@ -1476,42 +1946,55 @@ map_rect_new_binfile_int(struct map_priv *map, struct map_selection *sel)
 	return mr;
 }
 
-static void
-tile_bbox(char *tile, int len, struct coord_rect *r)
+/**
+ * @brief Shrinks the area of a tile to the area of one of its subtiles
+ *
+ * @param tile The letter naming the subtile, 'a' to 'd'
+ * @param r The area of the tile, returns the area of the subtile
+ * @return 1 on success, 0 if tile is not a valid subtile letter
+ */
+static int
+tile_bbox_subtile(char tile, struct coord_rect *r)
 {
         struct coord c;
 	int overlap=1;
         int xo,yo;
+        c.x=(r->lu.x+r->rl.x)/2;
+        c.y=(r->lu.y+r->rl.y)/2;
+        xo=(r->rl.x-r->lu.x)*overlap/100;
+        yo=(r->lu.y-r->rl.y)*overlap/100;
+        switch (tile) {
+        case 'a':
+                r->lu.x=c.x-xo;
+                r->rl.y=c.y-yo;
+                break;
+        case 'b':
+                r->rl.x=c.x+xo;
+                r->rl.y=c.y-yo;
+                break;
+        case 'c':
+                r->lu.x=c.x-xo;
+                r->lu.y=c.y+yo;
+                break;
+        case 'd':
+                r->rl.x=c.x+xo;
+                r->lu.y=c.y+yo;
+                break;
+        default:
+                return 0;
+        }
+        return 1;
+}
+
+static void
+tile_bbox(char *tile, int len, struct coord_rect *r)
+{
 	struct coord_rect world_bbox = {
 	        { WORLD_BOUNDINGBOX_MIN_X, WORLD_BOUNDINGBOX_MAX_Y}, /* left upper corner */
 	        { WORLD_BOUNDINGBOX_MAX_X, WORLD_BOUNDINGBOX_MIN_Y}, /* right lower corner */
 	};
         *r=world_bbox;
-        while (len) {
-                c.x=(r->lu.x+r->rl.x)/2;
-                c.y=(r->lu.y+r->rl.y)/2;
-                xo=(r->rl.x-r->lu.x)*overlap/100;
-                yo=(r->lu.y-r->rl.y)*overlap/100;
-                switch (*tile) {
-                case 'a':
-                        r->lu.x=c.x-xo;
-                        r->rl.y=c.y-yo;
-                        break;
-                case 'b':
-                        r->rl.x=c.x+xo;
-                        r->rl.y=c.y-yo;
-                        break;
-                case 'c':
-                        r->lu.x=c.x-xo;
-                        r->lu.y=c.y+yo;
-                        break;
-                case 'd':
-                        r->rl.x=c.x+xo;
-                        r->lu.y=c.y+yo;
-                        break;
-                default:
-                        return;
-                }
+        while (len && tile_bbox_subtile(*tile, r)) {
                 tile++;
                 len--;
         }
@@ -1574,58 +2057,134 @@ map_rect_new_binfile(struct map_priv *map, struct map_selection *sel)
 	return mr;
 }
 
+/**
+ * @brief Opens the change journal <map>.log
+ *
+ * @param mode 0 to read it, 1 to write to it, 2 to create it for writing
+ * @return The journal, or NULL if it could not be opened
+ */
+static struct file *
+binfile_changes_open(struct map_priv *m, int mode)
+{
+	struct attr cache,readwrite,create;
+	struct attr *attrs[]={&cache,NULL,NULL,NULL};
+	char *changes_file=g_strdup_printf("%s.log",m->filename);
+	struct file *ret;
+
+	cache.type=attr_cache;
+	cache.u.num=0;
+	readwrite.type=attr_readwrite;
+	readwrite.u.num=1;
+	create.type=attr_create;
+	create.u.num=1;
+	if (mode > 0)
+		attrs[1]=&readwrite;
+	if (mode > 1)
+		attrs[2]=&create;
+	ret=file_create(changes_file, attrs);
+	g_free(changes_file);
+	return ret;
+}
+
 static void
-write_changes_do(gpointer key, gpointer value, gpointer user_data)
+binfile_changes_sync(struct map_priv *m)
 {
-	struct binfile_hash_entry *entry=key;
-	FILE *out=user_data;
-	if (entry->flags) {
-		entry->flags=0;
-		fwrite(entry, sizeof(*entry)+(le32_to_cpu(entry->data[0])+1)*4, 1, out);
-		dbg(lvl_debug,"yes\n");
+	if (m->changes_journal && m->changes_unsynced) {
+		file_fsync(m->changes_journal);
+		m->changes_unsynced=0;
 	}
 }
 
+/**
+ * @brief Appends the changed items which are not written yet to the journal <map>.log
+ *
+ * The records are written with a single write. The journal is synced to disk once
+ * BINFILE_CHANGES_SYNC records were written since the last sync, and when the map
+ * is destroyed.
+ */
 static void
 write_changes(struct map_priv *m)
 {
-	FILE *changes;
-	char *changes_file;
-	if (!m->changes)
+	struct binfile_hash_entry *entry;
+	unsigned char *records;
+	int i,len,size=0;
+
+	if (!m->changes_dirty || !m->changes_dirty->len)
 		return;
-	changes_file=g_strdup_printf("%s.log",m->filename);
-	changes=fopen(changes_file,"ab");
-	g_hash_table_foreach(m->changes, write_changes_do, changes);
-	fclose(changes);
-	g_free(changes_file);
+	if (!m->changes_journal)
+		m->changes_journal=binfile_changes_open(m, 1);
+	if (!m->changes_journal)
+		m->changes_journal=binfile_changes_open(m, 2);
+	if (!m->changes_journal) {
+		dbg(lvl_error,"failed to open %s.log\n", m->filename);
+		return;
+	}
+	for (i = 0 ; i < m->changes_dirty->len ; i++) {
+		entry=g_ptr_array_index(m->changes_dirty, i);
+		size+=sizeof(*entry)+(le32_to_cpu(entry->data[0])+1)*4;
+	}
+	records=g_malloc(size);
+	size=0;
+	for (i = 0 ; i < m->changes_dirty->len ; i++) {
+		entry=g_ptr_array_index(m->changes_dirty, i);
+		entry->flags=0;
+		len=sizeof(*entry)+(le32_to_cpu(entry->data[0])+1)*4;
+		memcpy(records+size, entry, len);
+		size+=len;
+	}
+	if (!file_data_write(m->changes_journal, file_size(m->changes_journal), size, records))
+		dbg(lvl_error,"failed to write %s.log\n", m->filename);
+	m->changes_unsynced+=m->changes_dirty->len;
+	g_ptr_array_set_size(m->changes_dirty, 0);
+	g_free(records);
+	if (m->changes_unsynced >= BINFILE_CHANGES_SYNC)
+		binfile_changes_sync(m);
 }
 
+/**
+ * @brief Reads the changed items from the journal <map>.log
+ *
+ * The journal is mapped into memory and read in one go, later records of an item
+ * replace earlier ones.
+ */
 static void
 load_changes(struct map_priv *m)
 {
-	FILE *changes;
-	char *changes_file;
-	struct binfile_hash_entry entry,*e;
-	int size;
-	changes_file=g_strdup_printf("%s.log",m->filename);
-	changes=fopen(changes_file,"rb");
-	if (! changes) {
-		g_free(changes_file);
+	struct file *journal=binfile_changes_open(m, 0);
+	struct binfile_hash_entry *e;
+	unsigned char *pos;
+	int len;
+
+	if (! journal)
 		return;
-	}
 	m->changes=g_hash_table_new_full(binfile_hash_entry_hash, binfile_hash_entry_equal, g_free, NULL);
-	while (fread(&entry, sizeof(entry), 1, changes) == 1) {
-		if (fread(&size, sizeof(size), 1, changes) != 1)
-			break;
-		e=g_malloc(sizeof(struct binfile_hash_entry)+(le32_to_cpu(size)+1)*4);
-		*e=entry;
-		e->data[0]=size;
-		if (fread(e->data+1, le32_to_cpu(size)*4, 1, changes) != 1)
-			break;
-		g_hash_table_replace(m->changes, e, e);
+	if (file_size(journal) && file_mmap(journal)) {
+		pos=journal->begin;
+		while (pos+sizeof(*e)+sizeof(int) <= journal->end) {
+			len=sizeof(*e)+(le32_to_cpu(((struct binfile_hash_entry *)pos)->data[0])+1)*4;
+			if (len < (int)(sizeof(*e)+sizeof(int)) || pos+len > journal->end)
+				break;
+			e=g_malloc(len);
+			memcpy(e, pos, len);
+			e->flags=0;
+			g_hash_table_replace(m->changes, e, e);
+			pos+=len;
+		}
 	}
-	fclose(changes);
-	g_free(changes_file);
+	file_destroy(journal);
+}
+
+static void
+binfile_changes_destroy(struct map_priv *m)
+{
+	write_changes(m);
+	binfile_changes_sync(m);
+	if (m->changes_journal)
+		file_destroy(m->changes_journal);
+	if (m->changes_dirty)
+		g_ptr_array_free(m->changes_dirty, TRUE);
+	if (m->changes)
+		g_hash_table_destroy(m->changes);
 }
 
 
@@ -1639,6 +2198,8 @@ map_rect_destroy_binfile(struct map_rect_priv *mr)
 #endif
 	if (mr->tiles[0].fi && mr->tiles[0].start)
 		file_data_free(mr->tiles[0].fi, (unsigned char *)(mr->tiles[0].start));
+	g_free(mr->tiles[0].matches);
+	g_free(mr->tiles[0].spans);
 	g_free(mr->url);
 	map_binfile_http_close(mr->m);
         g_free(mr);
@@ -1718,33 +2279,337 @@ map_parse_country_binfile(struct map_rect_priv *mr)
 	push_zipfile_tile(mr, at.u.num, 0, 0, 0);
 }
 
+/**
+ * @brief Decodes the current item of a map rect, which must be a submap item
+ *
+ * @return 1 on success, 0 if the item lacks its area, order or zipfile reference
+ */
 static int
-map_parse_submap(struct map_rect_priv *mr, int async)
+binfile_submap_decode(struct map_rect_priv *mr, struct binfile_submap *s)
 {
-	struct coord_rect r;
 	struct coord c[2];
 	struct attr at;
-	struct range mima;
 	if (binfile_coord_get(mr->item.priv_data, c, 2) != 2)
 		return 0;
-	r.lu.x=c[0].x;
-	r.lu.y=c[1].y;
-	r.rl.x=c[1].x;
-	r.rl.y=c[0].y;
+	s->r.lu.x=c[0].x;
+	s->r.lu.y=c[1].y;
+	s->r.rl.x=c[1].x;
+	s->r.rl.y=c[0].y;
 	if (!binfile_attr_get(mr->item.priv_data, attr_order, &at))
 		return 0;
 #if __BYTE_ORDER == __BIG_ENDIAN
-	mima.min=le16_to_cpu(at.u.range.max);
-	mima.max=le16_to_cpu(at.u.range.min);
+	s->order.min=le16_to_cpu(at.u.range.max);
+	s->order.max=le16_to_cpu(at.u.range.min);
 #else
-	mima=at.u.range;
+	s->order=at.u.range;
 #endif
-	if (!mr->m->eoc || !selection_contains(mr->sel, &r, &mima))
-		return 0;
 	if (!binfile_attr_get(mr->item.priv_data, attr_zipfile_ref, &at))
 		return 0;
-	dbg(lvl_debug,"pushing zipfile %ld from %d\n", at.u.num, mr->t->zipfile_num);
-	return push_zipfile_tile(mr, at.u.num, 0, 0, async);
+	s->zipfile=at.u.num;
+	return 1;
+}
+
+static int
+map_parse_submap(struct map_rect_priv *mr, int async)
+{
+	struct binfile_submap s;
+	if (!binfile_submap_decode(mr, &s))
+		return 0;
+	if (!mr->m->eoc || !selection_contains(mr->sel, &s.r, &s.order))
+		return 0;
+	dbg(lvl_debug,"pushing zipfile %d from %d\n", s.zipfile, mr->t->zipfile_num);
+	return push_zipfile_tile(mr, s.zipfile, 0, 0, async);
+}
+
+static int
+binfile_rect_contains(struct coord_rect *r, struct coord_rect *inner)
+{
+	return r->lu.x <= inner->lu.x && r->rl.x >= inner->rl.x && r->lu.y >= inner->lu.y && r->rl.y <= inner->rl.y;
+}
+
+static void
+binfile_quadtree_add(struct binfile_quadtree *q, struct binfile_submap *s, int idx)
+{
+	struct coord_rect r;
+	int depth,i;
+
+	for (depth = 0 ; depth < BINFILE_QUADTREE_DEPTH ; depth++) {
+		for (i = 0 ; i < 4 ; i++) {
+			r=q->r;
+			tile_bbox_subtile('a'+i, &r);
+			if (binfile_rect_contains(&r, &s->r))
+				break;
+		}
+		if (i == 4)
+			break;
+		if (!q->children[i]) {
+			q->children[i]=g_new0(struct binfile_quadtree, 1);
+			q->children[i]->r=r;
+		}
+		q=q->children[i];
+	}
+	if (!q->submaps)
+		q->submaps=g_array_new(FALSE, FALSE, sizeof(int));
+	g_array_append_val(q->submaps, idx);
+}
+
+static void
+binfile_quadtree_destroy(struct binfile_quadtree *q)
+{
+	int i;
+	if (!q)
+		return;
+	for (i = 0 ; i < 4 ; i++)
+		binfile_quadtree_destroy(q->children[i]);
+	if (q->submaps)
+		g_array_free(q->submaps, TRUE);
+	g_free(q);
+}
+
+/**
+ * @brief Collects the indices of the submaps in a quadtree which match a selection
+ */
+static void
+binfile_quadtree_query(struct binfile_quadtree *q, struct binfile_submaps *submaps, struct map_selection *sel,
+		       GArray *matches)
+{
+	struct binfile_submap *s;
+	struct map_selection *curr;
+	int i,idx;
+
+	for (curr = sel ; curr ; curr = curr->next) {
+		if (coord_rect_overlap(&q->r, &curr->u.c_rect))
+			break;
+	}
+	/* The root is always searched, it also holds the submaps extending beyond the world */
+	if (!curr && q != submaps->root)
+		return;
+	if (q->submaps) {
+		for (i = 0 ; i < q->submaps->len ; i++) {
+			idx=g_array_index(q->submaps, int, i);
+			s=&submaps->submaps[idx];
+			if (selection_contains(sel, &s->r, &s->order))
+				g_array_append_val(matches, idx);
+		}
+	}
+	for (i = 0 ; i < 4 ; i++) {
+		if (q->children[i])
+			binfile_quadtree_query(q->children[i], submaps, sel, matches);
+	}
+}
+
+static int
+binfile_compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief Decodes the submap items of a tile
+ *
+ * @return The submaps, or NULL if the tile has none
+ */
+static struct binfile_submaps *
+binfile_submaps_new(struct map_priv *m, struct tile *tile)
+{
+	struct map_rect_priv *mr=g_new0(struct map_rect_priv, 1);
+	GArray *submaps=g_array_new(FALSE, FALSE, sizeof(struct binfile_submap));
+	struct binfile_submaps *ret=NULL;
+	struct binfile_submap s,*prev;
+	struct tile *t;
+	int i,end;
+	struct coord_rect world_bbox = {
+	        { WORLD_BOUNDINGBOX_MIN_X, WORLD_BOUNDINGBOX_MAX_Y}, /* left upper corner */
+	        { WORLD_BOUNDINGBOX_MAX_X, WORLD_BOUNDINGBOX_MIN_Y}, /* right lower corner */
+	};
+
+	mr->m=m;
+	mr->item.priv_data=mr;
+	mr->t=t=&mr->tiles[0];
+	*t=*tile;
+	t->pos_next=t->start;
+	while (t->pos_next < t->end) {
+		t->pos=t->pos_next;
+		setup_pos(mr);
+		if (mr->item.type != type_submap)
+			continue;
+		binfile_coord_rewind(mr);
+		binfile_attr_rewind(mr);
+		/* Submaps which can't be decoded are left to map_parse_submap() */
+		if (!binfile_submap_decode(mr, &s))
+			continue;
+		s.pos=t->pos-t->start;
+		s.next=t->pos_next-t->start;
+		g_array_append_val(submaps, s);
+	}
+	g_free(mr);
+	if (submaps->len) {
+		ret=g_new0(struct binfile_submaps, 1);
+		ret->count=submaps->len;
+		ret->submaps=(struct binfile_submap *)g_array_free(submaps, FALSE);
+		end=ret->count-1;
+		for (i = ret->count-1 ; i >= 0 ; i--) {
+			prev=&ret->submaps[i];
+			if (i < ret->count-1 && prev->next != ret->submaps[i+1].pos)
+				end=i;
+			prev->run_end=end;
+		}
+		ret->root=g_new0(struct binfile_quadtree, 1);
+		ret->root->r=world_bbox;
+		for (i = 0 ; i < ret->count ; i++)
+			binfile_quadtree_add(ret->root, &ret->submaps[i], i);
+	} else
+		g_array_free(submaps, TRUE);
+	return ret;
+}
+
+static void
+binfile_submaps_destroy(struct binfile_submaps *submaps)
+{
+	if (!submaps)
+		return;
+	binfile_quadtree_destroy(submaps->root);
+	g_free(submaps->submaps);
+	g_free(submaps);
+}
+
+/* Marks members whose tile has been decoded and has no submaps */
+static struct binfile_submaps binfile_no_submaps;
+
+/**
+ * @brief Sets up the submaps of the tile just pushed to a map rect
+ *
+ * The submap items of a tile are decoded the first time the tile is entered, later
+ * map rects look up the submaps matching their selection in the quadtree.
+ */
+static void
+binfile_tile_submaps(struct map_rect_priv *mr)
+{
+	struct map_priv *m=mr->m;
+	struct tile *t=mr->t;
+	struct binfile_submaps *submaps;
+	GArray *matches;
+
+	if (!m->submaps || mr->country_id || m->members[t->zipfile_num].leaf)
+		return;
+	submaps=g_atomic_pointer_get(&m->submaps[t->zipfile_num]);
+	if (!submaps) {
+		submaps=binfile_submaps_new(m, t);
+		if (!submaps)
+			submaps=&binfile_no_submaps;
+		/* Another map rect may have decoded the same tile meanwhile */
+		if (!g_atomic_pointer_compare_and_exchange(&m->submaps[t->zipfile_num], NULL, submaps)) {
+			if (submaps != &binfile_no_submaps)
+				binfile_submaps_destroy(submaps);
+			submaps=g_atomic_pointer_get(&m->submaps[t->zipfile_num]);
+		}
+	}
+	if (submaps == &binfile_no_submaps)
+		return;
+	t->submaps=submaps;
+	t->submap=0;
+	t->match=0;
+	t->match_count=-1;
+	if (!mr->sel)
+		return;
+	matches=g_array_new(FALSE, FALSE, sizeof(int));
+	binfile_quadtree_query(submaps->root, submaps, mr->sel, matches);
+	t->match_count=matches->len;
+	t->matches=(int *)g_array_free(matches, FALSE);
+	qsort(t->matches, t->match_count, sizeof(int), binfile_compare_int);
+}
+
+/**
+ * @brief Checks whether the items of a type are needed by the selection of a map rect
+ *
+ * Submap items are always needed to reach the tiles below.
+ */
+static int
+binfile_type_selected(struct map_rect_priv *mr, enum item_type type)
+{
+	return type == type_submap || map_selection_contains_item(mr->sel, 1, type);
+}
+
+/**
+ * @brief Restricts the tile just pushed to a map rect to the item types of its selection
+ *
+ * Tiles written by maptool start with an item of type_tile_type_index, which lists
+ * where the items of each type are. The groups of types the selection does not ask
+ * for are skipped without looking at their items.
+ */
+static void
+binfile_tile_spans(struct map_rect_priv *mr)
+{
+	struct tile *t=mr->t;
+	struct attr attr;
+	int *ranges,*spans;
+	int i,count,all=1;
+
+	if (!mr->sel || mr->country_id || t->end-t->start < 3 || le32_to_cpu(t->start[1]) != type_tile_type_index)
+		return;
+	t->pos=t->start;
+	setup_pos(mr);
+	binfile_attr_rewind(mr);
+	if (!binfile_attr_get(mr, attr_type_ranges, &attr)) {
+		t->pos_next=t->start;
+		return;
+	}
+	ranges=attr.u.data;
+	/* The data of the attribute follows its length and type */
+	count=(le32_to_cpu(ranges[-2])-1)/3;
+	spans=g_new(int, count*2);
+	t->span_count=0;
+	for (i = 0 ; i < count ; i++) {
+		if (!binfile_type_selected(mr, le32_to_cpu(ranges[i*3]))) {
+			all=0;
+			continue;
+		}
+		if (t->span_count && spans[t->span_count*2-1] == le32_to_cpu(ranges[i*3+1]))
+			spans[t->span_count*2-1]=le32_to_cpu(ranges[i*3+2]);
+		else {
+			spans[t->span_count*2]=le32_to_cpu(ranges[i*3+1]);
+			spans[t->span_count*2+1]=le32_to_cpu(ranges[i*3+2]);
+			t->span_count++;
+		}
+	}
+	if (all) {
+		g_free(spans);
+		t->pos_next=t->start;
+		return;
+	}
+	t->spans=spans;
+	t->span=0;
+	t->span_end=t->start;
+	t->pos_next=t->start;
+}
+
+/**
+ * @brief Handles the run of submap items starting at the current position of the current tile
+ *
+ * Submaps not matching the selection are skipped without decoding them,
+ * the next one matching is entered.
+ *
+ * @return 1 if the tile to enter is being downloaded, 0 otherwise
+ */
+static int
+binfile_push_submap(struct map_rect_priv *mr)
+{
+	struct tile *t=mr->t;
+	struct binfile_submap *s=t->submaps->submaps;
+	int end=s[t->submap].run_end,next=t->submap;
+
+	if (t->match_count >= 0)
+		next=t->match < t->match_count ? t->matches[t->match] : t->submaps->count;
+	if (next > end) {
+		t->pos_next=t->start+s[end].next;
+		t->submap=end+1;
+		return 0;
+	}
+	t->pos_next=t->start+s[next].next;
+	t->submap=next+1;
+	t->match++;
+	dbg(lvl_debug,"pushing zipfile %d from %d\n", s[next].zipfile, t->zipfile_num);
+	return push_zipfile_tile(mr, s[next].zipfile, 0, 0, 1);
 }
 
 static int
@@ -1786,11 +2651,24 @@ map_rect_get_item_binfile(struct map_rect_priv *mr)
 		if (! t)
 			return NULL;
 		t->pos=t->pos_next;
+		if (t->spans && t->pos >= t->span_end) {
+			if (t->span < t->span_count) {
+				t->pos=t->start+t->spans[t->span*2];
+				t->span_end=t->start+t->spans[t->span*2+1];
+				t->span++;
+			} else
+				t->pos=t->end;
+		}
 		if (t->pos >= t->end) {
 			if (pop_tile(mr))
 				continue;
 			return NULL;
 		}
+		if (t->submaps && t->submap < t->submaps->count && t->submaps->submaps[t->submap].pos == t->pos-t->start) {
+			if (binfile_push_submap(mr))
+				return &busy_item;
+			continue;
+		}
 		setup_pos(mr);
 		binfile_coord_rewind(mr);
 		binfile_attr_rewind(mr);
@@ -1799,6 +2677,10 @@ map_rect_get_item_binfile(struct map_rect_priv *mr)
 				return &busy_item;
 			continue;
 		}
+		if (mr->item.type == type_tile_type_index)
+			continue;
+		if (mr->sel && !mr->country_id && !binfile_type_selected(mr, mr->item.type))
+			continue;
 		if (t->mode != 2) {
 			mr->item.id_hi=t->zipfile_num;
 			mr->item.id_lo=t->pos-t->start;
@@ -2483,6 +3365,25 @@ binmap_get_attr(struct map_priv *m, enum attr_type type, struct attr *attr)
 			attr->u.str=m->progress;
 			return 1;
 		}
+		break;
+	case attr_speed_index:
+		binfile_open_deferred(m);
+		if (m->speed_index) {
+			attr->u.data=m->speed_index;
+			return 1;
+		}
+		break;
+	case attr_bbox:
+		/* Known once the central directory is read, or from the snapshot */
+		if (m->members) {
+			attr->u.data=&m->bbox;
+			return 1;
+		}
+		break;
+	case attr_concurrent:
+		/* Downloads and reopening a changed file replace the data of the map under other map rects */
+		attr->u.num=(m->fi || m->deferred) && !m->check_version && !m->download_enabled;
+		return 1;
 	default:
 		break;
 	}
@@ -2564,20 +3465,25 @@ static int
 map_binfile_zip_setup(struct map_priv *m, char *filename, int mmap)
 {
 	struct zip_cd *first_cd;
-	int i;
+	int i,index_offset=m->index_offset;
 	if (!(m->eoc=binfile_read_eoc(m->fi))) {
 		dbg(lvl_error,"map file %s: unable to read eoc\n", filename);
 		return 0;
 	}
 	dbg_assert(m->eoc->zipedsk == m->eoc->zipecen);
+	/* Tiles of page aligned maps are used in place */
+	if (!mmap && binfile_page_aligned(m->fi)) {
+		dbg(lvl_debug,"map file %s: page aligned, mapping it\n", filename);
+		mmap=1;
+	}
 	if (m->eoc->zipedsk && strlen(filename) > 3) {
 		char *tmpfilename=g_strdup(filename),*ext=tmpfilename+strlen(tmpfilename)-3;
 		m->fis=g_new(struct file *,m->eoc->zipedsk);
 		for (i = 0 ; i < m->eoc->zipedsk-1 ; i++) {
 			sprintf(ext,"b%02d",i+1);
 			m->fis[i]=file_create(tmpfilename, 0);
-			if (mmap)
-				file_mmap(m->fis[i]);
+			if (mmap && file_mmap(m->fis[i]))
+				file_advise_random(m->fis[i]);
 		}
 		m->fis[m->eoc->zipedsk-1]=m->fi;
 		g_free(tmpfilename);
@@ -2588,20 +3494,84 @@ map_binfile_zip_setup(struct map_priv *m, char *filename, int mmap)
 		dbg(lvl_error,"map file %s: no index found\n", filename);
 		return 0;
 	}
-	if (!(first_cd=binfile_read_cd(m, 0, 0))) {
-		dbg(lvl_error,"map file %s: unable to get first cd\n", filename);
-		return 0;
+	if (m->members && m->index_offset != index_offset) {
+		dbg(lvl_error,"map file %s: snapshot does not match the map\n", filename);
+		g_free(m->members);
+		m->members=NULL;
+	}
+	/* Unless they are known from the snapshot */
+	if (!m->members) {
+		if (!(first_cd=binfile_read_cd(m, 0, 0))) {
+			dbg(lvl_error,"map file %s: unable to get first cd\n", filename);
+			return 0;
+		}
+		m->cde_size=sizeof(struct zip_cd)+first_cd->zipcfnl+first_cd->zipcxtl;
+		m->zip_members=m->index_offset/m->cde_size+1;
+		file_data_free(m->fi, (unsigned char *)first_cd);
+		if (!binfile_read_members(m)) {
+			dbg(lvl_error,"map file %s: unable to read central directory\n", filename);
+			return 0;
+		}
 	}
-	m->cde_size=sizeof(struct zip_cd)+first_cd->zipcfnl+first_cd->zipcxtl;
-	m->zip_members=m->index_offset/m->cde_size+1;
 	dbg(lvl_debug,"cde_size %d\n", m->cde_size);
 	dbg(lvl_debug,"members %d\n",m->zip_members);
-	file_data_free(m->fi, (unsigned char *)first_cd);
-	if (mmap)
-		file_mmap(m->fi);
+	m->submaps=g_new0(struct binfile_submaps *, m->zip_members);
+	if (mmap && file_mmap(m->fi))
+		file_advise_random(m->fi);
 	return 1;
 }
 
+/**
+ * @brief Computes a checksum of the decoded central directory
+ *
+ * The fields are hashed one by one, the padding of struct binfile_member is not
+ * initialized.
+ */
+static unsigned long
+binfile_members_crc(struct map_priv *m)
+{
+	struct binfile_member *mb;
+	unsigned long crc=0;
+	int i;
+
+	for (i = 0 ; i < m->zip_members ; i++) {
+		mb=&m->members[i];
+		crc=crc32(crc, (unsigned char *)&mb->offset, sizeof(mb->offset));
+		crc=crc32(crc, (unsigned char *)&mb->zipsize, sizeof(mb->zipsize));
+		crc=crc32(crc, (unsigned char *)&mb->zipuncmp, sizeof(mb->zipuncmp));
+		crc=crc32(crc, (unsigned char *)&mb->zipfnln, sizeof(mb->zipfnln));
+		crc=crc32(crc, (unsigned char *)&mb->zipmthd, sizeof(mb->zipmthd));
+		crc=crc32(crc, (unsigned char *)&mb->zipdsk, sizeof(mb->zipdsk));
+	}
+	return crc;
+}
+
+/**
+ * @brief Opens the persistent cache of decompressed tiles of a map
+ *
+ * The tiles are kept in the binfile directory below the user data directory, in a
+ * directory named after the size, modification time and a checksum of the central
+ * directory of the map, so they are dropped once the map changes.
+ */
+static void
+binfile_tile_cache_open(struct map_priv *m)
+{
+	char *dir=getenv("NAVIT_USER_DATADIR");
+	char *base,*parent,*identity;
+	struct stat st;
+
+	if (!dir || m->tile_cache_size <= 0 || m->fis || !m->members || stat(m->filename, &st))
+		return;
+	base=g_path_get_basename(m->filename);
+	parent=g_strdup_printf("%s/binfile/tiles/%s-%08x", dir, base, g_str_hash(m->filename));
+	identity=g_strdup_printf("%llx-%lx-%08lx", (long long)st.st_size, (long)st.st_mtime,
+				 binfile_members_crc(m));
+	m->tile_cache=tile_cache_new(parent, identity, m->tile_cache_size);
+	m->fi->tile_cache=m->tile_cache;
+	g_free(identity);
+	g_free(parent);
+	g_free(base);
+}
 
 static int
 map_binfile_open(struct map_priv *m)
@@ -2610,8 +3580,11 @@ map_binfile_open(struct map_priv *m)
 	struct map_rect_priv *mr;
 	struct item *item;
 	struct attr attr;
+	struct coord c[2];
 	struct attr readwrite={attr_readwrite, {(void *)1}};
 	struct attr *attrs[]={&readwrite, NULL};
+	struct stat st;
+	char *spdname;
 
 	dbg(lvl_debug,"file_create %s\n", m->filename);
 	m->fi=file_create(m->filename, m->url?attrs:NULL);
@@ -2637,6 +3610,7 @@ map_binfile_open(struct map_priv *m)
 			m->fi=NULL;
 			return 0;
 		}
+		binfile_tile_cache_open(m);
 	} else if (*magic == zip_lfh_sig_rev || *magic == zip_split_sig_rev || *magic == zip_cd_sig_rev || *magic == zip64_eoc_sig_rev) {
 		dbg(lvl_error,"endianness mismatch for '%s'\n", m->filename);
 		file_destroy(m->fi);
@@ -2646,11 +3620,19 @@ map_binfile_open(struct map_priv *m)
 		file_mmap(m->fi);
 	file_data_free(m->fi, (unsigned char *)magic);
 	m->cachedir=g_strdup("/tmp/navit");
-	m->map_version=0;
-	mr=map_rect_new_binfile(m, NULL);
+	/* The map information of a deferred map is known from its snapshot */
+	mr=m->deferred ? NULL : map_rect_new_binfile(m, NULL);
 	if (mr) {
+		m->map_version=0;
 		while ((item=map_rect_get_item_binfile(mr)) == &busy_item);
 		if (item && item->type == type_map_information)  {
+			/* Maps written by newer versions of maptool store the area covered by their items */
+			if (m->members && binfile_coord_get(item->priv_data, c, 2) == 2) {
+				m->bbox.lu.x=MIN(c[0].x, c[1].x);
+				m->bbox.lu.y=MAX(c[0].y, c[1].y);
+				m->bbox.rl.x=MAX(c[0].x, c[1].x);
+				m->bbox.rl.y=MIN(c[0].y, c[1].y);
+			}
 			if (binfile_attr_get(item->priv_data, attr_version, &attr))
 				m->map_version=attr.u.num;
 			if (binfile_attr_get(item->priv_data, attr_map_release, &attr))
@@ -2670,6 +3652,11 @@ map_binfile_open(struct map_priv *m)
 			return 0;
 		}
 	}
+	if (!stat(m->filename, &st)) {
+		spdname=g_strconcat(m->filename, SPEED_INDEX_SUFFIX, NULL);
+		m->speed_index=speed_index_open(spdname, st.st_size, st.st_mtime);
+		g_free(spdname);
+	}
 	return 1;
 }
 
@@ -2680,8 +3667,27 @@ map_binfile_close(struct map_priv *m)
 	file_data_free(m->fi, (unsigned char *)m->index_cd);
 	file_data_free(m->fi, (unsigned char *)m->eoc);
 	file_data_free(m->fi, (unsigned char *)m->eoc64);
+	g_free(m->members);
+	m->members=NULL;
+	binfile_names_destroy(m->names);
+	m->names=NULL;
+	if (m->submaps) {
+		for (i = 0 ; i < m->zip_members ; i++) {
+			if (m->submaps[i] != &binfile_no_submaps)
+				binfile_submaps_destroy(m->submaps[i]);
+		}
+		g_free(m->submaps);
+		m->submaps=NULL;
+	}
 	g_free(m->cachedir);
 	g_free(m->map_release);
+	speed_index_destroy(m->speed_index);
+	m->speed_index=NULL;
+	if (m->tile_cache) {
+		m->fi->tile_cache=NULL;
+		tile_cache_destroy(m->tile_cache);
+		m->tile_cache=NULL;
+	}
 	if (m->fis) {
 		for (i = 0 ; i < m->eoc->zipedsk ; i++) {
 			file_destroy(m->fis[i]);
@@ -2693,6 +3699,7 @@ map_binfile_close(struct map_priv *m)
 static void
 map_binfile_destroy(struct map_priv *m)
 {
+	g_mutex_clear(&m->open_mutex);
 	g_free(m->filename);
 	g_free(m->url);
 	g_free(m->progress);
@@ -2716,12 +3723,160 @@ binfile_check_version(struct map_priv *m)
 }
 
 
+/**
+ * @brief Returns the name of the snapshot of a map
+ *
+ * Snapshots are kept in the binfile directory below the user data directory, named
+ * after the map file and a hash of its path.
+ *
+ * @return The name, or NULL if there is no user data directory
+ */
+static char *
+binfile_snapshot_name(struct map_priv *m)
+{
+	char *dir=getenv("NAVIT_USER_DATADIR");
+	char *base,*ret;
+
+	if (!dir)
+		return NULL;
+	base=g_path_get_basename(m->filename);
+	ret=g_strdup_printf("%s/binfile/%s-%08x.snapshot", dir, base, g_str_hash(m->filename));
+	g_free(base);
+	return ret;
+}
+
+/**
+ * @brief Reads the snapshot of a map
+ *
+ * If the snapshot matches the size and modification time of the map, the map
+ * version, release, area and central directory of the map are taken from it.
+ *
+ * @return 1 if the snapshot was used, 0 otherwise
+ */
+static int
+binfile_snapshot_load(struct map_priv *m)
+{
+	char *name=binfile_snapshot_name(m);
+	struct binfile_snapshot h;
+	unsigned char *data;
+	struct stat st;
+	int size;
+
+	if (!name)
+		return 0;
+	if (stat(m->filename, &st) || !file_get_contents(name, &data, &size)) {
+		g_free(name);
+		return 0;
+	}
+	g_free(name);
+	if (size < sizeof(h)) {
+		g_free(data);
+		return 0;
+	}
+	memcpy(&h, data, sizeof(h));
+	if (h.magic != BINFILE_SNAPSHOT_MAGIC || h.version != BINFILE_SNAPSHOT_VERSION || h.size != st.st_size ||
+	    h.mtime != st.st_mtime || h.zip_members < 1 || h.release_len < 0 ||
+	    size != sizeof(h)+h.release_len+(long long)h.zip_members*sizeof(struct binfile_member) ||
+	    (h.release_len && data[sizeof(h)+h.release_len-1])) {
+		dbg(lvl_debug,"snapshot of %s is outdated\n", m->filename);
+		g_free(data);
+		return 0;
+	}
+	m->map_version=h.map_version;
+	m->zip_members=h.zip_members;
+	m->cde_size=h.cde_size;
+	m->index_offset=h.index_offset;
+	m->bbox=h.bbox;
+	if (h.release_len)
+		m->map_release=g_strdup((char *)data+sizeof(h));
+	m->members=g_new(struct binfile_member, h.zip_members);
+	memcpy(m->members, data+sizeof(h)+h.release_len, h.zip_members*sizeof(struct binfile_member));
+	g_free(data);
+	return 1;
+}
+
+/**
+ * @brief Writes the snapshot of an opened map
+ *
+ * The snapshot is written to a temporary file which then replaces the old one,
+ * so a map never sees a partial snapshot.
+ */
+static void
+binfile_snapshot_save(struct map_priv *m)
+{
+	char *name=binfile_snapshot_name(m);
+	char *dir,*tmpname;
+	struct binfile_snapshot h;
+	struct stat st;
+	FILE *f;
+	int ok;
+
+	if (!name)
+		return;
+	if (!m->members || stat(m->filename, &st)) {
+		g_free(name);
+		return;
+	}
+	memset(&h, 0, sizeof(h));
+	h.magic=BINFILE_SNAPSHOT_MAGIC;
+	h.version=BINFILE_SNAPSHOT_VERSION;
+	h.size=st.st_size;
+	h.mtime=st.st_mtime;
+	h.map_version=m->map_version;
+	h.zip_members=m->zip_members;
+	h.cde_size=m->cde_size;
+	h.index_offset=m->index_offset;
+	h.bbox=m->bbox;
+	h.release_len=m->map_release ? strlen(m->map_release)+1 : 0;
+	dir=g_path_get_dirname(name);
+	file_mkdir(dir, 1);
+	g_free(dir);
+	tmpname=g_strconcat(name, ".tmp", NULL);
+	f=fopen(tmpname, "wb");
+	if (f) {
+		ok=fwrite(&h, sizeof(h), 1, f) == 1;
+		if (ok && h.release_len)
+			ok=fwrite(m->map_release, h.release_len, 1, f) == 1;
+		if (ok)
+			ok=fwrite(m->members, sizeof(struct binfile_member), m->zip_members, f) == m->zip_members;
+		if (fclose(f) || !ok || rename(tmpname, name)) {
+			dbg(lvl_error,"failed to write snapshot %s\n", name);
+			remove(tmpname);
+		}
+	}
+	g_free(tmpname);
+	g_free(name);
+}
+
+/**
+ * @brief Opens a map which was created from its snapshot
+ *
+ * Called whenever the map is about to be used. Does nothing once the map is opened.
+ */
+static void
+binfile_open_deferred(struct map_priv *m)
+{
+	if (!g_atomic_int_get(&m->deferred))
+		return;
+	g_mutex_lock(&m->open_mutex);
+	if (m->deferred) {
+		dbg(lvl_debug,"opening %s\n", m->filename);
+		if (!map_binfile_open(m) && !m->fi) {
+			g_free(m->members);
+			m->members=NULL;
+			m->zip_members=0;
+		}
+		g_atomic_int_set(&m->deferred, 0);
+	}
+	g_mutex_unlock(&m->open_mutex);
+}
+
 static struct map_priv *
 map_new_binfile(struct map_methods *meth, struct attr **attrs, struct callback_list *cbl)
 {
 	struct map_priv *m;
 	struct attr *data=attr_search(attrs, NULL, attr_data);
-	struct attr *check_version,*map_pass,*flags,*url,*download_enabled;
+	struct attr *check_version,*map_pass,*flags,*url,*download_enabled,*tile_cache_size;
 	struct file_wordexp *wexp;
 	char **wexp_data;
 	if (! data)
@@ -2752,11 +3907,22 @@ map_new_binfile(struct map_methods *meth, struct attr **attrs, struct callback_l
 	download_enabled = attr_search(attrs, NULL, attr_update);
 	if (download_enabled)
 		m->download_enabled=download_enabled->u.num;
+	tile_cache_size=attr_search(attrs, NULL, attr_tile_cache_size);
+	if (tile_cache_size)
+		m->tile_cache_size=tile_cache_size->u.num;
+
+	g_mutex_init(&m->open_mutex);
 
-	if (!map_binfile_open(m) && !m->check_version && !m->url) {
+	/* Maps which are neither downloaded nor checked for updates are opened when first used */
+	if (!m->check_version && !m->url && binfile_snapshot_load(m)) {
+		m->deferred=1;
+		load_changes(m);
+	} else if (!map_binfile_open(m) && !m->check_version && !m->url) {
 		map_binfile_destroy(m);
 		m=NULL;
 	} else {
+		if (m->fi && !m->check_version && !m->url)
+			binfile_snapshot_save(m);
 		load_changes(m);
 	}
 	return m;
@@ -166,6 +166,8 @@ void mapset_destroy(struct mapset *ms)
  */
 struct mapset_handle {
 	GList *l;	/**< Pointer to the current (next) map */
+	struct map_selection *sel;	/**< Maps not intersecting this selection are skipped, NULL to return all maps */
+	enum projection pro;		/**< Projection of sel */
 };
 
 /**
@@ -179,54 +181,93 @@ struct mapset_handle {
  */
 struct mapset_handle *
 mapset_open(struct mapset *ms)
+{
+	return mapset_open_selection(ms, NULL, projection_none);
+}
+
+/**
+ * @brief Returns a new handle for a mapset which skips maps outside of a selection
+ *
+ * Maps which report the area they cover with attr_bbox in the projection of the selection
+ * are only returned by mapset_next() if that area intersects one of the rectangles of the
+ * selection, so no map rect has to be built to find out that they have nothing there.
+ * Other maps are always returned.
+ *
+ * @param ms The mapset to get a handle of
+ * @param sel The selection, must be kept until the handle is closed. NULL to return all maps
+ * @param pro The projection of the selection
+ * @return The new mapset handle
+ */
+struct mapset_handle *
+mapset_open_selection(struct mapset *ms, struct map_selection *sel, enum projection pro)
 {
 	struct mapset_handle *ret=NULL;
 	if(ms)
 	{
 		ret=g_new(struct mapset_handle, 1);
 		ret->l=ms->maps;
+		ret->sel=sel;
+		ret->pro=pro;
 	}
 
 	return ret;
 }
 
+/**
+ * @brief Checks whether a map may have items within the selection of a mapset handle
+ */
+static int
+mapset_map_selected(struct mapset_handle *msh, struct map *map)
+{
+	struct map_selection *sel;
+	struct attr bbox;
+
+	if (!msh->sel || map_projection(map) != msh->pro || !map_get_attr(map, attr_bbox, &bbox, NULL))
+		return 1;
+	for (sel = msh->sel ; sel ; sel = sel->next) {
+		if (coord_rect_overlap(&sel->u.c_rect, bbox.u.data))
+			return 1;
+	}
+	return 0;
+}
+
 /**
  * @brief Gets the next map from a mapset handle
  *
  * If you set active to true, this function will not return any maps that
  * have the attr_active attribute associated with them and set to false.
+ * Maps outside of the selection of a handle from mapset_open_selection() are skipped.
  *
  * @param msh The mapset handle to get the next map of
  * @param active Set to true to only get active maps (See description)
  * @return The next map
  */
+static int
+mapset_map_active(struct map *map, int active)
+{
+	struct attr active_attr;
+
+	if (!active)
+		return 1;
+	if (active == 2 && map_get_attr(map, attr_route_active, &active_attr, NULL))
+		return active_attr.u.num;
+	if (active == 3 && map_get_attr(map, attr_search_active, &active_attr, NULL))
+		return active_attr.u.num;
+	if (!map_get_attr(map, attr_active, &active_attr, NULL))
+		return 1;
+	return active_attr.u.num;
+}
+
 struct map * mapset_next(struct mapset_handle *msh, int active)
 {
 	struct map *ret;
-	struct attr active_attr;
 
 	for (;;) {
 		if (!msh || !msh->l)
 			return NULL;
 		ret=msh->l->data;
 		msh->l=g_list_next(msh->l);
-		if (!active)
-			return ret;			
-		if (active == 2 && map_get_attr(ret, attr_route_active, &active_attr, NULL)) {
-			if (active_attr.u.num)
-				return ret;
-			else
-				continue;
-		}
-		if (active == 3 && map_get_attr(ret, attr_search_active, &active_attr, NULL)) {
-			if (active_attr.u.num)
-				return ret;
-			else
-				continue;
-		}
-		if (!map_get_attr(ret, attr_active, &active_attr, NULL))
-			return ret;
-		if (active_attr.u.num)
+		if (mapset_map_active(ret, active) && mapset_map_selected(msh, ret))
 			return ret;
 	}
 }
@@ -23,10 +23,12 @@
 
 /* prototypes */
 enum attr_type;
+enum projection;
 struct attr;
 struct attr_iter;
 struct item;
 struct map;
+struct map_selection;
 struct mapset;
 struct mapset_handle;
 struct mapset_search;
@@ -40,6 +42,7 @@ int mapset_get_attr(struct mapset *ms, enum attr_type type, struct attr *attr, s
 void mapset_destroy(struct mapset *ms);
 struct map *mapset_get_map_by_name(struct mapset *ms, const char*map_name);
 struct mapset_handle *mapset_open(struct mapset *ms);
+struct mapset_handle *mapset_open_selection(struct mapset *ms, struct map_selection *sel, enum projection pro);
 struct map *mapset_next(struct mapset_handle *msh, int active);
 void mapset_close(struct mapset_handle *msh);
 struct mapset_search *mapset_search_new(struct mapset *ms, struct item *item, struct attr *search_attr, int partial);
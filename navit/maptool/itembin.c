@@ -181,6 +181,50 @@ item_bin_remove_attr(struct item_bin *ib, void *ptr)
 	}
 }
 
+/**
+ * @brief Moves attr_flags and attr_maxspeed ahead of all other attributes of an item
+ *
+ * Maps of version 2 and later store these attributes first, flags before maxspeed,
+ * so the binfile driver reads them without scanning the attributes. The size of
+ * the item does not change.
+ */
+void
+item_bin_hot_attrs_first(struct item_bin *ib)
+{
+	static const enum attr_type hot[]={attr_flags, attr_maxspeed};
+	int *start=(int *)(ib+1)+ib->clen;
+	int *end=(int *)ib+ib->len+1;
+	int *a,*buffer,*out;
+	int i,found=0;
+
+	for (a = start ; a < end ; a+=a[0]+1) {
+		if (a[0] < 1)
+			return;
+		if (a[1] == attr_flags || a[1] == attr_maxspeed)
+			found=1;
+	}
+	if (!found || a != end)
+		return;
+	buffer=g_new(int, end-start);
+	out=buffer;
+	for (i = 0 ; i < sizeof(hot)/sizeof(*hot) ; i++) {
+		for (a = start ; a < end ; a+=a[0]+1) {
+			if (a[1] == hot[i]) {
+				memcpy(out, a, (a[0]+1)*sizeof(int));
+				out+=a[0]+1;
+			}
+		}
+	}
+	for (a = start ; a < end ; a+=a[0]+1) {
+		if (a[1] != attr_flags && a[1] != attr_maxspeed) {
+			memcpy(out, a, (a[0]+1)*sizeof(int));
+			out+=a[0]+1;
+		}
+	}
+	memcpy(start, buffer, (end-start)*sizeof(int));
+	g_free(buffer);
+}
+
 void
 item_bin_add_attr_int(struct item_bin *ib, enum attr_type type, int val)
 {
@@ -46,6 +46,7 @@ void graphics_new(struct navit *nav) {
 #include "linguistics.h"
 #include "plugin.h"
 #include "util.h"
+#include "speedindex.h"
 #include "maptool.h"
 
 #define SLIZE_SIZE_DEFAULT_GB 1
@@ -263,13 +264,16 @@ usage()
 	fprintf(f,"-5 (--md5) <file>                 : set file where to write md5 sum\n");
 	fprintf(f,"-6 (--64bit)                      : set zip 64 bit compression\n");
 	fprintf(f,"-a (--attr-debug-level)  <level>  : control which data is included in the debug attribute\n");
+	fprintf(f,"-A (--page-align)                 : store tiles uncompressed and page aligned, to be used in place when the map is memory mapped\n");
 	fprintf(f,"-c (--dump-coordinates)           : dump coordinates after phase 1\n");
 	fprintf(f,"-D (--dump)                       : dump map data to standard output in Navit textfile format\n");
 	fprintf(f,"-e (--end) <phase>                : end at specified phase\n");
 	fprintf(f,"-E (--experimental)               : Enable experimental features (%s)\n",
 		experimental_feature_description ? experimental_feature_description : "-not available in this version-");
 	fprintf(f,"-i (--input-file) <file>          : specify the input file name (OSM), overrules default stdin\n");
+	fprintf(f,"-I (--speed-index)                : also write a speed limit index for vehicle tracking to <result>%s\n", SPEED_INDEX_SUFFIX);
 	fprintf(f,"-k (--keep-tmpfiles)              : do not delete tmp files after processing. useful to reuse them\n");
+	fprintf(f,"-L (--lz4)                        : compress with LZ4 instead of deflate, larger but faster to read\n");
 	fprintf(f,"-n (--ignore-unknown)             : do not output ways and nodes with unknown type\n");
 	fprintf(f,"-N (--nodes-only)                 : process only nodes\n");
 	fprintf(f,"-r (--rule-file) <file>           : read mapping rules from specified file\n");
@@ -301,6 +305,8 @@ struct maptool_params {
 	int end;
 	int dump;
 	int compression_level;
+	int lz4;
+	int page_align;
 	int dump_coordinates;
 	int input;
 	GList *map_handles;
@@ -316,6 +322,7 @@ struct maptool_params {
 	int countries_loaded;
 	int tilesdir_loaded;
 	int max_index_size;
+	int speed_index;
 };
 
 static int
@@ -345,6 +352,7 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 		{"start", 1, 0, 's'},
 		{"timestamp", 1, 0, 't'},
 		{"input-file", 1, 0, 'i'},
+		{"speed-index", 0, 0, 'I'},
 		{"rule-file", 1, 0, 'r'},
 		{"ignore-unknown", 0, 0, 'n'},
 		{"url", 1, 0, 'u'},
@@ -352,9 +360,11 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 		{"slice-size", 1, 0, 'S'},
 		{"unknown-country", 0, 0, 'U'},
 		{"index-size", 0, 0, 'x'},
+		{"lz4", 0, 0, 'L'},
+		{"page-align", 0, 0, 'A'},
 		{0, 0, 0, 0}
 	};
-	c = getopt_long (argc, argv, "5:6DENS:Wa:bc"
+	c = getopt_long (argc, argv, "5:6ADEILNS:Wa:bc"
 				      "e:hi:knm:p:r:s:t:wu:z:Ux:", long_options, option_index);
 	if (c == -1)
 		return 1;
@@ -371,6 +381,15 @@ parse_option(struct maptool_params *p, char **argv, int argc, int *option_index)
 	case 'E':
 		experimental=1;
 		break;
+	case 'I':
+		p->speed_index=1;
+		break;
+	case 'A':
+		p->page_align=1;
+		break;
+	case 'L':
+		p->lz4=1;
+		break;
 	case 'N':
 		p->process_ways=0;
 		break;
@@ -735,6 +754,8 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 		zip_set_timestamp(zip_info, p->timestamp);
 		zip_set_maxnamelen(zip_info, 14+strlen(suffix0));
 		zip_set_compression_level(zip_info, p->compression_level);
+		zip_set_lz4(zip_info, p->lz4);
+		zip_set_page_align(zip_info, p->page_align);
 		if (p->md5file) 
 			zip_set_md5(zip_info, 1);
 		if(!zip_open(zip_info, p->result, zipdir, zipindex)) {
@@ -745,7 +766,7 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 			map_information_attrs[1].type=attr_url;
 			map_information_attrs[1].u.str=p->url;
 		}
-		index_init(zip_info, 1);
+		index_init(zip_info, 2);
 	}
 	for (f = 0 ; f < filename_count ; f++) {
 		files[f]=tempfile(suffix, filenames[f], 0);
@@ -785,9 +806,12 @@ maptool_assemble_map(struct maptool_params *p, char *suffix, char **filenames, c
 		write_countrydir(zip_info,p->max_index_size);
 		zip_set_zipnum(zip_info, zipnum);
 		write_aux_tiles(zip_info);
+		index_finish(zip_info);
 		zip_write_index(zip_info);
 		zip_write_directory(zip_info);
 		zip_close(zip_info);
+		if (p->speed_index)
+			speed_index_finish(p->result);
 		if (p->md5file && zip_get_md5(zip_info, md5_data)) {
 			FILE *md5=fopen(p->md5file,"w");
 			int i;
@@ -986,6 +1010,13 @@ int main(int argc, char **argv)
 		maptool_dump(&p, suffix);
 		exit(0);
 	}
+	if (p.speed_index && p.process_ways && start_phase(&p,"generating speed limit index")) {
+		FILE *ways_split=tempfile(suffix,"ways_split",0);
+		if (ways_split) {
+			speed_index_write(ways_split, p.result);
+			fclose(ways_split);
+		}
+	}
 	if (p.process_relations) {
 		filenames[filename_count]="relations";
 		referencenames[filename_count++]=NULL;
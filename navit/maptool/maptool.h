@@ -197,6 +197,7 @@ int attr_bin_write_data(struct attr_bin *ab, enum attr_type type, void *data, in
 int attr_bin_write_attr(struct attr_bin *ab, struct attr *attr);
 void item_bin_add_attr_data(struct item_bin *ib, enum attr_type type, void *data, int size);
 void item_bin_add_attr(struct item_bin *ib, struct attr *attr);
+void item_bin_hot_attrs_first(struct item_bin *ib);
 void item_bin_add_attr_int(struct item_bin *ib, enum attr_type type, int val);
 void *item_bin_get_attr(struct item_bin *ib, enum attr_type type, void *last);
 struct attr_bin * item_bin_get_attr_bin(struct item_bin *ib, enum attr_type type, void *last);
@@ -349,6 +350,11 @@ int file_writer_finish(struct item_bin_sink_func *file_writer);
 int tile_collector_process(struct item_bin_sink_func *tile_collector, struct item_bin *ib, struct tile_data *tile_data);
 struct item_bin_sink_func *tile_collector_new(struct item_bin_sink *out);
 
+/* speedindex.c */
+
+void speed_index_write(FILE *ways, char *result);
+void speed_index_finish(char *result);
+
 /* tempfile.c */
 
 char *tempfile_name(char *suffix, char *name);
@@ -379,8 +385,11 @@ int create_tile_hash(void);
 void write_tilesdir(struct tile_info *info, struct zip_info *zip_info, FILE *out);
 void merge_tiles(struct tile_info *info);
 extern struct attr map_information_attrs[32];
+void index_bbox_extend(struct item_bin *ib);
 void index_init(struct zip_info *info, int version);
+void index_finish(struct zip_info *info);
 void index_submap_add(struct tile_info *info, struct tile_head *th);
+char *tile_group_items(char *data, int size, int *size_ret);
 
 /* zip.c */
 void write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data, int data_size);
@@ -391,6 +400,8 @@ void zip_set_md5(struct zip_info *info, int on);
 int zip_get_md5(struct zip_info *info, unsigned char *out);
 void zip_set_zip64(struct zip_info *info, int on);
 void zip_set_compression_level(struct zip_info *info, int level);
+void zip_set_lz4(struct zip_info *info, int on);
+void zip_set_page_align(struct zip_info *info, int on);
 void zip_set_maxnamelen(struct zip_info *info, int max);
 int zip_get_maxnamelen(struct zip_info *info);
 int zip_add_member(struct zip_info *info);
@@ -318,7 +318,8 @@ process_slice(FILE **in, FILE **reference, int in_count, int with_range, long lo
 	char *slice_data,*zip_data;
 	int zipfiles=0;
 	struct tile_info info;
-	int i;
+	int i,group=1,tile_size;
+	char *tile_data;
 
 	slice_data=malloc(size);
 	assert(slice_data != NULL);
@@ -336,6 +337,8 @@ process_slice(FILE **in, FILE **reference, int in_count, int with_range, long lo
 			fseek(in[i], 0, SEEK_SET);
 		if (reference && reference[i]) {
 			fseek(reference[i], 0, SEEK_SET);
+			/* The references record the offsets of the items as written */
+			group=0;
 		}
 	}
 	info.write=1;
@@ -353,7 +356,12 @@ process_slice(FILE **in, FILE **reference, int in_count, int with_range, long lo
 				fprintf(stderr,"Size error '%s': %d vs %d\n", th->name, th->total_size, th->total_size_used);
 				exit(1);
 			}
-			write_zipmember(zip_info, th->name, zip_get_maxnamelen(zip_info), th->zip_data, th->total_size);
+			if (group && th->total_size) {
+				tile_data=tile_group_items(th->zip_data, th->total_size, &tile_size);
+				write_zipmember(zip_info, th->name, zip_get_maxnamelen(zip_info), tile_data, tile_size);
+				g_free(tile_data);
+			} else
+				write_zipmember(zip_info, th->name, zip_get_maxnamelen(zip_info), th->zip_data, th->total_size);
 			zipfiles++;
 		} else {
 			dbg_assert(fwrite(th->zip_data, th->total_size, 1, zip_get_index(zip_info))==1);
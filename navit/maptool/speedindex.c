@@ -0,0 +1,223 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2011 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include "maptool.h"
+#include "transform.h"
+#include "speedindex.h"
+
+/* Longer segments are split, this bounds how far the index has to look around a query rectangle */
+#define SPEED_INDEX_MAX_SEGMENT 2048
+#define SPEED_INDEX_SHIFT 11
+#define SPEED_INDEX_MAX_CELLS (1 << 20)
+
+struct speed_index_entry {
+	unsigned int cell;
+	unsigned int seq;
+	struct speed_index_segment seg;
+};
+
+static int
+speed_index_entry_cmp(const void *a, const void *b)
+{
+	const struct speed_index_entry *ea=a, *eb=b;
+	if (ea->cell != eb->cell)
+		return ea->cell < eb->cell ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+static void
+speed_index_add_segment(GArray *entries, struct speed_index_header *h, struct coord *c0, struct coord *c1,
+                        struct speed_index_entry *tmpl)
+{
+	long long dx=c1->x-c0->x, dy=c1->y-c0->y;
+	long long len=MAX(dx < 0 ? -dx : dx, dy < 0 ? -dy : dy);
+	int i,n=(len+SPEED_INDEX_MAX_SEGMENT-1)/SPEED_INDEX_MAX_SEGMENT;
+	struct speed_index_entry e=*tmpl;
+
+	if (n < 1)
+		n=1;
+	e.seg.angle=transform_get_angle_delta(c0, c1, 0);
+	for (i = 0 ; i < n ; i++) {
+		e.seg.x0=c0->x+dx*i/n;
+		e.seg.y0=c0->y+dy*i/n;
+		e.seg.x1=c0->x+dx*(i+1)/n;
+		e.seg.y1=c0->y+dy*(i+1)/n;
+		h->max_dx=MAX(h->max_dx, abs(e.seg.x1-e.seg.x0));
+		h->max_dy=MAX(h->max_dy, abs(e.seg.y1-e.seg.y0));
+		e.seq=entries->len;
+		g_array_append_val(entries, e);
+	}
+}
+
+static void
+speed_index_write_padding(FILE *out, long long *pos, long long offset)
+{
+	static char zero[SPEED_INDEX_PAGE_SIZE];
+	while (*pos < offset) {
+		int len=MIN(offset-*pos, SPEED_INDEX_PAGE_SIZE);
+		fwrite(zero, len, 1, out);
+		*pos+=len;
+	}
+}
+
+/**
+ * @brief Writes the speed limit index for the drivable ways of a map
+ *
+ * The index is written to <result>.spd.tmp, speed_index_finish() moves it into place once the
+ * size of the map is known.
+ *
+ * @param ways The ways_split file
+ * @param result The name of the map being generated
+ */
+void
+speed_index_write(FILE *ways, char *result)
+{
+	GArray *entries=g_array_new(FALSE, FALSE, sizeof(struct speed_index_entry));
+	struct speed_index_header h;
+	struct speed_index_entry tmpl,*e;
+	struct item_bin *ib;
+	struct rect r;
+	unsigned int *cells;
+	long long pos,cells_size;
+	char *filename;
+	FILE *out;
+	int i,count;
+
+	memset(&h, 0, sizeof(h));
+	memset(&tmpl, 0, sizeof(tmpl));
+	h.magic=SPEED_INDEX_MAGIC;
+	h.version=SPEED_INDEX_VERSION;
+	fseek(ways, 0, SEEK_SET);
+	while ((ib=read_item(ways))) {
+		struct coord *c=(struct coord *)(ib+1);
+		int *default_flags=item_get_default_flags(ib->type),*flags,*maxspeed;
+		count=ib->clen/2;
+		if (!default_flags || count < 2)
+			continue;
+		flags=item_bin_get_attr(ib, attr_flags, NULL);
+		tmpl.seg.street=h.street_count++;
+		tmpl.seg.type=ib->type;
+		tmpl.seg.flags=flags ? *flags : *default_flags;
+		tmpl.seg.maxspeed=-1;
+		if (tmpl.seg.flags & AF_SPEED_LIMIT) {
+			maxspeed=item_bin_get_attr(ib, attr_maxspeed, NULL);
+			if (maxspeed)
+				tmpl.seg.maxspeed=*maxspeed;
+		}
+		for (i = 0 ; i < count-1 ; i++)
+			speed_index_add_segment(entries, &h, &c[i], &c[i+1], &tmpl);
+	}
+	h.segment_count=entries->len;
+	e=(struct speed_index_entry *)entries->data;
+	if (h.segment_count) {
+		r.l.x=r.h.x=e[0].seg.x0;
+		r.l.y=r.h.y=e[0].seg.y0;
+		for (i = 1 ; i < h.segment_count ; i++) {
+			struct coord c;
+			c.x=e[i].seg.x0;
+			c.y=e[i].seg.y0;
+			bbox_extend(&c, &r);
+		}
+		h.origin_x=r.l.x;
+		h.origin_y=r.l.y;
+		h.shift=SPEED_INDEX_SHIFT;
+		for (;;) {
+			h.w=(((long long)r.h.x-r.l.x) >> h.shift)+1;
+			h.h=(((long long)r.h.y-r.l.y) >> h.shift)+1;
+			if ((long long)h.w*h.h <= SPEED_INDEX_MAX_CELLS)
+				break;
+			h.shift++;
+		}
+	} else {
+		h.w=h.h=1;
+	}
+	for (i = 0 ; i < h.segment_count ; i++)
+		e[i].cell=((e[i].seg.y0-h.origin_y) >> h.shift)*h.w+((e[i].seg.x0-h.origin_x) >> h.shift);
+	qsort(e, h.segment_count, sizeof(*e), speed_index_entry_cmp);
+
+	cells_size=((long long)h.w*h.h+1)*sizeof(unsigned int);
+	cells=g_new0(unsigned int, h.w*h.h+1);
+	for (i = 0 ; i < h.segment_count ; i++)
+		cells[e[i].cell+1]++;
+	for (i = 0 ; i < h.w*h.h ; i++)
+		cells[i+1]+=cells[i];
+	h.cells_offset=SPEED_INDEX_PAGE_SIZE;
+	h.segments_offset=(h.cells_offset+cells_size+SPEED_INDEX_PAGE_SIZE-1)/SPEED_INDEX_PAGE_SIZE*SPEED_INDEX_PAGE_SIZE;
+
+	filename=g_strconcat(result, SPEED_INDEX_SUFFIX, ".tmp", NULL);
+	out=fopen(filename, "wb");
+	if (!out) {
+		fprintf(stderr,"Failed to write speed index %s\n", filename);
+		exit(1);
+	}
+	fwrite(&h, sizeof(h), 1, out);
+	pos=sizeof(h);
+	speed_index_write_padding(out, &pos, h.cells_offset);
+	fwrite(cells, cells_size, 1, out);
+	pos+=cells_size;
+	speed_index_write_padding(out, &pos, h.segments_offset);
+	for (i = 0 ; i < h.segment_count ; i++)
+		fwrite(&e[i].seg, sizeof(e[i].seg), 1, out);
+	fclose(out);
+	fprintf(stderr,"speed index: %d streets, %d segments in %dx%d cells of size %d\n", h.street_count, h.segment_count,
+		h.w, h.h, 1 << h.shift);
+	g_free(filename);
+	g_free(cells);
+	g_array_free(entries, TRUE);
+}
+
+/**
+ * @brief Records the size and modification time of the finished map in the speed limit index and
+ * moves it into place
+ *
+ * @param result The name of the generated map, which has to be closed
+ */
+void
+speed_index_finish(char *result)
+{
+	char *tmpname=g_strconcat(result, SPEED_INDEX_SUFFIX, ".tmp", NULL);
+	char *filename=g_strconcat(result, SPEED_INDEX_SUFFIX, NULL);
+	int64_t stamp[2];
+	struct stat st;
+	FILE *f=fopen(tmpname, "r+b");
+
+	if (f && stat(result, &st)) {
+		fprintf(stderr,"Map %s not found, removing its speed index\n", result);
+		fclose(f);
+		remove(tmpname);
+	} else if (f) {
+		stamp[0]=st.st_size;
+		stamp[1]=st.st_mtime;
+		fseek(f, offsetof(struct speed_index_header, map_size), SEEK_SET);
+		fwrite(stamp, sizeof(stamp), 1, f);
+		fclose(f);
+		rename(tmpname, filename);
+	} else
+		fprintf(stderr,"Speed index %s not found, was the speed index phase skipped?\n", tmpname);
+	g_free(tmpname);
+	g_free(filename);
+}
@@ -313,8 +313,12 @@ write_item(char *tile, struct item_bin *ib, FILE *reference)
 			dbg_assert(fwrite(&th->zipnum, sizeof(th->zipnum), 1, reference)==1);
 			dbg_assert(fwrite(&offset, sizeof(th->total_size_used), 1, reference)==1);
 		}
-		if (th->zip_data)
+		if (th->zip_data) {
 			memcpy(th->zip_data+th->total_size_used, ib, size);
+			item_bin_hot_attrs_first((struct item_bin *)(th->zip_data+th->total_size_used));
+			if (ib->type != type_submap)
+				index_bbox_extend(ib);
+		}
 		th->total_size_used+=size;
 	} else {
 		fprintf(stderr,"no tile hash found for %s\n", tile);
@@ -619,22 +623,158 @@ merge_tiles(struct tile_info *info)
 	} while (work_done);
 }
 
+struct tile_item {
+	enum item_type type;
+	int offset;
+	int len;
+};
+
+static int
+tile_item_cmp(const void *a, const void *b)
+{
+	const struct tile_item *ia=a, *ib=b;
+	if (ia->type != ib->type)
+		return ia->type < ib->type ? -1 : 1;
+	return ia->offset - ib->offset;
+}
+
+/**
+ * @brief Groups the items of a tile by their type
+ *
+ * The items are sorted by type, items of the same type keep their order. They are
+ * preceded by an item of type_tile_type_index. Its attr_type_ranges lists, for each
+ * type, the type and the offsets of its first item and of the end of its last item,
+ * in ints from the start of the tile.
+ *
+ * @param data The items of the tile
+ * @param size Size of the items in bytes
+ * @param size_ret Returns the size of the grouped tile in bytes
+ * @return The grouped tile, to be freed with g_free()
+ */
+char *
+tile_group_items(char *data, int size, int *size_ret)
+{
+	GArray *items=g_array_new(FALSE, FALSE, sizeof(struct tile_item));
+	struct tile_item item,*it;
+	struct item_bin *ib;
+	int *ranges;
+	char *ret;
+	int i,pos,types=0,hdr;
+
+	for (pos = 0 ; pos < size ; pos+=item.len) {
+		ib=(struct item_bin *)(data+pos);
+		item.type=ib->type;
+		item.offset=pos;
+		item.len=(ib->len+1)*4;
+		g_array_append_val(items, item);
+	}
+	qsort(items->data, items->len, sizeof(struct tile_item), tile_item_cmp);
+	for (i = 0 ; i < items->len ; i++) {
+		if (!i || g_array_index(items, struct tile_item, i).type != g_array_index(items, struct tile_item, i-1).type)
+			types++;
+	}
+	/* Item header, attribute header and a triple per type */
+	hdr=5+types*3;
+	ret=g_malloc(hdr*4+size);
+	ranges=g_new(int, types*3);
+	pos=hdr*4;
+	types=0;
+	for (i = 0 ; i < items->len ; i++) {
+		it=&g_array_index(items, struct tile_item, i);
+		if (!i || it->type != it[-1].type) {
+			ranges[types*3]=it->type;
+			ranges[types*3+1]=pos/4;
+			types++;
+		}
+		memcpy(ret+pos, data+it->offset, it->len);
+		pos+=it->len;
+		ranges[types*3-1]=pos/4;
+	}
+	ib=(struct item_bin *)ret;
+	item_bin_init(ib, type_tile_type_index);
+	item_bin_add_attr_data(ib, attr_type_ranges, ranges, types*3*4);
+	dbg_assert(ib->len+1 == hdr);
+	g_free(ranges);
+	g_array_free(items, TRUE);
+	*size_ret=pos;
+	return ret;
+}
+
 struct attr map_information_attrs[32];
 
+/* Area covered by the items written to the tiles */
+static struct rect index_bbox;
+static int index_bbox_valid;
+
+/**
+ * @brief Extends the area covered by the map by the coordinates of an item
+ */
 void
-index_init(struct zip_info *info, int version)
+index_bbox_extend(struct item_bin *ib)
 {
+	struct coord *c=(struct coord *)(ib+1);
+	struct rect r;
+
+	if (ib->clen < 2)
+		return;
+	bbox(c, ib->clen/2, &r);
+	if (index_bbox_valid) {
+		bbox_extend(&r.l, &index_bbox);
+		bbox_extend(&r.h, &index_bbox);
+	} else {
+		index_bbox=r;
+		index_bbox_valid=1;
+	}
+}
+
+/**
+ * @brief Writes the map information item
+ *
+ * The coordinates of the item are the lower left and upper right corner of the area
+ * covered by the items of the map, or of the whole world as long as no item is written.
+ */
+static void
+index_write_map_information(FILE *index)
+{
+	struct rect world={{WORLD_BOUNDINGBOX_MIN_X,WORLD_BOUNDINGBOX_MIN_Y},{WORLD_BOUNDINGBOX_MAX_X,WORLD_BOUNDINGBOX_MAX_Y}};
 	struct item_bin *item_bin;
 	int i;
-	map_information_attrs[0].type=attr_version;
-	map_information_attrs[0].u.num=version;
+
 	item_bin=init_item(type_map_information);
+	item_bin_add_coord_rect(item_bin, index_bbox_valid ? &index_bbox : &world);
 	for (i = 0 ; i < 32 ; i++) {
 		if (!map_information_attrs[i].type)
 			break;
 		item_bin_add_attr(item_bin, &map_information_attrs[i]);
 	}
-	item_bin_write(item_bin, zip_get_index(info));
+	item_bin_write(item_bin, index);
+}
+
+void
+index_init(struct zip_info *info, int version)
+{
+	map_information_attrs[0].type=attr_version;
+	map_information_attrs[0].u.num=version;
+	/* A run may assemble several maps, each covers only its own items */
+	index_bbox_valid=0;
+	index_write_map_information(zip_get_index(info));
+}
+
+/**
+ * @brief Stores the area covered by the items of the map in the map information item
+ *
+ * Must be called once all tiles are written. The map information item is the first
+ * item of the index, written by index_init() with the same size.
+ */
+void
+index_finish(struct zip_info *info)
+{
+	FILE *index=zip_get_index(info);
+	long pos=ftell(index);
+
+	fseek(index, 0, SEEK_SET);
+	index_write_map_information(index);
+	fseek(index, pos, SEEK_SET);
 }
 
 void
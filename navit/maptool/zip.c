@@ -23,12 +23,18 @@
 #include "debug.h"
 #include "maptool.h"
 #include "zipfile.h"
+#include "lz4.h"
+
+/* Alignment of the data of the members with zip_set_page_align() */
+#define ZIP_PAGE_SIZE 4096
 
 struct zip_info {
 	int zipnum;
 	int dir_size;
 	long long offset;
 	int compression_level;
+	int lz4;
+	int page_align;
 	int maxnamelen;
 	int zip64;
 	short date;
@@ -121,8 +127,9 @@ write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data,
 		zip_info->offset,
 	};
 	char *filename;
+	unsigned char *padding=NULL;
 	int crc=0,len,comp_size=data_size;
-	uLongf destlen=data_size+data_size/500+12;
+	uLongf destlen=MAX(data_size+data_size/500+12, lz4_compress_bound(data_size));
 	char *compbuffer;
 
 	compbuffer = malloc(destlen);
@@ -132,8 +139,26 @@ write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data,
 	}
 		crc=crc32(0, NULL, 0);
 		crc=crc32(crc, (unsigned char *)data, data_size);
-	lfh.zipmthd=zip_info->compression_level ? 8:0;
-	if (zip_info->compression_level) {
+	lfh.zipmthd=zip_info->compression_level && !zip_info->page_align ? 8:0;
+	if (zip_info->page_align) {
+		/* The padding has to hold at least the extra field header and the alignment */
+		lfh.zipxtraln=(ZIP_PAGE_SIZE-(zip_info->offset+sizeof(lfh)+filelen+6)%ZIP_PAGE_SIZE)%ZIP_PAGE_SIZE+6;
+		padding=g_malloc0(lfh.zipxtraln);
+		padding[0]=zip_extra_header_id_align & 0xff;
+		padding[1]=zip_extra_header_id_align >> 8;
+		padding[2]=(lfh.zipxtraln-4) & 0xff;
+		padding[3]=(lfh.zipxtraln-4) >> 8;
+		padding[4]=ZIP_PAGE_SIZE & 0xff;
+		padding[5]=ZIP_PAGE_SIZE >> 8;
+	} else if (zip_info->compression_level && zip_info->lz4) {
+		lfh.zipmthd=zip_method_lz4;
+		destlen=lz4_compress((unsigned char *)data, data_size, (unsigned char *)compbuffer, destlen);
+		if (destlen && destlen < data_size) {
+			data=compbuffer;
+			comp_size=destlen;
+		} else
+			lfh.zipmthd=0;
+	} else if (zip_info->compression_level) {
 		int error=compress2_int((Byte *)compbuffer, &destlen, (Bytef *)data, data_size, zip_info->compression_level);
 		if (error == Z_OK) {
 			if (destlen < data_size) {
@@ -166,6 +191,11 @@ write_zipmember(struct zip_info *zip_info, char *name, int filelen, char *data,
 	zip_write(zip_info, &lfh, sizeof(lfh));
 	zip_write(zip_info, filename, filelen);
 	zip_info->offset+=sizeof(lfh)+filelen;
+	if (padding) {
+		zip_write(zip_info, padding, lfh.zipxtraln);
+		zip_info->offset+=lfh.zipxtraln;
+		g_free(padding);
+	}
 	zip_write(zip_info, data, comp_size);
 	zip_info->offset+=comp_size;
 	dbg_assert(fwrite(&cd, sizeof(cd), 1, zip_info->dir)==1);
@@ -286,6 +316,29 @@ zip_set_compression_level(struct zip_info *info, int level)
 	info->compression_level=level;
 }
 
+/**
+ * @brief Compresses the members with zip_method_lz4 instead of deflate
+ *
+ * The compression level then only decides whether members are compressed at all.
+ */
+void
+zip_set_lz4(struct zip_info *info, int on)
+{
+	info->lz4=on;
+}
+
+/**
+ * @brief Stores the members uncompressed, with their data starting on a page boundary
+ *
+ * The local file headers are padded with an extra field, so the binfile driver can use
+ * the tiles of a memory mapped map in place.
+ */
+void
+zip_set_page_align(struct zip_info *info, int on)
+{
+	info->page_align=on;
+}
+
 void
 zip_set_maxnamelen(struct zip_info *info, int max)
 {
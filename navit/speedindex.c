@@ -0,0 +1,149 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <limits.h>
+#include <glib.h>
+#include "debug.h"
+#include "coord.h"
+#include "file.h"
+#include "speedindex.h"
+
+struct speed_index {
+	struct file *file;
+	struct speed_index_header *header;
+	uint32_t *cells;
+	struct speed_index_segment *segments;
+};
+
+/**
+ * @brief Opens the speed limit index of a map
+ *
+ * @param filename The name of the index file
+ * @param map_size The size of the map file
+ * @param map_mtime The modification time of the map file, the index is rejected if either differs
+ * from the map it was built for
+ * @return The index or NULL if it does not exist or is not usable
+ */
+struct speed_index *
+speed_index_open(char *filename, long long map_size, long long map_mtime)
+{
+	struct speed_index *ret;
+	struct speed_index_header *h;
+	struct file *file;
+	long long cells_size,i;
+	uint32_t *cells;
+
+	if (!file_exists(filename))
+		return NULL;
+	file=file_create(filename, NULL);
+	if (!file)
+		return NULL;
+	if (file->size < SPEED_INDEX_PAGE_SIZE || !file_mmap(file)) {
+		file_destroy(file);
+		return NULL;
+	}
+	h=(struct speed_index_header *)file->begin;
+	cells_size=((long long)h->w*h->h+1)*sizeof(uint32_t);
+	if (h->magic != SPEED_INDEX_MAGIC || h->version != SPEED_INDEX_VERSION || h->map_size != map_size ||
+	    h->map_mtime != map_mtime) {
+		dbg(lvl_error,"ignoring speed index '%s', it does not match the map\n", filename);
+		file_destroy(file);
+		return NULL;
+	}
+	/* The grid must fit into the file and cell numbers into an int, and the
+	 * cell table must be a non-decreasing list of offsets into the segments */
+	if (h->shift >= 31 || (long long)h->w*h->h >= INT_MAX ||
+	    h->cells_offset < 0 || h->cells_offset % sizeof(uint32_t) || h->cells_offset > file->size-cells_size ||
+	    h->segments_offset < 0 || h->segments_offset % sizeof(uint32_t) ||
+	    h->segments_offset > file->size-(long long)(h->segment_count*sizeof(struct speed_index_segment)) ||
+	    ((uint32_t *)(file->begin+h->cells_offset))[(long long)h->w*h->h] != h->segment_count) {
+		dbg(lvl_error,"ignoring speed index '%s', it is corrupt\n", filename);
+		file_destroy(file);
+		return NULL;
+	}
+	cells=(uint32_t *)(file->begin+h->cells_offset);
+	for (i = 0 ; i < (long long)h->w*h->h ; i++) {
+		if (cells[i] > cells[i+1]) {
+			dbg(lvl_error,"ignoring speed index '%s', cell %lld is corrupt\n", filename, i);
+			file_destroy(file);
+			return NULL;
+		}
+	}
+	ret=g_new0(struct speed_index, 1);
+	ret->file=file;
+	ret->header=h;
+	ret->cells=cells;
+	ret->segments=(struct speed_index_segment *)(file->begin+h->segments_offset);
+	dbg(lvl_debug,"%s: %d segments in %dx%d cells\n", filename, h->segment_count, h->w, h->h);
+	return ret;
+}
+
+/**
+ * @brief Computes the range of cells which may contain segments touching a rectangle
+ *
+ * @param idx The index
+ * @param r The rectangle
+ * @param x0 Returns the first column
+ * @param y0 Returns the first row
+ * @param x1 Returns the last column
+ * @param y1 Returns the last row
+ * @return 0 if no cell can contain such segments, 1 otherwise
+ */
+int
+speed_index_get_cells(struct speed_index *idx, struct coord_rect *r, int *x0, int *y0, int *x1, int *y1)
+{
+	struct speed_index_header *h=idx->header;
+	long long lx=(long long)r->lu.x-h->max_dx-h->origin_x, rx=(long long)r->rl.x+h->max_dx-h->origin_x;
+	long long ly=(long long)r->rl.y-h->max_dy-h->origin_y, uy=(long long)r->lu.y+h->max_dy-h->origin_y;
+
+	if (rx < 0 || uy < 0 || !h->segment_count)
+		return 0;
+	*x0=lx < 0 ? 0 : lx >> h->shift;
+	*y0=ly < 0 ? 0 : ly >> h->shift;
+	*x1=MIN(rx >> h->shift, h->w-1);
+	*y1=MIN(uy >> h->shift, h->h-1);
+	return *x0 <= *x1 && *y0 <= *y1;
+}
+
+/**
+ * @brief Returns the segments of a cell
+ *
+ * @param idx The index
+ * @param x The column of the cell
+ * @param y The row of the cell
+ * @param count Returns the number of segments
+ * @return The segments, pointing into the mapped file
+ */
+struct speed_index_segment *
+speed_index_get_cell(struct speed_index *idx, int x, int y, int *count)
+{
+	int cell=y*idx->header->w+x;
+
+	*count=idx->cells[cell+1]-idx->cells[cell];
+	return idx->segments+idx->cells[cell];
+}
+
+void
+speed_index_destroy(struct speed_index *idx)
+{
+	if (!idx)
+		return;
+	file_destroy(idx->file);
+	g_free(idx);
+}
@@ -0,0 +1,75 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_SPEEDINDEX_H
+#define NAVIT_SPEEDINDEX_H
+
+#include <stdint.h>
+
+/** @file speedindex.h
+ *
+ * @brief Flat spatial index of the drivable segments of a map, written next to a binfile as <map>.spd
+ *
+ * The file consists of three page aligned sections, all in little endian byte order:
+ * the header, the start index of every grid cell (w*h+1 entries) and the segments, sorted by
+ * cell and street. A segment belongs to the cell containing its start point and is never longer than
+ * max_dx/max_dy, so the segments touching a rectangle are all found in the cells of the rectangle
+ * grown by that amount. The file is used in place via mmap.
+ */
+
+#define SPEED_INDEX_MAGIC 0x4450534e	/* "NSPD" */
+#define SPEED_INDEX_VERSION 2
+#define SPEED_INDEX_PAGE_SIZE 4096
+#define SPEED_INDEX_SUFFIX ".spd"
+
+struct speed_index_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t map_size;		/**< Size of the map file the index was built for */
+	int64_t map_mtime;		/**< Modification time of the map file the index was built for */
+	int32_t origin_x, origin_y;	/**< Lower left corner of cell 0,0 (projection_mg) */
+	uint32_t shift;			/**< log2 of the cell size */
+	uint32_t w, h;			/**< Number of columns and rows */
+	int32_t max_dx, max_dy;		/**< Largest extent of a segment */
+	uint32_t segment_count;
+	uint32_t street_count;
+	uint32_t reserved;
+	int64_t cells_offset;		/**< File offset of the cell start table */
+	int64_t segments_offset;	/**< File offset of the segments */
+};
+
+struct speed_index_segment {
+	int32_t x0, y0, x1, y1;
+	uint32_t street;		/**< Number of the street, segments of a street are adjacent within a cell */
+	uint32_t type;			/**< Item type of the street */
+	uint32_t flags;			/**< Flags of the street */
+	int16_t maxspeed;		/**< Maximum speed of the street, -1 if unknown */
+	int16_t angle;			/**< Direction of the segment as returned by transform_get_angle_delta() */
+};
+
+/* prototypes */
+struct coord_rect;
+struct speed_index;
+struct speed_index *speed_index_open(char *filename, long long map_size, long long map_mtime);
+int speed_index_get_cells(struct speed_index *idx, struct coord_rect *r, int *x0, int *y0, int *x1, int *y1);
+struct speed_index_segment *speed_index_get_cell(struct speed_index *idx, int x, int y, int *count);
+void speed_index_destroy(struct speed_index *idx);
+/* end of prototypes */
+
+#endif
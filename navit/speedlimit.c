@@ -0,0 +1,162 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "debug.h"
+#include "item.h"
+#include "attr.h"
+#include "coord.h"
+#include "projection.h"
+#include "transform.h"
+#include "map.h"
+#include "mapset.h"
+#include "file.h"
+#include "track.h"
+#include "speedlimit.h"
+
+void module_map_binfile_init(void);
+
+struct speedlimit {
+	struct mapset *ms;
+	GList *maps;
+	GMutex mutex;			/**< Protects idle */
+	GSList *idle;			/**< Tracking objects not used by a lookup right now */
+};
+
+/**
+ * @brief Initializes the parts of navit needed for lookups
+ *
+ * Must be called once before speedlimit_open() by programs which do not set
+ * up navit otherwise. Calling it again has no effect.
+ */
+void
+speedlimit_init(void)
+{
+	static gsize initialized;
+
+	if (g_once_init_enter(&initialized)) {
+		file_init();
+		module_map_binfile_init();
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+/**
+ * @brief Opens a set of maps for speed limit lookups
+ *
+ * @param maps NULL terminated list of binfile maps
+ * @return The lookup handle, or NULL if a map could not be opened
+ */
+struct speedlimit *
+speedlimit_open(char **maps)
+{
+	struct speedlimit *sl=g_new0(struct speedlimit, 1);
+	struct attr type={attr_type,{"binfile"}}, data={attr_data}, map_attr={attr_map};
+	struct attr *attrs[]={&type,&data,NULL};
+
+	sl->ms=mapset_new(NULL, NULL);
+	g_mutex_init(&sl->mutex);
+	for (; *maps ; maps++) {
+		data.u.str=*maps;
+		map_attr.u.map=map_new(NULL, attrs);
+		if (!map_attr.u.map) {
+			dbg(lvl_error,"failed to open map '%s'\n", *maps);
+			speedlimit_close(sl);
+			return NULL;
+		}
+		sl->maps=g_list_append(sl->maps, map_attr.u.map);
+		mapset_add_attr(sl->ms, &map_attr);
+	}
+	return sl;
+}
+
+/**
+ * @brief Looks up the speed limit at a position
+ *
+ * Each lookup borrows a tracking object from a pool, the most recently returned
+ * one first. A tracking object keeps the streets loaded for the grid cell of the
+ * last position it looked up, so lookups of nearby positions rarely have to read
+ * the maps. The loaded streets only depend on the cell, so the result does not
+ * depend on the tracking object used or on earlier lookups.
+ *
+ * @param sl The lookup handle
+ * @param lat The latitude of the position
+ * @param lng The longitude of the position
+ * @param heading The direction of travel in degrees
+ * @param result Returns the matched street and its speed limit
+ * @return 1 if the position was matched to a street, 0 if no street is within the offroad limit
+ */
+int
+speedlimit_lookup(struct speedlimit *sl, double lat, double lng, double heading, struct speedlimit_result *result)
+{
+	struct tracking *tr=NULL;
+	struct tracking_match m;
+	struct coord_geo g;
+	struct coord c;
+	int ret;
+
+	g_mutex_lock(&sl->mutex);
+	if (sl->idle) {
+		tr=sl->idle->data;
+		sl->idle=g_slist_delete_link(sl->idle, sl->idle);
+	}
+	g_mutex_unlock(&sl->mutex);
+	if (!tr)
+		tr=tracking_new_batch(sl->ms);
+	g.lat=lat;
+	g.lng=lng;
+	tracking_match_reset(tr, &g);
+	ret=tracking_match_position(tr, &g, 0, heading, &m) && !m.offroad;
+	g_mutex_lock(&sl->mutex);
+	sl->idle=g_slist_prepend(sl->idle, tr);
+	g_mutex_unlock(&sl->mutex);
+
+	memset(result, 0, sizeof(*result));
+	result->type=type_none;
+	result->maxspeed=-1;
+	if (!ret)
+		return 0;
+	result->type=m.item.type;
+	result->id_hi=m.item.id_hi;
+	result->id_lo=m.item.id_lo;
+	result->maxspeed=m.maxspeed;
+	transform_from_geo(projection_mg, &g, &c);
+	result->distance=transform_distance(projection_mg, &c, &m.pos);
+	return 1;
+}
+
+/**
+ * @brief Closes the maps opened by speedlimit_open()
+ *
+ * No lookup may be running when this is called.
+ */
+void
+speedlimit_close(struct speedlimit *sl)
+{
+	GList *l;
+
+	g_slist_free_full(sl->idle, (GDestroyNotify)tracking_destroy);
+	mapset_destroy(sl->ms);
+	for (l = sl->maps ; l ; l = g_list_next(l))
+		map_destroy(l->data);
+	g_list_free(sl->maps);
+	g_mutex_clear(&sl->mutex);
+	g_free(sl);
+}
@@ -0,0 +1,53 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_SPEEDLIMIT_H
+#define NAVIT_SPEEDLIMIT_H
+
+/** @file speedlimit.h
+ *
+ * @brief Looks up the speed limit at a position without a navit object
+ *
+ * A lookup matches the position to a street with the scoring of the vehicle
+ * tracking, but without regard to earlier lookups. All functions but
+ * speedlimit_open() and speedlimit_close() may be called from several threads
+ * at the same time.
+ */
+
+#include "item.h"
+
+/**
+ * @brief The result of a speed limit lookup
+ */
+struct speedlimit_result {
+	enum item_type type;		/**< Type of the matched street, type_none if no street was found */
+	int id_hi, id_lo;		/**< Id of the matched street within its map, 0 if it was read from a speed index */
+	int maxspeed;			/**< The maximum speed allowed on the street in km/h, -1 if not known */
+	int distance;			/**< Distance from the position to the street in meters */
+};
+
+/* prototypes */
+struct speedlimit;
+void speedlimit_init(void);
+struct speedlimit *speedlimit_open(char **maps);
+int speedlimit_lookup(struct speedlimit *sl, double lat, double lng, double heading, struct speedlimit_result *result);
+void speedlimit_close(struct speedlimit *sl);
+/* end of prototypes */
+
+#endif
@@ -19,9 +19,11 @@
 
 void module_map_binfile_init(void);
 void module_vehicle_gpsd_init(void);
+void module_vehicle_replay_init(void);
 void builtin_init(void) {
     module_map_binfile_init();
     module_vehicle_gpsd_init();
+    module_vehicle_replay_init();
 }
 
 #include "start_real.h"
@@ -0,0 +1,345 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include "debug.h"
+#include "file.h"
+#include "tilecache.h"
+
+#define TILE_CACHE_SUFFIX ".tile"
+
+struct tile_cache_entry {
+	long long offset;
+	int size;
+	time_t used;
+	struct tile_cache_entry *prev,*next;
+};
+
+struct tile_cache {
+	char *dir;
+	long long budget;
+	GMutex mutex;				/**< Protects the members below */
+	long long size;				/**< Total size of the cached files */
+	GHashTable *entries;			/**< Maps the offset to the entry */
+	struct tile_cache_entry *first,*last;	/**< Most and least recently used entry */
+};
+
+static guint
+tile_cache_hash(gconstpointer key)
+{
+	const long long *offset=key;
+	return (guint)(*offset ^ (*offset >> 32));
+}
+
+static gboolean
+tile_cache_equal(gconstpointer a, gconstpointer b)
+{
+	return *(const long long *)a == *(const long long *)b;
+}
+
+static char *
+tile_cache_filename(struct tile_cache *tc, long long offset)
+{
+	return g_strdup_printf("%s/%llx" TILE_CACHE_SUFFIX, tc->dir, offset);
+}
+
+static void
+tile_cache_unlink(struct tile_cache *tc, struct tile_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next=e->next;
+	else
+		tc->first=e->next;
+	if (e->next)
+		e->next->prev=e->prev;
+	else
+		tc->last=e->prev;
+}
+
+static void
+tile_cache_link_first(struct tile_cache *tc, struct tile_cache_entry *e)
+{
+	e->prev=NULL;
+	e->next=tc->first;
+	if (e->next)
+		e->next->prev=e;
+	else
+		tc->last=e;
+	tc->first=e;
+}
+
+/* Must be called with the mutex held */
+static void
+tile_cache_remove(struct tile_cache *tc, struct tile_cache_entry *e)
+{
+	char *name=tile_cache_filename(tc, e->offset);
+
+	remove(name);
+	g_free(name);
+	tile_cache_unlink(tc, e);
+	g_hash_table_remove(tc->entries, &e->offset);
+	tc->size-=e->size;
+	g_free(e);
+}
+
+/* Must be called with the mutex held */
+static void
+tile_cache_trim(struct tile_cache *tc)
+{
+	while (tc->size > tc->budget && tc->last)
+		tile_cache_remove(tc, tc->last);
+}
+
+static void
+tile_cache_remove_dir(char *dir)
+{
+	void *d=file_opendir(dir);
+	char *name,*path;
+
+	if (!d)
+		return;
+	while ((name=file_readdir(d))) {
+		if (!strcmp(name, ".") || !strcmp(name, ".."))
+			continue;
+		path=g_strdup_printf("%s/%s", dir, name);
+		remove(path);
+		g_free(path);
+	}
+	file_closedir(d);
+	remove(dir);
+}
+
+static int
+tile_cache_compare_used(const void *a, const void *b, void *data)
+{
+	const struct tile_cache_entry *ea=*(struct tile_cache_entry * const *)a, *eb=*(struct tile_cache_entry * const *)b;
+
+	if (ea->used != eb->used)
+		return ea->used > eb->used ? -1 : 1;
+	return 0;
+}
+
+/**
+ * @brief Reads the files cached in an earlier run
+ *
+ * Leftovers of interrupted writes are removed.
+ */
+static void
+tile_cache_scan(struct tile_cache *tc)
+{
+	GPtrArray *found=g_ptr_array_new();
+	struct tile_cache_entry *e;
+	struct stat st;
+	void *d=file_opendir(tc->dir);
+	char *name,*end,*path;
+	long long offset;
+	int i;
+
+	while (d && (name=file_readdir(d))) {
+		if (name[0] == '.')
+			continue;
+		path=g_strdup_printf("%s/%s", tc->dir, name);
+		offset=g_ascii_strtoll(name, &end, 16);
+		if (end == name || strcmp(end, TILE_CACHE_SUFFIX) || stat(path, &st) || st.st_size > G_MAXINT) {
+			remove(path);
+		} else {
+			e=g_new0(struct tile_cache_entry, 1);
+			e->offset=offset;
+			e->size=st.st_size;
+			e->used=st.st_mtime;
+			g_ptr_array_add(found, e);
+		}
+		g_free(path);
+	}
+	if (d)
+		file_closedir(d);
+	g_qsort_with_data(found->pdata, found->len, sizeof(void *), tile_cache_compare_used, NULL);
+	for (i = found->len-1 ; i >= 0 ; i--) {
+		e=found->pdata[i];
+		g_hash_table_insert(tc->entries, &e->offset, e);
+		tile_cache_link_first(tc, e);
+		tc->size+=e->size;
+	}
+	g_ptr_array_free(found, TRUE);
+}
+
+/**
+ * @brief Opens the persistent cache of a map
+ *
+ * The files are kept in a subdirectory of parent named after the identity of the map.
+ * Other subdirectories of parent are assumed to belong to older versions of the map and
+ * are removed.
+ *
+ * @param parent The directory for the caches of the map
+ * @param identity Identifies the contents of the map, e.g. its size, modification time and checksum
+ * @param budget The maximum size of all cached files in bytes
+ * @return The cache, or NULL if the directory could not be created
+ */
+struct tile_cache *
+tile_cache_new(char *parent, char *identity, long long budget)
+{
+	struct tile_cache *tc;
+	void *d;
+	char *name,*path;
+
+	if ((d=file_opendir(parent))) {
+		while ((name=file_readdir(d))) {
+			if (!strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, identity))
+				continue;
+			path=g_strdup_printf("%s/%s", parent, name);
+			dbg(lvl_debug,"removing outdated cache %s\n", path);
+			tile_cache_remove_dir(path);
+			g_free(path);
+		}
+		file_closedir(d);
+	}
+	path=g_strdup_printf("%s/%s", parent, identity);
+	if (file_mkdir(path, 1) && !file_is_dir(path)) {
+		dbg(lvl_error,"failed to create tile cache %s\n", path);
+		g_free(path);
+		return NULL;
+	}
+	tc=g_new0(struct tile_cache, 1);
+	tc->dir=path;
+	tc->budget=budget;
+	tc->entries=g_hash_table_new(tile_cache_hash, tile_cache_equal);
+	g_mutex_init(&tc->mutex);
+	tile_cache_scan(tc);
+	tile_cache_trim(tc);
+	dbg(lvl_debug,"%s: %lld bytes cached\n", tc->dir, tc->size);
+	return tc;
+}
+
+/**
+ * @brief Copies cached data
+ *
+ * The file is mapped and copied to dest, its modification time is set to mark it as used.
+ *
+ * @param tc The cache
+ * @param offset Offset of the compressed data in the map
+ * @param dest Buffer for the data
+ * @param size Size of the decompressed data, the cached file has to be as large
+ * @return 1 if the data was cached, 0 otherwise
+ */
+int
+tile_cache_get(struct tile_cache *tc, long long offset, unsigned char *dest, int size)
+{
+	struct tile_cache_entry *e;
+	struct stat st;
+	char *name;
+	void *data;
+	int fd,hit,ret=0;
+
+	g_mutex_lock(&tc->mutex);
+	e=g_hash_table_lookup(tc->entries, &offset);
+	hit=e && e->size == size;
+	if (hit) {
+		tile_cache_unlink(tc, e);
+		tile_cache_link_first(tc, e);
+	}
+	g_mutex_unlock(&tc->mutex);
+	if (!hit)
+		return 0;
+	name=tile_cache_filename(tc, offset);
+	fd=open(name, O_RDWR);
+	g_free(name);
+	if (fd == -1)
+		return 0;
+	if (!fstat(fd, &st) && st.st_size == size) {
+		data=mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED) {
+			memcpy(dest, data, size);
+			munmap(data, size);
+			futimens(fd, NULL);
+			ret=1;
+		}
+	}
+	close(fd);
+	return ret;
+}
+
+/**
+ * @brief Adds decompressed data to the cache
+ *
+ * The data is written to a temporary file which then gets its final name, so an
+ * interrupted write never leaves a partial file behind.
+ *
+ * @param tc The cache
+ * @param offset Offset of the compressed data in the map
+ * @param data The decompressed data
+ * @param size Size of the decompressed data
+ */
+void
+tile_cache_put(struct tile_cache *tc, long long offset, unsigned char *data, int size)
+{
+	struct tile_cache_entry *e;
+	char *name,*tmpname;
+	FILE *f;
+	int ok;
+
+	if (size > tc->budget)
+		return;
+	g_mutex_lock(&tc->mutex);
+	e=g_hash_table_lookup(tc->entries, &offset);
+	g_mutex_unlock(&tc->mutex);
+	if (e)
+		return;
+	name=tile_cache_filename(tc, offset);
+	tmpname=g_strdup_printf("%s.%p.tmp", name, (void *)g_thread_self());
+	f=fopen(tmpname, "wb");
+	ok=f && fwrite(data, size, 1, f) == 1;
+	if (f && fclose(f))
+		ok=0;
+	g_mutex_lock(&tc->mutex);
+	if (ok && !g_hash_table_lookup(tc->entries, &offset) && !rename(tmpname, name)) {
+		e=g_new0(struct tile_cache_entry, 1);
+		e->offset=offset;
+		e->size=size;
+		g_hash_table_insert(tc->entries, &e->offset, e);
+		tile_cache_link_first(tc, e);
+		tc->size+=size;
+		tile_cache_trim(tc);
+	} else
+		remove(tmpname);
+	g_mutex_unlock(&tc->mutex);
+	g_free(tmpname);
+	g_free(name);
+}
+
+void
+tile_cache_destroy(struct tile_cache *tc)
+{
+	struct tile_cache_entry *e,*next;
+
+	for (e = tc->first ; e ; e = next) {
+		next=e->next;
+		g_free(e);
+	}
+	g_hash_table_destroy(tc->entries);
+	g_mutex_clear(&tc->mutex);
+	g_free(tc->dir);
+	g_free(tc);
+}
@@ -0,0 +1,43 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_TILECACHE_H
+#define NAVIT_TILECACHE_H
+
+/** @file tilecache.h
+ *
+ * @brief Persistent cache of decompressed map data
+ *
+ * Keeps decompressed zip members of a map in a directory, one file per member named
+ * after the offset of its data in the map. file.c consults it when the memory cache
+ * misses, so tiles decompressed in an earlier run are not decompressed again. Once the
+ * files exceed the budget, the least recently used ones are removed. The modification
+ * time of a file records its last use across runs. All functions but tile_cache_new()
+ * and tile_cache_destroy() may be called from several threads at the same time.
+ */
+
+/* prototypes */
+struct tile_cache;
+struct tile_cache *tile_cache_new(char *parent, char *identity, long long budget);
+int tile_cache_get(struct tile_cache *tc, long long offset, unsigned char *dest, int size);
+void tile_cache_put(struct tile_cache *tc, long long offset, unsigned char *data, int size);
+void tile_cache_destroy(struct tile_cache *tc);
+/* end of prototypes */
+
+#endif
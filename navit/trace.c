@@ -0,0 +1,278 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file trace.c
+ *
+ * @brief Reads recorded GPS traces from NMEA logs and GPX files
+ *
+ * Of NMEA logs the RMC sentences are used. Missing speeds and directions are
+ * derived from the previous fix, missing timestamps are assumed to be one second apart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include "debug.h"
+#include "coord.h"
+#include "transform.h"
+#include "projection.h"
+#include "util.h"
+#include "trace.h"
+
+#define KNOTS_TO_KPH 1.852
+
+/**
+ * @brief Converts an NMEA coordinate in (d)ddmm.mmmm format to degrees
+ */
+static double
+trace_nmea_degrees(char *value, char *hemisphere)
+{
+	double v=g_ascii_strtod(value, NULL);
+	double deg=floor(v/100);
+
+	deg+=(v-deg*100)/60;
+	if (*hemisphere == 'S' || *hemisphere == 'W')
+		deg=-deg;
+	return deg;
+}
+
+static int
+trace_nmea_checksum_ok(char *line)
+{
+	char *star=strchr(line, '*');
+	unsigned char sum=0;
+	char *p;
+
+	if (!star)
+		return 1;
+	for (p=line+1 ; p < star ; p++)
+		sum^=*p;
+	return strtoul(star+1, NULL, 16) == sum;
+}
+
+/**
+ * @brief Parses an RMC sentence
+ *
+ * @return 1 if the sentence contains a valid fix, 0 otherwise
+ */
+static int
+trace_parse_rmc(char *line, struct trace_fix *fix)
+{
+	char **f;
+	char *star;
+	int ret=0;
+
+	if (!trace_nmea_checksum_ok(line))
+		return 0;
+	if ((star=strchr(line, '*')))
+		*star='\0';
+	f=g_strsplit(line, ",", 0);
+	if (g_strv_length(f) >= 10 && f[2][0] == 'A' && strlen(f[1]) >= 6 && strlen(f[9]) == 6 && f[3][0] && f[5][0]) {
+		fix->geo.lat=trace_nmea_degrees(f[3], f[4]);
+		fix->geo.lng=trace_nmea_degrees(f[5], f[6]);
+		fix->speed=f[7][0] ? g_ascii_strtod(f[7], NULL)*KNOTS_TO_KPH : -1;
+		fix->direction=f[8][0] ? g_ascii_strtod(f[8], NULL) : -1;
+		fix->height=0;
+		g_snprintf(fix->time, sizeof(fix->time), "20%.2s-%.2s-%.2sT%.2s:%.2s:%.2sZ",
+			   f[9]+4, f[9]+2, f[9], f[1], f[1]+2, f[1]+4);
+		ret=1;
+	}
+	g_strfreev(f);
+	return ret;
+}
+
+static void
+trace_parse_nmea(GArray *fixes, char *data)
+{
+	struct trace_fix fix;
+	char **lines=g_strsplit_set(data, "\r\n", 0);
+	int i;
+
+	for (i = 0 ; lines[i] ; i++) {
+		char *line=lines[i];
+		if (line[0] != '$' || strlen(line) < 6 || strncmp(line+3, "RMC", 3))
+			continue;
+		if (trace_parse_rmc(line, &fix))
+			g_array_append_val(fixes, fix);
+	}
+	g_strfreev(lines);
+}
+
+/**
+ * @brief Returns the text of an XML element or attribute value within a range of a GPX file
+ *
+ * @param start Start of the range to search in
+ * @param end End of the range
+ * @param key The opening tag or attribute including the quote, e.g. "<time>" or "lat=\""
+ * @param term The character or string terminating the value
+ * @return The value which must be freed with g_free, or NULL if not found
+ */
+static char *
+trace_gpx_value(char *start, char *end, const char *key, const char *term)
+{
+	char *pos=g_strstr_len(start, end-start, key);
+	char *stop;
+
+	if (!pos)
+		return NULL;
+	pos+=strlen(key);
+	stop=g_strstr_len(pos, end-pos, term);
+	if (!stop)
+		return NULL;
+	return g_strndup(pos, stop-pos);
+}
+
+static double
+trace_gpx_double(char *start, char *end, const char *key, const char *term, double def)
+{
+	char *value=trace_gpx_value(start, end, key, term);
+	double ret=def;
+
+	if (value) {
+		ret=g_ascii_strtod(value, NULL);
+		g_free(value);
+	}
+	return ret;
+}
+
+static void
+trace_parse_gpx(GArray *fixes, char *data)
+{
+	struct trace_fix fix;
+	char *pos=data, *start, *end, *close, *next, *time;
+
+	while ((start=strstr(pos, "<trkpt"))) {
+		end=start+strcspn(start, ">");
+		if (!*end)
+			break;
+		/* A self-closing <trkpt .../> has no children, otherwise they end at the
+		 * closing tag or, if that is missing, at the next point */
+		if (end[-1] != '/') {
+			next=strstr(end, "<trkpt");
+			close=strstr(end, "</trkpt>");
+			if (close && (!next || close < next))
+				end=close;
+			else if (next)
+				end=next-1;
+		}
+		memset(&fix, 0, sizeof(fix));
+		fix.geo.lat=trace_gpx_double(start, end, "lat=\"", "\"", NAN);
+		fix.geo.lng=trace_gpx_double(start, end, "lon=\"", "\"", NAN);
+		/* GPX 1.0 records the speed in m/s, GPX 1.1 does not have it at all */
+		fix.speed=trace_gpx_double(start, end, "<speed>", "<", -1);
+		if (fix.speed >= 0)
+			fix.speed*=3.6;
+		fix.direction=trace_gpx_double(start, end, "<course>", "<", -1);
+		fix.height=trace_gpx_double(start, end, "<ele>", "<", 0);
+		time=trace_gpx_value(start, end, "<time>", "<");
+		if (time) {
+			g_strlcpy(fix.time, time, sizeof(fix.time));
+			g_free(time);
+		}
+		if (!isnan(fix.geo.lat) && !isnan(fix.geo.lng))
+			g_array_append_val(fixes, fix);
+		pos=end+1;
+	}
+}
+
+/**
+ * @brief Fills in the timestamps, speeds and directions not recorded in the trace
+ *
+ * Missing speeds and directions are derived from the previous fix.
+ */
+static void
+trace_complete_fixes(GArray *fixes)
+{
+	struct trace_fix *fix,*prev=NULL;
+	struct coord c,pc;
+	unsigned int secs=0;
+	int i;
+
+	for (i = 0 ; i < fixes->len ; i++) {
+		fix=&g_array_index(fixes, struct trace_fix, i);
+		if (fix->time[0])
+			fix->secs=iso8601_to_secs(fix->time);
+		else {
+			/* Without timestamps, assume one fix per second */
+			fix->secs=++secs;
+			g_snprintf(fix->time, sizeof(fix->time), "1970-01-01T%02d:%02d:%02dZ", (secs/3600)%24, (secs/60)%60, secs%60);
+		}
+		transform_from_geo(projection_mg, &fix->geo, &c);
+		if (prev && (fix->speed < 0 || fix->direction < 0)) {
+			if (fix->speed < 0)
+				fix->speed=fix->secs > prev->secs ? transform_distance(projection_mg, &pc, &c)*3.6/(fix->secs-prev->secs) : prev->speed;
+			if (fix->direction < 0)
+				fix->direction=(c.x == pc.x && c.y == pc.y) ? prev->direction : transform_get_angle_delta(&pc, &c, 0);
+		}
+		if (fix->speed < 0)
+			fix->speed=0;
+		if (fix->direction < 0)
+			fix->direction=0;
+		prev=fix;
+		pc=c;
+	}
+}
+
+/**
+ * @brief Parses a recorded trace
+ *
+ * @param data The contents of the trace file, modified while parsing
+ * @param gpx 1 if data is a GPX file, 0 if it is an NMEA log
+ * @return An array of {@code struct trace_fix}, to be freed with g_array_free()
+ */
+GArray *
+trace_parse(char *data, int gpx)
+{
+	GArray *fixes=g_array_new(FALSE, FALSE, sizeof(struct trace_fix));
+
+	if (gpx)
+		trace_parse_gpx(fixes, data);
+	else
+		trace_parse_nmea(fixes, data);
+	trace_complete_fixes(fixes);
+	return fixes;
+}
+
+/**
+ * @brief Reads a recorded trace from a file
+ *
+ * Files ending in .gpx are read as GPX tracks, all others as NMEA logs.
+ *
+ * @param filename The name of the file
+ * @return An array of {@code struct trace_fix}, or NULL if the file could not be read
+ */
+GArray *
+trace_load(char *filename)
+{
+	GArray *ret;
+	GError *error=NULL;
+	char *data;
+
+	if (!g_file_get_contents(filename, &data, NULL, &error)) {
+		dbg(lvl_error, "failed to read '%s': %s\n", filename, error->message);
+		g_error_free(error);
+		return NULL;
+	}
+	ret=trace_parse(data, g_str_has_suffix(filename, ".gpx") || g_str_has_suffix(filename, ".GPX"));
+	g_free(data);
+	dbg(lvl_debug, "loaded %d fixes from '%s'\n", ret->len, filename);
+	return ret;
+}
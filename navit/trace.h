@@ -0,0 +1,43 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef NAVIT_TRACE_H
+#define NAVIT_TRACE_H
+
+#include <glib.h>
+#include "coord.h"
+
+/**
+ * @brief A single fix of a recorded GPS trace
+ */
+struct trace_fix {
+	struct coord_geo geo;
+	double speed;				/**< Speed in km/h */
+	double direction;			/**< Direction in degrees */
+	double height;
+	char time[32];				/**< Time of the fix in ISO 8601 format */
+	unsigned int secs;			/**< Time of the fix as returned by iso8601_to_secs() */
+};
+
+/* prototypes */
+GArray *trace_parse(char *data, int gpx);
+GArray *trace_load(char *filename);
+/* end of prototypes */
+
+#endif
@@ -18,6 +18,7 @@
  */
 
 #include <glib.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
@@ -35,92 +36,65 @@
 #include "vehicle.h"
 #include "util.h"
 #include "callback.h"
+#include "speedindex.h"
 
 struct object_func tracking_func;
 
-struct tracking_line
-{
-	struct street_data *street;
-	struct tracking_line *next;
-	int angle[0];
-};
-
 /**
- * @brief Information about a street
- *
- * This contains information about a certain street
+ * @brief A street loaded for tracking
  */
-struct street_data {
-	struct item item;	/**< The map item for this street */
-	int count;			/**< Number of coordinates this street has */
+struct tracking_street {
+	struct item item;		/**< The map item for this street */
 	int flags;
-	int maxspeed;		/**< Maximum speed allowed on this street. */
-	struct coord c[0];	/**< Pointer to the coordinates of this street.
-						 *   DO NOT INSERT FIELDS AFTER THIS. */
+	int maxspeed;			/**< Maximum speed allowed on this street, -1 if not known */
+	int first;			/**< Index of the first segment of this street in the segment table */
+	int count;			/**< Number of segments of this street */
+	struct coord_rect bbox;		/**< Bounding box of this street */
+	int indexed;			/**< Loaded from a speed index, item only carries the type and the map */
+	int ordinal;			/**< Load order, on equal values streets loaded later are preferred */
 };
 
 /**
- * @brief Gets street data for an item
+ * @brief Uniform grid over the segments of a segment table
  *
- * @param item The item to get the data for
- * @return Street data for the item
+ * Cells are square with a side of 1 << shift. Every segment is registered
+ * in each cell it passes through, so the entries of a cell are all segments
+ * that may be closer to a point in that cell than any cell further away.
  */
-struct street_data *
-street_get_data (struct item *item)
-{
-	int count=0,*flags;
-	struct street_data *ret = NULL, *ret1;
-	struct attr flags_attr, maxspeed_attr;
-	const int step = 128;
-	int c;
-
-	do {
-		ret1=g_realloc(ret, sizeof(struct street_data)+(count+step)*sizeof(struct coord));
-		if (!ret1) {
-			if (ret)
-				g_free(ret);
-			return NULL;
-		}
-		ret = ret1;
-		c = item_coord_get(item, &ret->c[count], step);
-		count += c;
-	} while (c && c == step);
-
-	ret1=g_realloc(ret, sizeof(struct street_data)+count*sizeof(struct coord));
-	if (ret1)
-		ret = ret1;
-	ret->item=*item;
-	ret->count=count;
-	if (item_attr_get(item, attr_flags, &flags_attr)) 
-		ret->flags=flags_attr.u.num;
-	else {
-		flags=item_get_default_flags(item->type);
-		if (flags)
-			ret->flags=*flags;
-		else
-			ret->flags=0;
-	}
-
-	ret->maxspeed = -1;
-	if (ret->flags & AF_SPEED_LIMIT) {
-		if (item_attr_get(item, attr_maxspeed, &maxspeed_attr)) {
-			ret->maxspeed = maxspeed_attr.u.num;
-		}
-	}
-
-	return ret;
-}
+struct tracking_grid {
+	struct coord origin;		/**< Lower left corner of cell 0,0 */
+	int shift;			/**< log2 of the cell size */
+	int w, h;			/**< Number of columns and rows */
+	int *start;			/**< Offset of the first entry of each cell, w*h+1 elements */
+	int *entries;			/**< Segment indices of all cells */
+	int *seen;			/**< Per segment generation of the last visit */
+	int generation;
+	int max_cell;			/**< Largest number of entries in one cell */
+	int *batch;			/**< Scratch space for scoring the segments of one cell */
+	struct coord *batch_lpnt;
+};
 
 /**
- * @brief Frees street data
+ * @brief Table of all segments loaded for tracking
  *
- * @param sd Street data to be freed
+ * The segments are stored in parallel arrays, so the matcher walks through
+ * contiguous memory. The segments of a street are stored one after another.
  */
-void
-street_data_free(struct street_data *sd)
-{
-	g_free(sd);
-}
+struct tracking_segments {
+	int count;			/**< Number of segments */
+	int size;			/**< Number of segments the arrays have room for */
+	int *x0, *y0, *x1, *y1;		/**< Start and end point of each segment */
+	int *angle;			/**< Direction of each segment */
+	int *flags;			/**< Flags of the street owning each segment */
+	int *maxspeed;			/**< Maximum speed of the street owning each segment */
+	int *street;			/**< Index of the street owning each segment */
+	struct tracking_street *streets;
+	int street_count;
+	int street_size;
+	struct tracking_grid grid;
+};
+
+#define TRACKING_SEGMENT_ARRAYS 8
 
 
 /**
@@ -211,14 +185,28 @@ struct tracking {
 	struct map *map;
 	struct vehicle *vehicle;
 	struct coord last_updated;
-	struct tracking_line *lines;
-	struct tracking_line *curr_line;
+	struct tracking_segments *segs;
+	struct item_hash *line_hash;
+	struct coord_rect corridor;
+	int corridor_valid;
+	struct tracking_refresh *refresh_pending;
+	GThread *refresh_thread;
+	GAsyncQueue *refresh_requests, *refresh_results;
+	int refresh_count;			/**< Number of times the loaded streets were refreshed */
+	GThread *prefetch_thread;
+	GAsyncQueue *prefetch_requests;
+	struct coord prefetch_exit;		/**< Predicted position of the next refresh which was prefetched for */
+	int prefetch_valid;
+	int synchronous;			/**< Load streets on the calling thread, see tracking_new_batch() */
+	int curr_seg;
 	int pos;
 	struct coord curr[2], curr_in, curr_out;
 	int curr_angle;
 	struct coord last[2], last_in, last_out;
 	struct cdf_data cdf;
 	struct attr *attr;
+	struct attr **street_attrs;		/**< Attributes last read from street_attrs_item, used while the map is busy */
+	struct item street_attrs_item;
 	int valid;
 	int time;
 	double direction, direction_matched;
@@ -237,6 +225,7 @@ struct tracking {
 	int overspeed_pref;
 	int overspeed_percent_pref;
 	int tunnel_extrapolation;
+	int map_fanout;				/**< Read the maps on one thread each when loading streets */
 };
 
 
@@ -291,12 +280,45 @@ tracking_get_segment_pos(struct tracking *tr)
 	return tr->pos;
 }
 
-struct street_data *
-tracking_get_street_data(struct tracking *tr)
+/* Serializes reading map items between tracking objects loading streets on different threads,
+ * for maps which do not support concurrent map rects */
+static GMutex tracking_map_mutex;
+/* Number of threads waiting for tracking_map_mutex to load streets, prefetching yields to them */
+static gint tracking_map_waiters;
+
+/**
+ * @brief Checks whether a map may be read by map rects on several threads at the same time
+ */
+static int
+tracking_map_concurrent(struct map *m)
 {
-	if (tr->curr_line)
-		return tr->curr_line->street;
-	return NULL;
+	struct attr attr;
+
+	return map_get_attr(m, attr_concurrent, &attr, NULL) && attr.u.num;
+}
+
+/**
+ * @brief Locks tracking_map_mutex to load streets unless the map supports concurrent map rects
+ *
+ * @return 1 if the mutex was locked
+ */
+static int
+tracking_map_lock(struct map *m)
+{
+	if (tracking_map_concurrent(m))
+		return 0;
+	g_atomic_int_inc(&tracking_map_waiters);
+	g_mutex_lock(&tracking_map_mutex);
+	g_atomic_int_add(&tracking_map_waiters, -1);
+	return 1;
+}
+
+static struct tracking_street *
+tracking_get_current_street(struct tracking *tr)
+{
+	if (!tr->segs || tr->curr_seg < 0)
+		return NULL;
+	return &tr->segs->streets[tr->segs->street[tr->curr_seg]];
 }
 
 int
@@ -304,7 +326,8 @@ tracking_get_attr(struct tracking *_this, enum attr_type type, struct attr *attr
 {
 	struct item *item;
 	struct map_rect *mr;
-	struct tracking_line *tl;
+	struct tracking_street *st=tracking_get_current_street(_this);
+	int locked;
 
 	int result=0;
 	dbg(lvl_debug,"enter %s\n",attr_to_name(type));
@@ -340,154 +363,1042 @@ tracking_get_attr(struct tracking *_this, enum attr_type type, struct attr *attr
 		attr->u.coord_geo=&_this->coord_geo;
 		return 1;
 	case attr_current_item:
-		if (! _this->curr_line || ! _this->curr_line->street)
+		if (! st || st->indexed)
 			return 0;
-		attr->u.item=&_this->curr_line->street->item;
+		attr->u.item=&st->item;
 		return 1;
 	case attr_street_count:
-		attr->u.num=0;
-		tl=_this->lines;
-		while (tl) {
-			attr->u.num++;
-			tl=tl->next;
-		}
+		attr->u.num=_this->segs ? _this->segs->street_count : 0;
 		return 1;
+	case attr_maxspeed:
+		if (st && (st->flags & AF_SPEED_LIMIT)) {
+			if (st->maxspeed == -1)
+				return 0;
+			attr->u.num=st->maxspeed;
+			return 1;
+		}
+		/* fall through */
 	default:
-		if (! _this->curr_line || ! _this->curr_line->street)
+		if (! st || st->indexed)
 			return 0;
-		item=&_this->curr_line->street->item;
+		item=&st->item;
+		if (!item_is_equal(*item, _this->street_attrs_item)) {
+			attr_list_free(_this->street_attrs);
+			_this->street_attrs=NULL;
+			_this->street_attrs_item=*item;
+		}
+		/* The streets may be loaded from the same map on the refresh thread. Rather than
+		 * blocking the main loop until it is done, return the value read last time */
+		locked=!tracking_map_concurrent(item->map);
+		if (locked && !g_mutex_trylock(&tracking_map_mutex)) {
+			struct attr *last=_this->street_attrs ? attr_search(_this->street_attrs, NULL, type) : NULL;
+			if (!last)
+				return 0;
+			*attr=*last;
+			return 1;
+		}
 		mr=map_rect_new(item->map,NULL);
 		item=map_rect_get_item_byid(mr, item->id_hi, item->id_lo);
-		if (item_attr_get(item, type, attr)) {
+		if (item && item_attr_get(item, type, attr)) {
 			_this->attr=attr_dup(attr);
 			*attr=*_this->attr;
+			_this->street_attrs=attr_generic_set_attr(_this->street_attrs, attr);
 			result=1;
 		}
 		map_rect_destroy(mr);
+		if (locked)
+			g_mutex_unlock(&tracking_map_mutex);
 		return result;
 	}
 }
 
+/**
+ * @brief Returns the map item of the matched street
+ *
+ * @return The item, or NULL if no street is matched or it was read from a speed index
+ */
 struct item *
 tracking_get_current_item(struct tracking *_this)
 {
-	if (! _this->curr_line || ! _this->curr_line->street)
+	struct tracking_street *st=tracking_get_current_street(_this);
+	if (! st || st->indexed)
 		return NULL;
-	return &_this->curr_line->street->item;
+	return &st->item;
 }
 
 int *
 tracking_get_current_flags(struct tracking *_this)
 {
-	if (! _this->curr_line || ! _this->curr_line->street)
+	struct tracking_street *st=tracking_get_current_street(_this);
+	if (! st)
 		return NULL;
-	return &_this->curr_line->street->flags;
+	return &st->flags;
+}
+
+/**
+ * @brief Reads the coordinates and the attributes relevant for tracking of a street
+ *
+ * @param item The item to get the data for
+ * @param c Buffer for the coordinates, grown as needed
+ * @param size Number of coordinates c has room for
+ * @param flags Returns the flags of the street
+ * @param maxspeed Returns the maximum speed allowed on the street or -1
+ * @return The number of coordinates
+ */
+static int
+tracking_street_get_data(struct item *item, struct coord **c, int *size, int *flags, int *maxspeed)
+{
+	int count=0,n,*default_flags;
+	struct attr flags_attr, maxspeed_attr;
+
+	for (;;) {
+		if (count == *size) {
+			*size=*size ? *size*2 : 128;
+			*c=g_renew(struct coord, *c, *size);
+		}
+		n=item_coord_get(item, *c+count, *size-count);
+		count+=n;
+		if (!n || count < *size)
+			break;
+	}
+	if (item_attr_get(item, attr_flags, &flags_attr)) 
+		*flags=flags_attr.u.num;
+	else {
+		default_flags=item_get_default_flags(item->type);
+		if (default_flags)
+			*flags=*default_flags;
+		else
+			*flags=0;
+	}
+
+	*maxspeed = -1;
+	if (*flags & AF_SPEED_LIMIT) {
+		if (item_attr_get(item, attr_maxspeed, &maxspeed_attr)) {
+			*maxspeed = maxspeed_attr.u.num;
+		}
+	}
+	return count;
 }
 
 static void
-tracking_get_angles(struct tracking_line *tl)
+tracking_coord_bbox(struct coord *c, int count, struct coord_rect *r)
 {
 	int i;
-	struct street_data *sd=tl->street;
-	for (i = 0 ; i < sd->count-1 ; i++) 
-		tl->angle[i]=transform_get_angle_delta(&sd->c[i], &sd->c[i+1], 0);
+
+	r->lu=c[0];
+	r->rl=c[0];
+	for (i = 1 ; i < count ; i++) {
+		if (r->lu.x > c[i].x)
+			r->lu.x=c[i].x;
+		if (r->rl.x < c[i].x)
+			r->rl.x=c[i].x;
+		if (r->rl.y > c[i].y)
+			r->rl.y=c[i].y;
+		if (r->lu.y < c[i].y)
+			r->lu.y=c[i].y;
+	}
 }
 
 static int
-street_data_within_selection(struct street_data *sd, struct map_selection *sel)
+tracking_rect_within_selection(struct coord_rect *r, struct map_selection *sel)
 {
-	struct coord_rect r;
 	struct map_selection *curr;
-	int i;
 
 	if (!sel)
 		return 1;
-	r.lu=sd->c[0];
-	r.rl=sd->c[0];
-	for (i = 1 ; i < sd->count ; i++) {
-		if (r.lu.x > sd->c[i].x)
-			r.lu.x=sd->c[i].x;
-		if (r.rl.x < sd->c[i].x)
-			r.rl.x=sd->c[i].x;
-		if (r.rl.y > sd->c[i].y)
-			r.rl.y=sd->c[i].y;
-		if (r.lu.y < sd->c[i].y)
-			r.lu.y=sd->c[i].y;
-	}
         curr=sel;
 	while (curr) {
 		struct coord_rect *sr=&curr->u.c_rect;
-		if (r.lu.x <= sr->rl.x && r.rl.x >= sr->lu.x &&
-		    r.lu.y >= sr->rl.y && r.rl.y <= sr->lu.y)
+		if (r->lu.x <= sr->rl.x && r->rl.x >= sr->lu.x &&
+		    r->lu.y >= sr->rl.y && r->rl.y <= sr->lu.y)
 			return 1;
 		curr=curr->next;
 	}
         return 0;
 }
 
+/**
+ * @brief Makes sure the segment arrays have room for count segments
+ *
+ * All arrays live in one allocation which is doubled as needed.
+ */
+static void
+tracking_segments_reserve(struct tracking_segments *s, int count)
+{
+	int **arrays[TRACKING_SEGMENT_ARRAYS]={&s->x0, &s->y0, &s->x1, &s->y1, &s->angle, &s->flags, &s->maxspeed, &s->street};
+	int i,size=s->size ? s->size : 1024;
+	int *block;
+
+	if (count <= s->size)
+		return;
+	while (size < count)
+		size*=2;
+	block=g_new(int, size*TRACKING_SEGMENT_ARRAYS);
+	for (i = 0 ; i < TRACKING_SEGMENT_ARRAYS ; i++) {
+		if (s->count)
+			memcpy(block+i*size, *arrays[i], s->count*sizeof(int));
+	}
+	g_free(s->x0);
+	for (i = 0 ; i < TRACKING_SEGMENT_ARRAYS ; i++)
+		*arrays[i]=block+i*size;
+	s->size=size;
+}
 
+static struct tracking_street *
+tracking_segments_new_street(struct tracking_segments *s, int count)
+{
+	struct tracking_street *st;
+
+	if (s->street_count == s->street_size) {
+		s->street_size=s->street_size ? s->street_size*2 : 256;
+		s->streets=g_renew(struct tracking_street, s->streets, s->street_size);
+	}
+	tracking_segments_reserve(s, s->count+count);
+	st=&s->streets[s->street_count++];
+	st->first=s->count;
+	st->count=count;
+	st->indexed=0;
+	return st;
+}
+
+/**
+ * @brief Appends a street read from a map to the segment table
+ *
+ * @param s The segment table
+ * @param item The map item of the street
+ * @param flags The flags of the street
+ * @param maxspeed The maximum speed of the street
+ * @param c The coordinates of the street
+ * @param count The number of coordinates, at least 2
+ * @param bbox The bounding box of the coordinates
+ */
 static void
-tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection pro)
+tracking_segments_add_street(struct tracking_segments *s, struct item *item, int flags, int maxspeed, struct coord *c, int count, struct coord_rect *bbox)
 {
-	int max_dist=1000;
-	struct map_selection *sel;
-	struct mapset_handle *h;
+	struct tracking_street *st=tracking_segments_new_street(s, count-1);
+	int i,n;
+
+	st->item=*item;
+	st->flags=flags;
+	st->maxspeed=maxspeed;
+	st->bbox=*bbox;
+	for (i = 0 ; i < count-1 ; i++) {
+		n=s->count++;
+		s->x0[n]=c[i].x;
+		s->y0[n]=c[i].y;
+		s->x1[n]=c[i+1].x;
+		s->y1[n]=c[i+1].y;
+		s->angle[n]=transform_get_angle_delta(&c[i], &c[i+1], 0);
+		s->flags[n]=flags;
+		s->maxspeed[n]=maxspeed;
+		s->street[n]=s->street_count-1;
+	}
+}
+
+/**
+ * @brief Appends the segments of a speed index which touch a rectangle
+ *
+ * The segments are taken over from the mapped index as they are, no map items
+ * are read. Consecutive segments of a street within a cell become one street of
+ * the table, so a street crossing cells is loaded as several streets.
+ *
+ * @param s The segment table
+ * @param m The map the index belongs to
+ * @param idx The speed index
+ * @param r The rectangle, in the projection of the map
+ */
+static void
+tracking_segments_add_index(struct tracking_segments *s, struct map *m, struct speed_index *idx, struct coord_rect *r)
+{
+	struct speed_index_segment *seg;
+	struct tracking_street *st;
+	struct coord_rect sr;
+	unsigned int street=0;
+	int x,y,x0,y0,x1,y1,i,n,count;
+
+	if (!speed_index_get_cells(idx, r, &x0, &y0, &x1, &y1))
+		return;
+	for (y = y0 ; y <= y1 ; y++) {
+		for (x = x0 ; x <= x1 ; x++) {
+			seg=speed_index_get_cell(idx, x, y, &count);
+			st=NULL;
+			for (i = 0 ; i < count ; i++, seg++) {
+				sr.lu.x=MIN(seg->x0, seg->x1);
+				sr.rl.x=MAX(seg->x0, seg->x1);
+				sr.lu.y=MAX(seg->y0, seg->y1);
+				sr.rl.y=MIN(seg->y0, seg->y1);
+				if (!coord_rect_overlap(&sr, r)) {
+					st=NULL;
+					continue;
+				}
+				if (!st || street != seg->street) {
+					/* The index does not know the ids of the map items */
+					street=seg->street;
+					st=tracking_segments_new_street(s, 0);
+					st->item.type=seg->type;
+					st->item.id_hi=0;
+					st->item.id_lo=0;
+					st->item.map=m;
+					st->item.meth=NULL;
+					st->item.priv_data=NULL;
+					st->flags=seg->flags;
+					st->maxspeed=seg->maxspeed;
+					st->bbox=sr;
+					st->indexed=1;
+				} else {
+					coord_rect_extend(&st->bbox, &sr.lu);
+					coord_rect_extend(&st->bbox, &sr.rl);
+				}
+				tracking_segments_reserve(s, s->count+1);
+				n=s->count++;
+				s->x0[n]=seg->x0;
+				s->y0[n]=seg->y0;
+				s->x1[n]=seg->x1;
+				s->y1[n]=seg->y1;
+				s->angle[n]=seg->angle;
+				s->flags[n]=seg->flags;
+				s->maxspeed[n]=seg->maxspeed;
+				s->street[n]=s->street_count-1;
+				st->count++;
+			}
+		}
+	}
+}
+
+/**
+ * @brief Appends a street of another segment table
+ */
+static void
+tracking_segments_copy_street(struct tracking_segments *s, struct tracking_segments *from, int idx)
+{
+	struct tracking_street *fst=&from->streets[idx];
+	struct tracking_street *st=tracking_segments_new_street(s, fst->count);
+	int **dst[TRACKING_SEGMENT_ARRAYS-1]={&s->x0, &s->y0, &s->x1, &s->y1, &s->angle, &s->flags, &s->maxspeed};
+	int *src[TRACKING_SEGMENT_ARRAYS-1]={from->x0, from->y0, from->x1, from->y1, from->angle, from->flags, from->maxspeed};
+	int i;
+
+	st->item=fst->item;
+	st->flags=fst->flags;
+	st->maxspeed=fst->maxspeed;
+	st->bbox=fst->bbox;
+	st->indexed=fst->indexed;
+	st->ordinal=fst->ordinal;
+	for (i = 0 ; i < TRACKING_SEGMENT_ARRAYS-1 ; i++)
+		memcpy(*dst[i]+st->first, src[i]+fst->first, st->count*sizeof(int));
+	for (i = 0 ; i < st->count ; i++)
+		s->street[st->first+i]=s->street_count-1;
+	s->count+=st->count;
+}
+
+/* Distance in map units loaded around the vehicle */
+#define TRACKING_CORRIDOR_MARGIN 1000
+/* Seconds of travel at the current speed which are loaded ahead of the vehicle */
+#define TRACKING_CORRIDOR_LOOKAHEAD 60
+/* Upper limit for the distance loaded ahead */
+#define TRACKING_CORRIDOR_AHEAD_MAX 5000
+/* Speed in km/h below which the streets of the next corridor are not prefetched */
+#define TRACKING_PREFETCH_MIN_SPEED 10
+/* Microseconds the prefetch thread waits while streets are loaded from the maps */
+#define TRACKING_PREFETCH_BACKOFF 2000
+
+#define TRACKING_GRID_SHIFT 6
+#define TRACKING_GRID_MAX_CELLS 65536
+
+static int
+tracking_grid_cell(int d, int shift)
+{
+	if (d >= 0)
+		return d >> shift;
+	return -((-d-1) >> shift) - 1;
+}
+
+static int
+tracking_grid_clamp(int c, int n)
+{
+	if (c < 0)
+		return 0;
+	if (c >= n)
+		return n-1;
+	return c;
+}
+
+/**
+ * @brief Registers a segment in all grid cells it passes through
+ *
+ * If fill is NULL, only the number of entries per cell is counted in g->start[cell+1],
+ * otherwise the segment is stored at fill[cell] which is advanced afterwards.
+ */
+static void
+tracking_grid_add_segment(struct tracking_grid *g, struct tracking_segments *s, int seg, int *fill)
+{
+	int x0=s->x0[seg], y0=s->y0[seg], x1=s->x1[seg], y1=s->y1[seg];
+	int xmin=MIN(x0, x1), xmax=MAX(x0, x1);
+	int ymin=MIN(y0, y1), ymax=MAX(y0, y1);
+	int cx,cx0,cx1,cy,cy0,cy1,cell;
+
+	cx0=(xmin-g->origin.x) >> g->shift;
+	cx1=(xmax-g->origin.x) >> g->shift;
+	for (cx = cx0 ; cx <= cx1 ; cx++) {
+		int ylo=ymin, yhi=ymax;
+		if (cx0 != cx1) {
+			double left=g->origin.x+((double)cx*(1 << g->shift));
+			double xs=MAX(xmin, left), xe=MIN(xmax, left+(1 << g->shift));
+			double m=(double)(y1-y0)/(x1-x0);
+			double ys=y0+(xs-x0)*m, ye=y0+(xe-x0)*m;
+			ylo=MAX(ymin, (int)floor(MIN(ys, ye))-1);
+			yhi=MIN(ymax, (int)ceil(MAX(ys, ye))+1);
+		}
+		cy0=tracking_grid_clamp((ylo-g->origin.y) >> g->shift, g->h);
+		cy1=tracking_grid_clamp((yhi-g->origin.y) >> g->shift, g->h);
+		for (cy = cy0 ; cy <= cy1 ; cy++) {
+			cell=cy*g->w+cx;
+			if (fill)
+				g->entries[fill[cell]++]=seg;
+			else
+				g->start[cell+1]++;
+		}
+	}
+}
+
+static void
+tracking_grid_free(struct tracking_grid *g)
+{
+	g_free(g->start);
+	g_free(g->entries);
+	g_free(g->seen);
+	g_free(g->batch);
+	g_free(g->batch_lpnt);
+	memset(g, 0, sizeof(*g));
+}
+
+/**
+ * @brief Builds the grid over all segments of a segment table
+ *
+ * @param g The grid to fill, must be empty
+ * @param s The segments to index
+ */
+static void
+tracking_grid_build(struct tracking_grid *g, struct tracking_segments *s)
+{
+	int xmin=INT_MAX, ymin=INT_MAX, xmax=INT_MIN, ymax=INT_MIN;
+	int i,cells,*fill;
+
+	if (!s->street_count)
+		return;
+	for (i = 0 ; i < s->street_count ; i++) {
+		struct coord_rect *r=&s->streets[i].bbox;
+		xmin=MIN(xmin, r->lu.x);
+		xmax=MAX(xmax, r->rl.x);
+		ymin=MIN(ymin, r->rl.y);
+		ymax=MAX(ymax, r->lu.y);
+	}
+	g->origin.x=xmin;
+	g->origin.y=ymin;
+	g->shift=TRACKING_GRID_SHIFT;
+	while ((long long)(((xmax-xmin) >> g->shift)+1)*(((ymax-ymin) >> g->shift)+1) > TRACKING_GRID_MAX_CELLS)
+		g->shift++;
+	g->w=((xmax-xmin) >> g->shift)+1;
+	g->h=((ymax-ymin) >> g->shift)+1;
+	cells=g->w*g->h;
+	g->start=g_new0(int, cells+1);
+	for (i = 0 ; i < s->count ; i++)
+		tracking_grid_add_segment(g, s, i, NULL);
+	for (i = 0 ; i < cells ; i++) {
+		g->max_cell=MAX(g->max_cell, g->start[i+1]);
+		g->start[i+1]+=g->start[i];
+	}
+	g->entries=g_new(int, g->start[cells]);
+	fill=g_new(int, cells);
+	memcpy(fill, g->start, cells*sizeof(int));
+	for (i = 0 ; i < s->count ; i++)
+		tracking_grid_add_segment(g, s, i, fill);
+	g_free(fill);
+	g->seen=g_new0(int, s->count);
+	g->batch=g_new(int, g->max_cell*6);
+	g->batch_lpnt=g_new(struct coord, g->max_cell);
+	dbg(lvl_debug,"%d segments in %dx%d cells of size %d\n", s->count, g->w, g->h, 1 << g->shift);
+}
+
+static void
+tracking_segments_free(struct tracking_segments *s)
+{
+	g_free(s->x0);
+	g_free(s->streets);
+	tracking_grid_free(&s->grid);
+	g_free(s);
+}
+
+/**
+ * @brief Computes the area which should be loaded for a position
+ *
+ * The corridor extends TRACKING_CORRIDOR_MARGIN around the position and
+ * reaches ahead along the current heading as far as the vehicle gets within
+ * TRACKING_CORRIDOR_LOOKAHEAD seconds at its current speed.
+ */
+static void
+tracking_corridor_rect(struct tracking *tr, struct coord *pc, enum projection pro, struct coord_rect *r)
+{
+	struct coord ahead;
+	int dist=tr->speed*TRACKING_CORRIDOR_LOOKAHEAD/3.6;
+
+	if (dist > TRACKING_CORRIDOR_AHEAD_MAX)
+		dist=TRACKING_CORRIDOR_AHEAD_MAX;
+	ahead=*pc;
+	if (dist > 0)
+		transform_project(pro, pc, dist, tr->direction, &ahead);
+	r->lu.x=MIN(pc->x, ahead.x)-TRACKING_CORRIDOR_MARGIN;
+	r->rl.x=MAX(pc->x, ahead.x)+TRACKING_CORRIDOR_MARGIN;
+	r->lu.y=MAX(pc->y, ahead.y)+TRACKING_CORRIDOR_MARGIN;
+	r->rl.y=MIN(pc->y, ahead.y)-TRACKING_CORRIDOR_MARGIN;
+}
+
+/**
+ * @brief Checks whether the loaded corridor still covers a position
+ *
+ * @return True if the position is at least half the corridor margin away from its border
+ */
+static int
+tracking_corridor_covers(struct tracking *tr, struct coord *pc)
+{
+	int m=TRACKING_CORRIDOR_MARGIN/2;
+
+	if (!tr->corridor_valid)
+		return 0;
+	return pc->x-m >= tr->corridor.lu.x && pc->x+m <= tr->corridor.rl.x &&
+	       pc->y+m <= tr->corridor.lu.y && pc->y-m >= tr->corridor.rl.y;
+}
+
+static struct map_selection *
+tracking_corridor_selection_add(struct map_selection *sel, int lx, int ly, int rx, int ry)
+{
+	struct map_selection *ret;
+
+	if (lx > rx || ly < ry)
+		return sel;
+	ret=g_new(struct map_selection, 1);
+	ret->next=sel;
+	ret->u.c_rect.lu.x=lx;
+	ret->u.c_rect.lu.y=ly;
+	ret->u.c_rect.rl.x=rx;
+	ret->u.c_rect.rl.y=ry;
+	ret->order=18;
+	ret->range.min=route_item_first;
+	ret->range.max=route_item_last;
+	return ret;
+}
+
+/**
+ * @brief Returns a selection covering the part of the new corridor which is not yet loaded
+ *
+ * @param n The new corridor
+ * @param o The loaded corridor or NULL if nothing is loaded
+ * @return Up to four rectangles covering n without o
+ */
+static struct map_selection *
+tracking_corridor_selection(struct coord_rect *n, struct coord_rect *o)
+{
+	struct map_selection *sel=NULL;
+	int lx,rx;
+
+	if (!o || !coord_rect_overlap(n, o))
+		return tracking_corridor_selection_add(NULL, n->lu.x, n->lu.y, n->rl.x, n->rl.y);
+	sel=tracking_corridor_selection_add(sel, n->lu.x, n->lu.y, o->lu.x-1, n->rl.y);
+	sel=tracking_corridor_selection_add(sel, o->rl.x+1, n->lu.y, n->rl.x, n->rl.y);
+	lx=MAX(n->lu.x, o->lu.x);
+	rx=MIN(n->rl.x, o->rl.x);
+	sel=tracking_corridor_selection_add(sel, lx, n->lu.y, rx, o->lu.y+1);
+	sel=tracking_corridor_selection_add(sel, lx, o->rl.y-1, rx, n->rl.y);
+	return sel;
+}
+
+/**
+ * @brief A refresh of the loaded streets
+ *
+ * The request is filled by the main loop, the new segment table is built by
+ * tracking_refresh_load() on the refresh thread, and it replaces the current
+ * one in tracking_refresh_apply() on the main loop again. While a refresh is
+ * pending, the refresh thread owns line_hash, and the current segment table
+ * is only read.
+ */
+struct tracking_refresh {
+	struct mapset *ms;
+	enum projection pro;
+	struct coord_rect corridor;		/**< The corridor to load */
+	struct coord_rect old;			/**< The corridor which is loaded already */
+	int old_valid;
+	struct tracking_segments *old_segments;	/**< The segment table currently in use, read only */
+	struct item_hash *line_hash;		/**< Items of all loaded streets */
+	int fanout;				/**< Read maps which support concurrent map rects on one thread each */
+	struct tracking_segments *segments;	/**< Returns the new segment table */
+};
+
+/**
+ * @brief The streets of one map read for a refresh
+ *
+ * With fan-out, every map is read into a table of its own, on a thread of its own
+ * if the map supports concurrent map rects. The tables are merged in the order of
+ * the maps in the mapset afterwards, so the result is the same as without fan-out.
+ */
+struct tracking_refresh_map {
+	struct tracking_refresh *r;
 	struct map *m;
+	struct map_selection *sel;		/**< The part of the corridor which is not loaded yet */
+	struct tracking_segments *segments;	/**< The streets read from the map */
+	GThread *thread;
+};
+
+/* Request which terminates the refresh thread */
+static struct tracking_refresh tracking_refresh_quit;
+
+/**
+ * @brief Appends the streets of a map to a segment table
+ *
+ * Maps with a speed index are read from the index for the whole corridor, other
+ * maps only within sel. Streets already in r->line_hash are skipped.
+ *
+ * @param r The refresh request
+ * @param m The map
+ * @param sel The part of the corridor which is not loaded yet, NULL if it is loaded completely
+ * @param s The segment table to append to
+ * @param seen If not NULL, the streets read are entered here and r->line_hash is only
+ * read, so several maps can be read at the same time. Otherwise they are entered in
+ * r->line_hash.
+ */
+static void
+tracking_refresh_load_map(struct tracking_refresh *r, struct map *m, struct map_selection *sel,
+			  struct tracking_segments *s, struct item_hash *seen)
+{
+	struct map_selection *msel;
 	struct map_rect *mr;
 	struct item *item;
-	struct street_data *street;
-	struct tracking_line *tl;
-	struct coord_geo g;
-	struct coord cc;
+	struct coord *c=NULL;
+	struct coord_rect bbox;
+	struct attr attr;
+	int size=0,count,flags,maxspeed,locked;
+
+	if (map_projection(m) == r->pro && map_get_attr(m, attr_speed_index, &attr, NULL)) {
+		tracking_segments_add_index(s, m, attr.u.data, &r->corridor);
+		return;
+	}
+	if (!sel)
+		return;
+	if (map_projection(m) == r->pro)
+		msel=map_selection_dup(sel);
+	else
+		msel=map_selection_dup_pro(sel, r->pro, map_projection(m));
+	locked=tracking_map_lock(m);
+	mr=map_rect_new(m, msel);
+	if (!mr) {
+		if (locked)
+			g_mutex_unlock(&tracking_map_mutex);
+		map_selection_destroy(msel);
+		return;
+	}
+	while ((item=map_rect_get_item(mr))) {
+		if (!item_get_default_flags(item->type) || item_hash_lookup(r->line_hash, item))
+			continue;
+		if (seen && item_hash_lookup(seen, item))
+			continue;
+		count=tracking_street_get_data(item, &c, &size, &flags, &maxspeed);
+		if (count < 2)
+			continue;
+		tracking_coord_bbox(c, count, &bbox);
+		if (tracking_rect_within_selection(&bbox, msel)) {
+			tracking_segments_add_street(s, item, flags, maxspeed, c, count, &bbox);
+			item_hash_insert(seen ? seen : r->line_hash, item, s);
+		}
+	}
+	map_rect_destroy(mr);
+	if (locked)
+		g_mutex_unlock(&tracking_map_mutex);
+	map_selection_destroy(msel);
+	g_free(c);
+}
+
+static gpointer
+tracking_refresh_map_thread(gpointer data)
+{
+	struct tracking_refresh_map *rm=data;
+	struct item_hash *seen=item_hash_new();
+
+	rm->segments=g_new0(struct tracking_segments, 1);
+	tracking_refresh_load_map(rm->r, rm->m, rm->sel, rm->segments, seen);
+	item_hash_destroy(seen);
+	return NULL;
+}
+
+/**
+ * @brief Reads every map on a thread of its own and merges the streets into a segment table
+ *
+ * Maps which do not support concurrent map rects are read on the calling thread while
+ * the others are read.
+ */
+static void
+tracking_refresh_load_fanout(struct tracking_refresh *r, struct map_selection *sel, struct tracking_segments *s,
+			     struct mapset_handle *h)
+{
+	GArray *maps=g_array_new(FALSE, TRUE, sizeof(struct tracking_refresh_map));
+	struct tracking_refresh_map *rm;
+	struct tracking_street *st;
+	struct map *m;
+	int i,j;
 
-	dbg(lvl_debug,"enter\n");
-	h=mapset_open(tr->ms);
 	while ((m=mapset_next(h,2))) {
-		cc.x = pc->x;
-		cc.y = pc->y;
-		if (map_projection(m) != pro) {
-			transform_to_geo(pro, &cc, &g);
-			transform_from_geo(map_projection(m), &g, &cc);
+		g_array_set_size(maps, maps->len+1);
+		rm=&g_array_index(maps, struct tracking_refresh_map, maps->len-1);
+		rm->r=r;
+		rm->m=m;
+		rm->sel=sel;
+	}
+	/* The first map is read on the calling thread anyway */
+	for (i = 1 ; i < maps->len ; i++) {
+		rm=&g_array_index(maps, struct tracking_refresh_map, i);
+		if (tracking_map_concurrent(rm->m))
+			rm->thread=g_thread_new("tracking_map", tracking_refresh_map_thread, rm);
+	}
+	for (i = 0 ; i < maps->len ; i++) {
+		rm=&g_array_index(maps, struct tracking_refresh_map, i);
+		if (!rm->thread)
+			tracking_refresh_map_thread(rm);
+	}
+	/* The workers read the line hash, so it is only written once all of them are done */
+	for (i = 0 ; i < maps->len ; i++) {
+		rm=&g_array_index(maps, struct tracking_refresh_map, i);
+		if (rm->thread)
+			g_thread_join(rm->thread);
+	}
+	for (i = 0 ; i < maps->len ; i++) {
+		rm=&g_array_index(maps, struct tracking_refresh_map, i);
+		for (j = 0 ; j < rm->segments->street_count ; j++) {
+			st=&rm->segments->streets[j];
+			if (st->indexed)
+				tracking_segments_copy_street(s, rm->segments, j);
+			else if (!item_hash_lookup(r->line_hash, &st->item)) {
+				tracking_segments_copy_street(s, rm->segments, j);
+				item_hash_insert(r->line_hash, &st->item, s);
+			}
 		}
-		sel = route_rect(18, &cc, &cc, 0, max_dist);
-		mr=map_rect_new(m, sel);
-		if (!mr)
+		tracking_segments_free(rm->segments);
+	}
+	g_array_free(maps, TRUE);
+}
+
+/**
+ * @brief Builds the segment table for a refresh request
+ *
+ * Streets of the current table which still touch the new corridor are copied,
+ * and the part of the corridor which was not loaded before is read from the
+ * maps. Maps with a speed index are read from the index for the whole corridor
+ * instead. Only accesses the maps and the data in the request, so it can run on
+ * the refresh thread.
+ */
+static void
+tracking_refresh_load(struct tracking_refresh *r)
+{
+	struct tracking_segments *s=g_new0(struct tracking_segments, 1), *old=r->old_segments;
+	struct map_selection *sel,corridor;
+	struct mapset_handle *h;
+	struct map *m;
+	int i,kept,ordinal=0;
+
+	if (r->old_valid && old) {
+		for (i = 0 ; i < old->street_count ; i++) {
+			if (old->streets[i].indexed)
+				continue;
+			if (coord_rect_overlap(&old->streets[i].bbox, &r->corridor))
+				tracking_segments_copy_street(s, old, i);
+			else
+				item_hash_remove(r->line_hash, &old->streets[i].item);
+		}
+		dbg(lvl_debug,"kept %d of %d streets\n", s->street_count, old->street_count);
+	}
+	kept=s->street_count;
+	for (i = 0 ; i < kept ; i++)
+		ordinal=MAX(ordinal, s->streets[i].ordinal+1);
+	sel=tracking_corridor_selection(&r->corridor, r->old_valid ? &r->old : NULL);
+	/* Maps which do not cover the corridor are skipped, their speed index included */
+	memset(&corridor, 0, sizeof(corridor));
+	corridor.u.c_rect=r->corridor;
+	h=mapset_open_selection(r->ms, &corridor, r->pro);
+	if (r->fanout)
+		tracking_refresh_load_fanout(r, sel, s, h);
+	else {
+		while ((m=mapset_next(h,2)))
+			tracking_refresh_load_map(r, m, sel, s, NULL);
+	}
+	mapset_close(h);
+	map_selection_destroy(sel);
+	for (i = kept ; i < s->street_count ; i++)
+		s->streets[i].ordinal=ordinal++;
+	tracking_grid_build(&s->grid, s);
+	r->segments=s;
+}
+
+static gpointer
+tracking_refresh_thread(gpointer data)
+{
+	struct tracking *tr=data;
+	struct tracking_refresh *r;
+
+	while ((r=g_async_queue_pop(tr->refresh_requests)) != &tracking_refresh_quit) {
+		tracking_refresh_load(r);
+		g_async_queue_push(tr->refresh_results, r);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Makes the segment table of a refresh the current one
+ */
+static void
+tracking_refresh_apply(struct tracking *tr, struct tracking_refresh *r)
+{
+	if (tr->segs)
+		tracking_segments_free(tr->segs);
+	tr->segs=r->segments;
+	tr->curr_seg=-1;
+	tr->corridor=r->corridor;
+	tr->corridor_valid=1;
+	tr->refresh_pending=NULL;
+	g_free(r);
+}
+
+/**
+ * @brief Moves the corridor of loaded streets to a new position
+ *
+ * If streets are loaded already, the new segment table is built on the
+ * refresh thread and picked up by a later call of tracking_update().
+ * Otherwise there is nothing to match against, so the streets are loaded
+ * right away.
+ *
+ * @param tr The tracking object
+ * @param pc The current position
+ * @param pro The projection of pc
+ */
+static void
+tracking_doupdate_lines(struct tracking *tr, struct coord *pc, enum projection pro)
+{
+	struct tracking_refresh *r=g_new0(struct tracking_refresh, 1);
+
+	dbg(lvl_debug,"enter\n");
+	if (!tr->line_hash)
+		tr->line_hash=item_hash_new();
+	r->ms=tr->ms;
+	r->pro=pro;
+	tracking_corridor_rect(tr, pc, pro, &r->corridor);
+	r->old=tr->corridor;
+	r->old_valid=tr->corridor_valid;
+	r->old_segments=tr->segs;
+	r->line_hash=tr->line_hash;
+	r->fanout=tr->map_fanout;
+	tr->refresh_count++;
+	if (!tr->corridor_valid || tr->synchronous) {
+		tracking_refresh_load(r);
+		tracking_refresh_apply(tr, r);
+	} else {
+		if (!tr->refresh_thread) {
+			tr->refresh_requests=g_async_queue_new();
+			tr->refresh_results=g_async_queue_new();
+			tr->refresh_thread=g_thread_new("tracking", tracking_refresh_thread, tr);
+		}
+		tr->refresh_pending=r;
+		g_async_queue_push(tr->refresh_requests, r);
+	}
+	dbg(lvl_debug, "exit\n");
+}
+
+/**
+ * @brief A request to read the streets of a corridor ahead of time
+ *
+ * Reading the streets loads the map tiles they are stored in, so the refresh
+ * which loads the corridor later finds the tiles in the file cache.
+ */
+struct tracking_prefetch {
+	struct mapset *ms;
+	enum projection pro;
+	struct map_selection *sel;
+};
+
+/* Request which terminates the prefetch thread */
+static struct tracking_prefetch tracking_prefetch_quit;
+
+static void
+tracking_prefetch_free(struct tracking_prefetch *p)
+{
+	map_selection_destroy(p->sel);
+	g_free(p);
+}
+
+/**
+ * @brief Reads the streets of a map within a selection
+ *
+ * Unless the map supports concurrent map rects, it is only read while no
+ * other thread waits to load streets. If one starts waiting, the map rect is
+ * given up and read again later, the tiles read so far are in the file cache
+ * by then.
+ *
+ * @return 1 if the map was read, 0 if a newer request arrived first
+ */
+static int
+tracking_prefetch_map(GAsyncQueue *queue, struct map *m, struct map_selection *sel)
+{
+	struct map_rect *mr;
+	int concurrent=tracking_map_concurrent(m);
+	int done=0;
+
+	while (!done) {
+		if (g_async_queue_length(queue) > 0)
+			return 0;
+		if (!concurrent && (g_atomic_int_get(&tracking_map_waiters) || !g_mutex_trylock(&tracking_map_mutex))) {
+			g_usleep(TRACKING_PREFETCH_BACKOFF);
 			continue;
-		while ((item=map_rect_get_item(mr))) {
-			if (item_get_default_flags(item->type)) {
-				street=street_get_data(item);
-				if (street_data_within_selection(street, sel)) {
-					tl=g_malloc(sizeof(struct tracking_line)+(street->count-1)*sizeof(int));
-					tl->street=street;
-					tracking_get_angles(tl);
-					tl->next=tr->lines;
-					tr->lines=tl;
-				} else
-					street_data_free(street);
+		}
+		done=1;
+		mr=map_rect_new(m, sel);
+		if (mr) {
+			while (map_rect_get_item(mr)) {
+				if (!concurrent && g_atomic_int_get(&tracking_map_waiters)) {
+					done=0;
+					break;
+				}
 			}
+			map_rect_destroy(mr);
 		}
-		map_selection_destroy(sel);
-		map_rect_destroy(mr);
+		if (!concurrent)
+			g_mutex_unlock(&tracking_map_mutex);
+	}
+	return 1;
+}
+
+static void
+tracking_prefetch_load(GAsyncQueue *queue, struct tracking_prefetch *p)
+{
+	struct mapset_handle *h;
+	struct map_selection *msel;
+	struct map *m;
+	struct attr attr;
+	int done=1;
+
+	h=mapset_open_selection(p->ms, p->sel, p->pro);
+	while (done && (m=mapset_next(h,2))) {
+		/* Streets of maps with a speed index are read from the index */
+		if (map_projection(m) == p->pro && map_get_attr(m, attr_speed_index, &attr, NULL))
+			continue;
+		if (map_projection(m) == p->pro)
+			msel=map_selection_dup(p->sel);
+		else
+			msel=map_selection_dup_pro(p->sel, p->pro, map_projection(m));
+		done=tracking_prefetch_map(queue, m, msel);
+		map_selection_destroy(msel);
 	}
 	mapset_close(h);
-	dbg(lvl_debug, "exit\n");
+	dbg(lvl_debug,"prefetch %s\n", done ? "done" : "superseded");
 }
 
+static gpointer
+tracking_prefetch_thread(gpointer data)
+{
+	struct tracking *tr=data;
+	struct tracking_prefetch *p,*newer;
+
+	for (;;) {
+		p=g_async_queue_pop(tr->prefetch_requests);
+		/* Only the latest request is of interest */
+		while (p != &tracking_prefetch_quit && (newer=g_async_queue_try_pop(tr->prefetch_requests))) {
+			tracking_prefetch_free(p);
+			p=newer;
+		}
+		if (p == &tracking_prefetch_quit)
+			break;
+		tracking_prefetch_load(tr->prefetch_requests, p);
+		tracking_prefetch_free(p);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Requests the streets of the next corridor to be read ahead of time
+ *
+ * The next refresh happens where the vehicle leaves the area covered by the
+ * current corridor. That point and the corridor loaded there are predicted
+ * from the current position, heading and speed, and the part of the corridor
+ * which is not loaded yet is read on the prefetch thread. A new request is
+ * only made if the predicted point moved noticeably.
+ *
+ * @param tr The tracking object
+ * @param pro The projection of curr_in
+ */
+static void
+tracking_prefetch(struct tracking *tr, enum projection pro)
+{
+	struct tracking_prefetch *p;
+	struct coord_rect next;
+	struct coord exit;
+	int lo=0,hi=TRACKING_CORRIDOR_AHEAD_MAX+2*TRACKING_CORRIDOR_MARGIN,mid;
+
+	if (tr->speed < TRACKING_PREFETCH_MIN_SPEED || !tr->corridor_valid)
+		return;
+	while (hi-lo > TRACKING_CORRIDOR_MARGIN/8) {
+		mid=(lo+hi)/2;
+		transform_project(pro, &tr->curr_in, mid, tr->direction, &exit);
+		if (tracking_corridor_covers(tr, &exit))
+			lo=mid;
+		else
+			hi=mid;
+	}
+	transform_project(pro, &tr->curr_in, hi, tr->direction, &exit);
+	if (tr->prefetch_valid && abs(exit.x-tr->prefetch_exit.x) < TRACKING_CORRIDOR_MARGIN/2 &&
+	        abs(exit.y-tr->prefetch_exit.y) < TRACKING_CORRIDOR_MARGIN/2)
+		return;
+	tr->prefetch_exit=exit;
+	tr->prefetch_valid=1;
+	tracking_corridor_rect(tr, &exit, pro, &next);
+	p=g_new0(struct tracking_prefetch, 1);
+	p->ms=tr->ms;
+	p->pro=pro;
+	p->sel=tracking_corridor_selection(&next, &tr->corridor);
+	if (!p->sel) {
+		g_free(p);
+		return;
+	}
+	if (!tr->prefetch_thread) {
+		tr->prefetch_requests=g_async_queue_new();
+		tr->prefetch_thread=g_thread_new("tracking_prefetch", tracking_prefetch_thread, tr);
+	}
+	g_async_queue_push(tr->prefetch_requests, p);
+}
+
+/**
+ * @brief Returns how often the loaded streets were refreshed
+ */
+int
+tracking_get_refresh_count(struct tracking *tr)
+{
+	return tr->refresh_count;
+}
 
 void
 tracking_flush(struct tracking *tr)
 {
-	struct tracking_line *tl=tr->lines,*next;
 	dbg(lvl_debug,"enter(tr=%p)\n", tr);
 
-	while (tl) {
-		next=tl->next;
-		street_data_free(tl->street);
-		g_free(tl);
-		tl=next;
+	if (tr->refresh_pending) {
+		struct tracking_refresh *r=g_async_queue_pop(tr->refresh_results);
+		tracking_segments_free(r->segments);
+		g_free(r);
+		tr->refresh_pending=NULL;
+	}
+	if (tr->segs) {
+		tracking_segments_free(tr->segs);
+		tr->segs=NULL;
+	}
+	if (tr->line_hash) {
+		item_hash_destroy(tr->line_hash);
+		tr->line_hash=NULL;
 	}
-	tr->lines=NULL;
-	tr->curr_line = NULL;
+	tr->corridor_valid=0;
+	tr->prefetch_valid=0;
+	tr->curr_seg=-1;
 }
 
 static int
@@ -553,41 +1464,232 @@ tracking_is_on_route(struct tracking *tr, struct route *rt, struct item *item)
 	return 0;
 }
 
+/**
+ * @brief Adds everything but the distance to the tracking value of a segment
+ *
+ * @param value The distance part of the value, already computed by the caller
+ */
 static int
-tracking_value(struct tracking *tr, struct tracking_line *t, int offset, struct coord *lpnt, int min, int flags)
+tracking_value_add(struct tracking *tr, struct tracking_segments *s, int i, struct coord *lpnt, int value, int min, int flags)
 {
-	int value=0;
-	struct street_data *sd=t->street;
-	dbg(lvl_info, "%d: (0x%x,0x%x)-(0x%x,0x%x)\n", offset, sd->c[offset].x, sd->c[offset].y, sd->c[offset+1].x, sd->c[offset+1].y);
-	if (flags & 1) {
-		struct coord c1, c2, cp;
-		c1.x = sd->c[offset].x;
-		c1.y = sd->c[offset].y;
-		c2.x = sd->c[offset+1].x;
-		c2.y = sd->c[offset+1].y;
-		cp.x = tr->curr_in.x;
-		cp.y = tr->curr_in.y;
-		value+=transform_distance_line_sq(&c1, &c2, &cp, lpnt);
-	}
+	struct coord c[2];
 	if (value >= min)
 		return value;
+	c[0].x = s->x0[i];
+	c[0].y = s->y0[i];
+	c[1].x = s->x1[i];
+	c[1].y = s->y1[i];
 	if (flags & 2) 
-		value += tracking_angle_delta(tr, tr->curr_angle, t->angle[offset], sd->flags)*tr->angle_pref>>4;
+		value += tracking_angle_delta(tr, tr->curr_angle, s->angle[i], s->flags[i])*tr->angle_pref>>4;
 	if (value >= min)
 		return value;
 	if ((flags & 4)  && tr->connected_pref)
-		value += tracking_is_connected(tr, tr->last, &sd->c[offset]);
+		value += tracking_is_connected(tr, tr->last, c);
 	if ((flags & 8)  && tr->nostop_pref)
 		value += tracking_is_no_stop(tr, lpnt, &tr->last_out);
 	if (value >= min)
 		return value;
 	if ((flags & 16) && tr->route_pref)
-		value += tracking_is_on_route(tr, tr->rt, &sd->item);
-	if ((flags & 64) && !!(sd->flags & AF_UNDERGROUND) != tr->no_gps) 
+		value += tracking_is_on_route(tr, tr->rt, &s->streets[s->street[i]].item);
+	if ((flags & 64) && !!(s->flags[i] & AF_UNDERGROUND) != tr->no_gps) 
 		value+=200;
 	return value;
 }
 
+static int
+tracking_value(struct tracking *tr, struct tracking_segments *s, int i, struct coord *lpnt, int min, int flags)
+{
+	int value=0;
+	struct coord c[2];
+	c[0].x = s->x0[i];
+	c[0].y = s->y0[i];
+	c[1].x = s->x1[i];
+	c[1].y = s->y1[i];
+	dbg(lvl_info, "%d: (0x%x,0x%x)-(0x%x,0x%x)\n", i, c[0].x, c[0].y, c[1].x, c[1].y);
+	if (flags & 1) {
+		struct coord cp;
+		cp.x = tr->curr_in.x;
+		cp.y = tr->curr_in.y;
+		value+=transform_distance_line_sq(&c[0], &c[1], &cp, lpnt);
+	}
+	return tracking_value_add(tr, s, i, lpnt, value, min, flags);
+}
+
+/**
+ * @brief Checks whether segment a is preferred over segment b when their values are equal
+ */
+static int
+tracking_grid_precedes(struct tracking_segments *s, int a, int b)
+{
+	int sa=s->street[a],sb=s->street[b];
+
+	if (sa != sb)
+		return s->streets[sa].ordinal > s->streets[sb].ordinal;
+	return a < b;
+}
+
+/**
+ * @brief Finds the segment with the lowest tracking value
+ *
+ * Walks the grid ring by ring around the current position. Since the distance
+ * is a lower bound for the value of a segment, the search stops as soon as
+ * the remaining rings are further away than the best value found. The distances
+ * of all segments of a cell are computed in one batch. Ties are
+ * resolved like the linear scan over the street list did: the street loaded
+ * last wins and within a street the first segment, so the result does not
+ * depend on the order in which the cells are visited.
+ *
+ * @param tr The tracking object
+ * @param lpnt Returns the point on the segment closest to the position
+ * @param min Upper limit for the value on entry, value of the result on return
+ * @return The index of the best segment or -1 if no segment is below min
+ */
+static int
+tracking_grid_match(struct tracking *tr, struct coord *lpnt, int *min)
+{
+	struct tracking_segments *s=tr->segs;
+	struct tracking_grid *g;
+	int best=-1,bounded,cx,cy,x,y,r,rmin,rmax,value,*e,*end;
+	int j,n,*bx0,*by0,*bx1,*by1,*bidx,*bdist;
+
+	if (!s || !s->count)
+		return -1;
+	g=&s->grid;
+	bx0=g->batch;
+	by0=bx0+g->max_cell;
+	bx1=by0+g->max_cell;
+	by1=bx1+g->max_cell;
+	bidx=by1+g->max_cell;
+	bdist=bidx+g->max_cell;
+	if (++g->generation == INT_MAX) {
+		memset(g->seen, 0, s->count*sizeof(int));
+		g->generation=1;
+	}
+	bounded=tr->angle_pref >= 0 && tr->connected_pref >= 0 && tr->nostop_pref >= 0 && tr->route_pref >= 0;
+	cx=tracking_grid_cell(tr->curr_in.x-g->origin.x, g->shift);
+	cy=tracking_grid_cell(tr->curr_in.y-g->origin.y, g->shift);
+	rmin=MAX(abs(cx-tracking_grid_clamp(cx, g->w)), abs(cy-tracking_grid_clamp(cy, g->h)));
+	rmax=MAX(MAX(abs(cx), abs(cx-g->w+1)), MAX(abs(cy), abs(cy-g->h+1)));
+	for (r = rmin ; r <= rmax ; r++) {
+		if (bounded && r > 0) {
+			long long lb=((long long)(r-1) << g->shift)-2;
+			if (lb > 0 && lb*lb > *min)
+				break;
+		}
+		for (y = MAX(cy-r, 0) ; y <= MIN(cy+r, g->h-1) ; y++) {
+			int edge=(y == cy-r || y == cy+r);
+			for (x = edge ? MAX(cx-r, 0) : cx-r ; x <= MIN(cx+r, g->w-1) ; x += edge ? 1 : 2*r) {
+				if (x < 0)
+					continue;
+				e=g->entries+g->start[y*g->w+x];
+				end=g->entries+g->start[y*g->w+x+1];
+				for (n = 0 ; e < end ; e++) {
+					if (g->seen[*e] == g->generation)
+						continue;
+					g->seen[*e]=g->generation;
+					bx0[n]=s->x0[*e];
+					by0[n]=s->y0[*e];
+					bx1[n]=s->x1[*e];
+					by1[n]=s->y1[*e];
+					bidx[n++]=*e;
+				}
+				transform_distance_line_sq_batch(bx0, by0, bx1, by1, n, &tr->curr_in, bdist, g->batch_lpnt);
+				for (j = 0 ; j < n ; j++) {
+					value=tracking_value_add(tr, s, bidx[j], &g->batch_lpnt[j], bdist[j], best >= 0 ? *min+1 : *min, -1);
+					if (value < *min || (best >= 0 && value == *min && tracking_grid_precedes(s, bidx[j], best))) {
+						best=bidx[j];
+						*lpnt=g->batch_lpnt[j];
+						*min=value;
+					}
+				}
+			}
+		}
+	}
+	return best;
+}
+
+
+/**
+ * @brief Matches the position in curr_in to the loaded streets
+ *
+ * Moves the corridor of loaded streets if needed, finds the best segment and
+ * updates the matched position.
+ *
+ * @param tr The tracking object
+ * @param pro The projection of curr_in
+ * @return The tracking value of the matched segment
+ */
+static int
+tracking_update_match(struct tracking *tr, enum projection pro)
+{
+	struct tracking_segments *s;
+	struct coord lpnt;
+	int i,min;
+
+	tr->last_in=tr->curr_in;
+	tr->last_out=tr->curr_out;
+	tr->last[0]=tr->curr[0];
+	tr->last[1]=tr->curr[1];
+	if (tr->refresh_pending) {
+		struct tracking_refresh *r=g_async_queue_try_pop(tr->refresh_results);
+		if (r)
+			tracking_refresh_apply(tr, r);
+	}
+	if (!tr->refresh_pending && !tracking_corridor_covers(tr, &tr->curr_in)) {
+		dbg(lvl_debug, "update\n");
+		tracking_doupdate_lines(tr, &tr->curr_in, pro);
+		tr->last_updated=tr->curr_in;
+		dbg(lvl_debug,"update end\n");
+	}
+	if (!tr->refresh_pending && !tr->synchronous)
+		tracking_prefetch(tr, pro);
+	
+	tr->street_direction=0;
+	min=INT_MAX/2;
+	i=tracking_grid_match(tr, &lpnt, &min);
+	s=tr->segs;
+	tr->curr_seg=i;
+	if (i >= 0) {
+		struct coord lpnt_tmp;
+		int angle_delta=tracking_angle_abs_diff(tr->curr_angle, s->angle[i], 360);
+		tr->pos=i-s->streets[s->street[i]].first;
+		tr->curr[0].x=s->x0[i];
+		tr->curr[0].y=s->y0[i];
+		tr->curr[1].x=s->x1[i];
+		tr->curr[1].y=s->y1[i];
+		tr->direction_matched=s->angle[i];
+		dbg(lvl_debug,"lpnt.x=0x%x,lpnt.y=0x%x pos=%d %d+%d+%d+%d=%d\n", lpnt.x, lpnt.y, tr->pos,
+			transform_distance_line_sq(&tr->curr[0], &tr->curr[1], &tr->curr_in, &lpnt_tmp),
+			tracking_angle_delta(tr, tr->curr_angle, s->angle[i], 0)*tr->angle_pref,
+			tracking_is_connected(tr, tr->last, tr->curr) ? tr->connected_pref : 0,
+			lpnt.x == tr->last_out.x && lpnt.y == tr->last_out.y ? tr->nostop_pref : 0,
+			min
+		);
+		tr->curr_out.x=lpnt.x;
+		tr->curr_out.y=lpnt.y;
+		tr->coord_geo_valid=0;
+		if (angle_delta < 70)
+			tr->street_direction=1;
+		else if (angle_delta > 110)
+			tr->street_direction=-1;
+		else
+			tr->street_direction=0;
+	}
+	dbg(lvl_debug,"tr->curr_seg=%d min=%d\n", tr->curr_seg, min);
+	if (tr->curr_seg < 0 || min > tr->offroad_limit_pref) {
+		tr->curr_out=tr->curr_in;
+		tr->coord_geo_valid=0;
+		tr->street_direction=0;
+	}
+	if (tr->curr_seg >= 0 && (s->flags[tr->curr_seg] & AF_UNDERGROUND)) {
+		if (tr->no_gps) 
+			tr->tunnel=1;
+	} else if (tr->tunnel) {
+		tr->speed=0;
+	}
+	dbg(lvl_debug,"found 0x%x,0x%x\n", tr->curr_out.x, tr->curr_out.y);
+	return min;
+}
 
 /**
  * @brief Processes a position update.
@@ -599,10 +1701,7 @@ tracking_value(struct tracking *tr, struct tracking_line *t, int offset, struct
 void
 tracking_update(struct tracking *tr, struct vehicle *v, enum projection pro)
 {
-	struct tracking_line *t;
-	int i,value,min,time;
-	struct coord lpnt;
-	struct coord cin;
+	int time;
 	struct attr valid,speed_attr,direction_attr,coord_geo,lag,time_attr,static_speed,static_distance;
 	double speed, direction;
 	if (v)
@@ -656,7 +1755,8 @@ tracking_update(struct tracking *tr, struct vehicle *v, enum projection pro)
 		dbg(lvl_debug,"tunnel extrapolation speed %f dir %f\n",tr->speed,tr->direction);
 		dbg(lvl_debug,"old 0x%x,0x%x\n",tr->curr_in.x, tr->curr_in.y);
 		speed=tr->speed;
-		direction=tr->curr_line->angle[tr->pos];
+		if (tr->curr_seg >= 0)
+			direction=tr->segs->angle[tr->curr_seg];
 		transform_project(pro, &tr->curr_in, tr->speed*tr->tunnel_extrapolation/36, tr->direction, &tr->curr_in);
 		dbg(lvl_debug,"new 0x%x,0x%x\n",tr->curr_in.x, tr->curr_in.y);
 	} else if (vehicle_get_attr(tr->vehicle, attr_lag, &lag, NULL) && lag.u.num > 0) {
@@ -681,71 +1781,110 @@ tracking_update(struct tracking *tr, struct vehicle *v, enum projection pro)
 	tr->pro=pro;
 	tr->curr_angle=tr->direction=direction;
 	tr->speed=speed;
-	tr->last_in=tr->curr_in;
-	tr->last_out=tr->curr_out;
-	tr->last[0]=tr->curr[0];
-	tr->last[1]=tr->curr[1];
-	if (!tr->lines || transform_distance(pro, &tr->last_updated, &tr->curr_in) > 500) {
-		dbg(lvl_debug, "update\n");
-		tracking_flush(tr);
-		tracking_doupdate_lines(tr, &tr->curr_in, pro);
-		tr->last_updated=tr->curr_in;
-		dbg(lvl_debug,"update end\n");
-	}
-	
-	tr->street_direction=0;
-	t=tr->lines;
-	tr->curr_line=NULL;
-	min=INT_MAX/2;
-	while (t) {
-		struct street_data *sd=t->street;
-		for (i = 0; i < sd->count-1 ; i++) {
-			value=tracking_value(tr,t,i,&lpnt,min,-1);
-			if (value < min) {
-				struct coord lpnt_tmp;
-				int angle_delta=tracking_angle_abs_diff(tr->curr_angle, t->angle[i], 360);
-				tr->curr_line=t;
-				tr->pos=i;
-				tr->curr[0]=sd->c[i];
-				tr->curr[1]=sd->c[i+1];
-				tr->direction_matched=t->angle[i];
-				dbg(lvl_debug,"lpnt.x=0x%x,lpnt.y=0x%x pos=%d %d+%d+%d+%d=%d\n", lpnt.x, lpnt.y, i, 
-					transform_distance_line_sq(&sd->c[i], &sd->c[i+1], &cin, &lpnt_tmp),
-					tracking_angle_delta(tr, tr->curr_angle, t->angle[i], 0)*tr->angle_pref,
-					tracking_is_connected(tr, tr->last, &sd->c[i]) ? tr->connected_pref : 0,
-					lpnt.x == tr->last_out.x && lpnt.y == tr->last_out.y ? tr->nostop_pref : 0,
-					value
-				);
-				tr->curr_out.x=lpnt.x;
-				tr->curr_out.y=lpnt.y;
-				tr->coord_geo_valid=0;
-				if (angle_delta < 70)
-					tr->street_direction=1;
-				else if (angle_delta > 110)
-					tr->street_direction=-1;
-				else
-					tr->street_direction=0;
-				min=value;
-			}
-		}
-		t=t->next;
-	}
-	dbg(lvl_debug,"tr->curr_line=%p min=%d\n", tr->curr_line, min);
-	if (!tr->curr_line || min > tr->offroad_limit_pref) {
-		tr->curr_out=tr->curr_in;
-		tr->coord_geo_valid=0;
-		tr->street_direction=0;
-	}
-	if (tr->curr_line && (tr->curr_line->street->flags & AF_UNDERGROUND)) {
-		if (tr->no_gps) 
-			tr->tunnel=1;
-	} else if (tr->tunnel) {
-		tr->speed=0;
-	}
-	dbg(lvl_debug,"found 0x%x,0x%x\n", tr->curr_out.x, tr->curr_out.y);
+	tracking_update_match(tr, pro);
 	callback_list_call_attr_0(tr->callback_list, attr_position_coord_geo);
 }
 
+/**
+ * @brief Creates a tracking object for matching recorded positions
+ *
+ * Unlike the tracking object of navit, it is not attached to a vehicle and loads
+ * the streets on the calling thread, so several of them can match positions on
+ * different threads at the same time.
+ *
+ * @param ms The mapset to match against
+ * @return The tracking object, to be freed with tracking_destroy()
+ */
+struct tracking *
+tracking_new_batch(struct mapset *ms)
+{
+	struct tracking *tr=tracking_new(NULL, NULL);
+
+	tr->ms=ms;
+	tr->synchronous=1;
+	return tr;
+}
+
+/**
+ * @brief Prepares matching a position unrelated to the previous one
+ *
+ * The next call of tracking_match_position() then does not prefer streets
+ * connected to the previous match. The streets loaded only depend on the
+ * cell of a fixed grid the position is in: the cell grown by
+ * TRACKING_CORRIDOR_MARGIN/2 on every side. They are kept if they were loaded
+ * for the same cell, so the match does not depend on the positions matched
+ * before.
+ *
+ * @param tr The tracking object, created by tracking_new_batch()
+ * @param geo The position which is to be matched next
+ */
+void
+tracking_match_reset(struct tracking *tr, struct coord_geo *geo)
+{
+	struct coord c,center;
+	struct coord_rect r;
+
+	tr->curr[0].x=tr->curr[1].x=tr->curr_out.x=INT_MIN;
+	tr->curr[0].y=tr->curr[1].y=tr->curr_out.y=INT_MIN;
+	tr->curr_seg=-1;
+	tr->tunnel=0;
+	tr->speed=0;
+	transform_from_geo(projection_mg, geo, &c);
+	/* Rounds down, so a cell never straddles 0 */
+	center.x=(c.x-(c.x < 0 ? TRACKING_CORRIDOR_MARGIN-1 : 0))/TRACKING_CORRIDOR_MARGIN*TRACKING_CORRIDOR_MARGIN+
+		 TRACKING_CORRIDOR_MARGIN/2;
+	center.y=(c.y-(c.y < 0 ? TRACKING_CORRIDOR_MARGIN-1 : 0))/TRACKING_CORRIDOR_MARGIN*TRACKING_CORRIDOR_MARGIN+
+		 TRACKING_CORRIDOR_MARGIN/2;
+	tracking_corridor_rect(tr, &center, projection_mg, &r);
+	if (tr->corridor_valid && tr->segs && !memcmp(&r, &tr->corridor, sizeof(r)))
+		return;
+	tracking_flush(tr);
+	tracking_doupdate_lines(tr, &center, projection_mg);
+}
+
+/**
+ * @brief Matches a recorded position to a street
+ *
+ * Uses the same scoring as tracking_update(), including the preference for
+ * streets connected to the one matched for the previous position, so the
+ * positions of a trace should be passed in order.
+ *
+ * @param tr The tracking object, created by tracking_new_batch()
+ * @param geo The position
+ * @param speed The speed in km/h
+ * @param direction The direction in degrees
+ * @param match Returns the matched street
+ * @return 1 if the position was matched to a street, 0 if no street is loaded around it
+ */
+int
+tracking_match_position(struct tracking *tr, struct coord_geo *geo, double speed, double direction, struct tracking_match *match)
+{
+	struct tracking_street *st;
+	int value;
+
+	transform_from_geo(projection_mg, geo, &tr->curr_in);
+	tr->pro=projection_mg;
+	tr->valid=attr_position_valid_valid;
+	tr->curr_angle=tr->direction=direction;
+	tr->speed=speed;
+	value=tracking_update_match(tr, projection_mg);
+	st=tracking_get_current_street(tr);
+	memset(match, 0, sizeof(*match));
+	match->maxspeed=-1;
+	if (!st)
+		return 0;
+	/* curr_out is not snapped to the street if value exceeds the offroad limit, which
+	 * the constant angle penalty alone does, so the distance is checked instead */
+	match->offroad=transform_distance_line_sq(&tr->curr[0], &tr->curr[1], &tr->curr_in, &match->pos) >
+		       tr->offroad_limit_pref;
+	match->item=st->item;
+	match->flags=st->flags;
+	if (st->flags & AF_SPEED_LIMIT)
+		match->maxspeed=st->maxspeed;
+	match->value=value;
+	return 1;
+}
+
 static int
 tracking_set_attr_do(struct tracking *tr, struct attr *attr, int initial)
 {
@@ -774,6 +1913,9 @@ tracking_set_attr_do(struct tracking *tr, struct attr *attr, int initial)
 	case attr_tunnel_extrapolation:
 		tr->tunnel_extrapolation=attr->u.num;
 		return 1;
+	case attr_map_fanout:
+		tr->map_fanout=attr->u.num;
+		return 1;
 	default:
 		return 0;
 	}
@@ -838,6 +1980,7 @@ tracking_new(struct attr *parent, struct attr **attrs)
 	this->nostop_pref=10;
 	this->offroad_limit_pref=5000;
 	this->route_pref=300;
+	this->curr_seg=-1;
 	this->callback_list=callback_list_new();
 
 
@@ -871,7 +2014,19 @@ tracking_destroy(struct tracking *tr)
 {
 	if (tr->attr) 
 		attr_free(tr->attr);
+	attr_list_free(tr->street_attrs);
 	tracking_flush(tr);
+	if (tr->refresh_thread) {
+		g_async_queue_push(tr->refresh_requests, &tracking_refresh_quit);
+		g_thread_join(tr->refresh_thread);
+		g_async_queue_unref(tr->refresh_requests);
+		g_async_queue_unref(tr->refresh_results);
+	}
+	if (tr->prefetch_thread) {
+		g_async_queue_push(tr->prefetch_requests, &tracking_prefetch_quit);
+		g_thread_join(tr->prefetch_thread);
+		g_async_queue_unref(tr->prefetch_requests);
+	}
 	callback_list_destroy(tr->callback_list);
 	g_free(tr);
 }
@@ -908,8 +2063,7 @@ struct map_priv {
 struct map_rect_priv {
 	struct tracking *tracking;
 	struct item item;
-	struct tracking_line *curr,*next;
-	int coord;
+	int seg;
 	enum attr_type attr_next;
 	int ccount;
 	int debug_idx;
@@ -927,17 +2081,21 @@ static int
 tracking_map_item_coord_get(void *priv_data, struct coord *c, int count)
 {
 	struct map_rect_priv *this=priv_data;
+	struct tracking_segments *s=this->tracking->segs;
+	struct coord sc;
 	enum projection pro;
 	int ret=0;
 	dbg(lvl_debug,"enter\n");
 	while (this->ccount < 2 && count > 0) {
-		pro = map_projection(this->curr->street->item.map);
+		pro = map_projection(s->streets[s->street[this->seg]].item.map);
+		sc.x=this->ccount ? s->x1[this->seg] : s->x0[this->seg];
+		sc.y=this->ccount ? s->y1[this->seg] : s->y0[this->seg];
 		if (projection_mg != pro) {
-			transform_from_to(&this->curr->street->c[this->ccount+this->coord],
+			transform_from_to(&sc,
 				pro,
 				c ,projection_mg);
 		} else
-		*c=this->curr->street->c[this->ccount+this->coord];
+		*c=sc;
 		dbg(lvl_debug,"coord %d 0x%x,0x%x\n",this->ccount,c->x,c->y);
 		this->ccount++;
 		ret++;
@@ -959,8 +2117,9 @@ static int
 tracking_map_item_attr_get(void *priv_data, enum attr_type attr_type, struct attr *attr)
 {
 	struct map_rect_priv *this_=priv_data;
-	struct coord lpnt,*c;
+	struct coord lpnt;
 	struct tracking *tr=this_->tracking;
+	struct tracking_segments *s=tr->segs;
 	int value;
 	attr->type=attr_type;
 
@@ -974,46 +2133,45 @@ tracking_map_item_attr_get(void *priv_data, enum attr_type attr_type, struct att
 		switch(this_->debug_idx) {
 		case 0:
                         this_->debug_idx++;
-			this_->str=attr->u.str=g_strdup_printf("overall: %d (limit %d)",tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, -1), tr->offroad_limit_pref);
+			this_->str=attr->u.str=g_strdup_printf("overall: %d (limit %d)",tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, -1), tr->offroad_limit_pref);
                         return 1;
 		case 1:
 			this_->debug_idx++;
-			c=&this_->curr->street->c[this_->coord];
-			value=tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 1);
+			value=tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 1);
                         this_->str=attr->u.str=g_strdup_printf("distance: (0x%x,0x%x) from (0x%x,0x%x)-(0x%x,0x%x) at (0x%x,0x%x) %d",
 				tr->curr_in.x, tr->curr_in.y,
-				c[0].x, c[0].y, c[1].x, c[1].y,
+				s->x0[this_->seg], s->y0[this_->seg], s->x1[this_->seg], s->y1[this_->seg],
 				lpnt.x, lpnt.y, value);
 			return 1;
 		case 2:
 			this_->debug_idx++;
                         this_->str=attr->u.str=g_strdup_printf("angle: %d to %d (flags %d) %d",
-				tr->curr_angle, this_->curr->angle[this_->coord], this_->curr->street->flags & 3,
-				tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 2));
+				tr->curr_angle, s->angle[this_->seg], s->flags[this_->seg] & 3,
+				tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 2));
 			return 1;
 		case 3:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("connected: %d", tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 4));
+                        this_->str=attr->u.str=g_strdup_printf("connected: %d", tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 4));
 			return 1;
 		case 4:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("no_stop: %d", tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 8));
+                        this_->str=attr->u.str=g_strdup_printf("no_stop: %d", tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 8));
 			return 1;
 		case 5:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("route: %d", tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 16));
+                        this_->str=attr->u.str=g_strdup_printf("route: %d", tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 16));
 			return 1;
 		case 6:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("overspeed: %d", tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 32));
+                        this_->str=attr->u.str=g_strdup_printf("overspeed: %d", tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 32));
 			return 1;
 		case 7:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("tunnel: %d", tracking_value(tr, this_->curr, this_->coord, &lpnt, INT_MAX/2, 64));
+                        this_->str=attr->u.str=g_strdup_printf("tunnel: %d", tracking_value(tr, s, this_->seg, &lpnt, INT_MAX/2, 64));
 			return 1;
 		case 8:
 			this_->debug_idx++;
-                        this_->str=attr->u.str=g_strdup_printf("line %p", this_->curr);
+                        this_->str=attr->u.str=g_strdup_printf("street %d", s->street[this_->seg]);
 			return 1;
 		default:
 			this_->attr_next=attr_none;
@@ -1048,9 +2206,7 @@ tracking_map_destroy(struct map_priv *priv)
 static void
 tracking_map_rect_init(struct map_rect_priv *priv)
 {
-	priv->next=priv->tracking->lines;
-	priv->curr=NULL;
-	priv->coord=0;
+	priv->seg=-1;
 	priv->item.id_lo=0;
 	priv->item.id_hi=0;
 }
@@ -1078,22 +2234,18 @@ static struct item *
 tracking_map_get_item(struct map_rect_priv *priv)
 {
 	struct item *ret=&priv->item;
+	struct tracking_segments *s=priv->tracking->segs;
+	struct tracking_street *st;
 	int value;
 	struct coord lpnt;
 
-	if (!priv->next)
+	if (!s || priv->seg+1 >= s->count)
 		return NULL;
-	if (! priv->curr || priv->coord + 2 >= priv->curr->street->count) {
-		priv->curr=priv->next;
-		priv->next=priv->curr->next;
-		priv->coord=0;
-		priv->item.id_lo=0;
-		priv->item.id_hi++;
-	} else {
-		priv->coord++;
-		priv->item.id_lo++;
-	}
-	value=tracking_value(priv->tracking, priv->curr, priv->coord, &lpnt, INT_MAX/2, -1);
+	priv->seg++;
+	st=&s->streets[s->street[priv->seg]];
+	priv->item.id_hi=s->street[priv->seg]+1;
+	priv->item.id_lo=priv->seg-st->first;
+	value=tracking_value(priv->tracking, s, priv->seg, &lpnt, INT_MAX/2, -1);
 	if (value < 64) 
 		priv->item.type=type_tracking_100;
 	else if (value < 128)
@@ -1116,7 +2268,7 @@ tracking_map_get_item(struct map_rect_priv *priv)
 		priv->item.type=type_tracking_10;
 	else
 		priv->item.type=type_tracking_0;
-	dbg(lvl_debug,"item %d %d points\n", priv->coord, priv->curr->street->count);
+	dbg(lvl_debug,"item %d %d segments\n", priv->item.id_lo, st->count);
 	tracking_map_item_coord_rewind(priv);
 	tracking_map_item_attr_rewind(priv);
 	return ret;
@@ -20,6 +20,22 @@
 #ifndef NAVIT_TRACK_H
 #define NAVIT_TRACK_H
 #include <time.h>
+#include "item.h"
+#include "coord.h"
+
+/**
+ * @brief A position matched by tracking_match_position()
+ */
+struct tracking_match {
+	struct item item;		/**< The matched street. Streets read from a speed index are no map items, only
+					     type and map are set and the ids are 0 */
+	int flags;			/**< The flags of the street */
+	int maxspeed;			/**< The maximum speed allowed on the street, -1 if not known */
+	int value;			/**< The tracking value of the match, lower is better */
+	int offroad;			/**< Set if the squared distance to the street exceeds the offroad limit */
+	struct coord pos;		/**< The matched position on the street (projection_mg) */
+};
+
 /* prototypes */
 enum attr_type;
 enum projection;
@@ -39,9 +55,13 @@ int tracking_get_segment_pos(struct tracking *tr);
 int tracking_get_attr(struct tracking *_this, enum attr_type type, struct attr *attr, struct attr_iter *attr_iter);
 struct item *tracking_get_current_item(struct tracking *_this);
 int *tracking_get_current_flags(struct tracking *_this);
+int tracking_get_refresh_count(struct tracking *tr);
 void tracking_flush(struct tracking *tr);
 int tracking_set_attr(struct tracking *tr, struct attr *attr);
 struct tracking *tracking_new(struct attr *parent, struct attr **attrs);
+struct tracking *tracking_new_batch(struct mapset *ms);
+void tracking_match_reset(struct tracking *tr, struct coord_geo *geo);
+int tracking_match_position(struct tracking *tr, struct coord_geo *geo, double speed, double direction, struct tracking_match *match);
 void tracking_set_mapset(struct tracking *this_, struct mapset *ms);
 void tracking_set_route(struct tracking *this_, struct route *rt);
 void tracking_destroy(struct tracking *tr);
@@ -1076,20 +1076,13 @@ transform_polyline_length(enum projection pro, struct coord *c, int count)
 	return ret;
 }
 
-static int
-transform_overflow_possible_if_squared(int count, ...) {
-	va_list ap;
-	int i, value, result = 0;
-
-	va_start (ap, count);
-	for (i = 0; i < count; i++) {
-		value = va_arg (ap, int);
-		if (abs(value)>32767) {
-			result = 1;
-		}
-	}
-	va_end (ap);
-	return result;
+/* Largest coordinate difference whose square can be summed with another one without overflow */
+#define TRANSFORM_SQ_LIMIT 32767
+
+static inline int
+transform_overflow_possible_if_squared(int value)
+{
+	return value > TRANSFORM_SQ_LIMIT || value < -TRANSFORM_SQ_LIMIT;
 }
 
 int
@@ -1098,7 +1091,7 @@ transform_distance_sq(struct coord *c1, struct coord *c2)
 	int dx=c1->x-c2->x;
 	int dy=c1->y-c2->y;
 
-	if (transform_overflow_possible_if_squared(2, dx, dy))
+	if (transform_overflow_possible_if_squared(dx) || transform_overflow_possible_if_squared(dy))
 		return INT_MAX;
 	else
 		return dx*dx+dy*dy;
@@ -1121,20 +1114,49 @@ transform_distance_sq_pc(struct pcoord *c1, struct pcoord *c2)
 	return transform_distance_sq(&p1, &p2);
 }
 
+/**
+ * @brief Computes the foot point of a reference point on a line segment whose projection lies inside the segment
+ *
+ * @param x0 Start of the segment
+ * @param y0 Start of the segment
+ * @param vx Vector from the start to the end of the segment
+ * @param vy Vector from the start to the end of the segment
+ * @param c1 Scalar product of the segment vector and the vector from the start to the reference point
+ * @param c2 Squared length of the segment vector
+ * @param ref The reference point
+ * @param lpnt Returns the foot point, may be NULL
+ * @return The squared distance between ref and the foot point
+ */
+static inline int
+transform_distance_line_sq_inner(int x0, int y0, int vx, int vy, int c1, int c2, struct coord *ref, struct coord *lpnt)
+{
+	int climit=1000000;
+	struct coord l;
+
+	while (c1 > climit || c2 > climit) {
+		c1/=256;
+		c2/=256;
+	}
+	l.x=x0+vx*c1/c2;
+	l.y=y0+vy*c1/c2;
+	if (lpnt)
+		*lpnt=l;
+	return transform_distance_sq(&l, ref);
+}
+
 int
 transform_distance_line_sq(struct coord *l0, struct coord *l1, struct coord *ref, struct coord *lpnt)
 {
 	int vx,vy,wx,wy;
 	int c1,c2;
-	int climit=1000000;
-	struct coord l;
 
 	vx=l1->x-l0->x;
 	vy=l1->y-l0->y;
 	wx=ref->x-l0->x;
 	wy=ref->y-l0->y;
 
-	if (transform_overflow_possible_if_squared(4, vx, vy, wx, wy)) {
+	if (transform_overflow_possible_if_squared(vx) || transform_overflow_possible_if_squared(vy) ||
+	    transform_overflow_possible_if_squared(wx) || transform_overflow_possible_if_squared(wy)) {
 		return INT_MAX;
 	}
 
@@ -1150,15 +1172,159 @@ transform_distance_line_sq(struct coord *l0, struct coord *l1, struct coord *ref
 			*lpnt=*l1;
 		return transform_distance_sq(l1, ref);
 	}
-	while (c1 > climit || c2 > climit) {
-		c1/=256;
-		c2/=256;
+	return transform_distance_line_sq_inner(l0->x, l0->y, vx, vy, c1, c2, ref, lpnt);
+}
+
+static void
+transform_distance_line_sq_batch_scalar(int *x0, int *y0, int *x1, int *y1, int count, struct coord *ref, int *dist, struct coord *lpnt)
+{
+	struct coord l0,l1;
+	int i;
+
+	for (i = 0 ; i < count ; i++) {
+		l0.x=x0[i];
+		l0.y=y0[i];
+		l1.x=x1[i];
+		l1.y=y1[i];
+		dist[i]=transform_distance_line_sq(&l0, &l1, ref, lpnt ? &lpnt[i] : NULL);
 	}
-	l.x=l0->x+vx*c1/c2;
-	l.y=l0->y+vy*c1/c2;
-	if (lpnt)
-		*lpnt=l;
-	return transform_distance_sq(&l, ref);
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/**
+ * @brief Finishes the distance computation for one segment of a batch
+ *
+ * The vector kernels compute the intermediate values of transform_distance_line_sq() for
+ * several segments at once, this selects the result exactly the way transform_distance_line_sq() does.
+ */
+static inline int
+transform_distance_line_sq_select(int x0, int y0, int x1, int y1, int overflow, int c1, int c2, int d0, int d1, int overflow1,
+                                  struct coord *ref, struct coord *lpnt)
+{
+	if (overflow)
+		return INT_MAX;
+	if (c1 <= 0) {
+		if (lpnt) {
+			lpnt->x=x0;
+			lpnt->y=y0;
+		}
+		return d0;
+	}
+	if (c2 <= c1) {
+		if (lpnt) {
+			lpnt->x=x1;
+			lpnt->y=y1;
+		}
+		return overflow1 ? INT_MAX : d1;
+	}
+	return transform_distance_line_sq_inner(x0, y0, x1-x0, y1-y0, c1, c2, ref, lpnt);
+}
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+/* Packs the low 16 bits of x and y into one 32 bit lane each, for use with _mm_madd_epi16 */
+static inline __m128i
+transform_sse2_pack(__m128i x, __m128i y)
+{
+	return _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_slli_epi32(y, 16));
+}
+
+static inline __m128i
+transform_sse2_overflow(__m128i v)
+{
+	return _mm_or_si128(_mm_cmpgt_epi32(v, _mm_set1_epi32(TRANSFORM_SQ_LIMIT)),
+			    _mm_cmplt_epi32(v, _mm_set1_epi32(-TRANSFORM_SQ_LIMIT)));
+}
+
+static void
+transform_distance_line_sq_batch_vector(int *x0, int *y0, int *x1, int *y1, int count, struct coord *ref, int *dist, struct coord *lpnt)
+{
+	__m128i rx=_mm_set1_epi32(ref->x), ry=_mm_set1_epi32(ref->y);
+	int i,j,c1[4],c2[4],d0[4],d1[4],ov[4],ov1[4];
+
+	for (i = 0 ; i+4 <= count ; i+=4) {
+		__m128i ax=_mm_loadu_si128((__m128i *)(x0+i)), ay=_mm_loadu_si128((__m128i *)(y0+i));
+		__m128i bx=_mm_loadu_si128((__m128i *)(x1+i)), by=_mm_loadu_si128((__m128i *)(y1+i));
+		__m128i vx=_mm_sub_epi32(bx, ax), vy=_mm_sub_epi32(by, ay);
+		__m128i wx=_mm_sub_epi32(rx, ax), wy=_mm_sub_epi32(ry, ay);
+		__m128i dx=_mm_sub_epi32(bx, rx), dy=_mm_sub_epi32(by, ry);
+		__m128i v=transform_sse2_pack(vx, vy), w=transform_sse2_pack(wx, wy), d=transform_sse2_pack(dx, dy);
+		_mm_storeu_si128((__m128i *)ov, _mm_or_si128(_mm_or_si128(transform_sse2_overflow(vx), transform_sse2_overflow(vy)),
+							      _mm_or_si128(transform_sse2_overflow(wx), transform_sse2_overflow(wy))));
+		_mm_storeu_si128((__m128i *)ov1, _mm_or_si128(transform_sse2_overflow(dx), transform_sse2_overflow(dy)));
+		_mm_storeu_si128((__m128i *)c1, _mm_madd_epi16(v, w));
+		_mm_storeu_si128((__m128i *)c2, _mm_madd_epi16(v, v));
+		_mm_storeu_si128((__m128i *)d0, _mm_madd_epi16(w, w));
+		_mm_storeu_si128((__m128i *)d1, _mm_madd_epi16(d, d));
+		for (j = 0 ; j < 4 ; j++)
+			dist[i+j]=transform_distance_line_sq_select(x0[i+j], y0[i+j], x1[i+j], y1[i+j], ov[j], c1[j], c2[j], d0[j], d1[j], ov1[j],
+								    ref, lpnt ? &lpnt[i+j] : NULL);
+	}
+	transform_distance_line_sq_batch_scalar(x0+i, y0+i, x1+i, y1+i, count-i, ref, dist+i, lpnt ? lpnt+i : NULL);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline uint32x4_t
+transform_neon_overflow(int32x4_t v)
+{
+	/* Not vabsq_s32(), which leaves INT_MIN negative */
+	return vorrq_u32(vcgtq_s32(v, vdupq_n_s32(TRANSFORM_SQ_LIMIT)), vcltq_s32(v, vdupq_n_s32(-TRANSFORM_SQ_LIMIT)));
+}
+
+static void
+transform_distance_line_sq_batch_vector(int *x0, int *y0, int *x1, int *y1, int count, struct coord *ref, int *dist, struct coord *lpnt)
+{
+	int32x4_t rx=vdupq_n_s32(ref->x), ry=vdupq_n_s32(ref->y);
+	int i,j,c1[4],c2[4],d0[4],d1[4];
+	unsigned int ov[4],ov1[4];
+
+	for (i = 0 ; i+4 <= count ; i+=4) {
+		int32x4_t ax=vld1q_s32(x0+i), ay=vld1q_s32(y0+i), bx=vld1q_s32(x1+i), by=vld1q_s32(y1+i);
+		int32x4_t vx=vsubq_s32(bx, ax), vy=vsubq_s32(by, ay);
+		int32x4_t wx=vsubq_s32(rx, ax), wy=vsubq_s32(ry, ay);
+		int32x4_t dx=vsubq_s32(bx, rx), dy=vsubq_s32(by, ry);
+		vst1q_u32(ov, vorrq_u32(vorrq_u32(transform_neon_overflow(vx), transform_neon_overflow(vy)),
+					vorrq_u32(transform_neon_overflow(wx), transform_neon_overflow(wy))));
+		vst1q_u32(ov1, vorrq_u32(transform_neon_overflow(dx), transform_neon_overflow(dy)));
+		vst1q_s32(c1, vmlaq_s32(vmulq_s32(vx, wx), vy, wy));
+		vst1q_s32(c2, vmlaq_s32(vmulq_s32(vx, vx), vy, vy));
+		vst1q_s32(d0, vmlaq_s32(vmulq_s32(wx, wx), wy, wy));
+		vst1q_s32(d1, vmlaq_s32(vmulq_s32(dx, dx), dy, dy));
+		for (j = 0 ; j < 4 ; j++)
+			dist[i+j]=transform_distance_line_sq_select(x0[i+j], y0[i+j], x1[i+j], y1[i+j], ov[j], c1[j], c2[j], d0[j], d1[j], ov1[j],
+								    ref, lpnt ? &lpnt[i+j] : NULL);
+	}
+	transform_distance_line_sq_batch_scalar(x0+i, y0+i, x1+i, y1+i, count-i, ref, dist+i, lpnt ? lpnt+i : NULL);
+}
+#endif
+
+/**
+ * @brief Computes the squared distances between a point and a batch of line segments
+ *
+ * The result for every segment is identical to the one of transform_distance_line_sq(),
+ * including INT_MAX for segments too far away to compute the distance. Where available,
+ * the segments are processed several at a time using vector instructions.
+ *
+ * @param x0 X coordinates of the segment start points
+ * @param y0 Y coordinates of the segment start points
+ * @param x1 X coordinates of the segment end points
+ * @param y1 Y coordinates of the segment end points
+ * @param count Number of segments
+ * @param ref The reference point
+ * @param dist Returns the squared distance for each segment
+ * @param lpnt Returns the foot point for each segment, may be NULL. Not written for segments with a distance of INT_MAX.
+ */
+void
+transform_distance_line_sq_batch(int *x0, int *y0, int *x1, int *y1, int count, struct coord *ref, int *dist, struct coord *lpnt)
+{
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	transform_distance_line_sq_batch_vector(x0, y0, x1, y1, count, ref, dist, lpnt);
+#else
+	transform_distance_line_sq_batch_scalar(x0, y0, x1, y1, count, ref, dist, lpnt);
+#endif
 }
 
 navit_float
@@ -86,6 +86,7 @@ int transform_distance_sq(struct coord *c1, struct coord *c2);
 navit_float transform_distance_sq_float(struct coord *c1, struct coord *c2);
 int transform_distance_sq_pc(struct pcoord *c1, struct pcoord *c2);
 int transform_distance_line_sq(struct coord *l0, struct coord *l1, struct coord *ref, struct coord *lpnt);
+void transform_distance_line_sq_batch(int *x0, int *y0, int *x1, int *y1, int count, struct coord *ref, int *dist, struct coord *lpnt);
 navit_float transform_distance_line_sq_float(struct coord *l0, struct coord *l1, struct coord *ref, struct coord *lpnt);
 int transform_distance_polyline_sq(struct coord *c, int count, struct coord *ref, struct coord *lpnt, int *pos);
 int transform_douglas_peucker(struct coord *in, int count, int dist_sq, struct coord *out);
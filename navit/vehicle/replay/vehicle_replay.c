@@ -0,0 +1,291 @@
+/**
+ * Navit, a modular navigation system.
+ * Copyright (C) 2005-2008 Navit Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/** @file vehicle_replay.c
+ *
+ * @brief Replays a recorded GPS trace from an NMEA or GPX file
+ *
+ * The vehicle is configured with source="replay:<file>". Files ending in .gpx are read
+ * as GPX tracks, all others as NMEA logs of which the RMC sentences are used.
+ *
+ * The interval attribute selects the replay speed: without it the fixes are replayed
+ * in real time according to their timestamps, with interval="0" they are replayed as
+ * fast as possible, otherwise one fix is replayed every interval milliseconds.
+ *
+ * For every fix the time spent processing the position update (tracking_update()
+ * and the position callbacks of navit) and the matched maxspeed are printed. At the
+ * end of the file a summary with a latency histogram, the number of tracking
+ * refreshes and the number of bytes decompressed is printed. If on_eof="quit" is set,
+ * navit exits afterwards.
+ */
+
+#define MODULE vehicle_replay
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "debug.h"
+#include "callback.h"
+#include "plugin.h"
+#include "coord.h"
+#include "item.h"
+#include "attr.h"
+#include "vehicle.h"
+#include "event.h"
+#include "file.h"
+#include "navit.h"
+#include "track.h"
+#include "trace.h"
+
+#define REPLAY_HISTOGRAM_BUCKETS 24
+
+extern struct navit *global_navit;
+
+struct vehicle_priv {
+	char *source;
+	char *on_eof;
+	struct callback_list *cbl;
+	struct callback *cb;
+	struct event_timeout *timeout;
+	struct event_idle *idle;
+	int interval;				/**< Milliseconds between fixes, 0 for as fast as possible, -1 for real time */
+	GArray *fixes;
+	int curr;				/**< Index of the fix currently reported */
+	struct attr **attrs;
+
+	/* Statistics */
+	GArray *latencies;			/**< Processing time of each fix in microseconds */
+	int histogram[REPLAY_HISTOGRAM_BUCKETS];
+	gint64 start_time;
+	int start_refresh_count;
+	long long start_uncompressed_bytes;
+	int matched;
+};
+
+static int
+vehicle_replay_compare_int(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void
+vehicle_replay_report(struct vehicle_priv *priv)
+{
+	struct tracking *tracking=global_navit ? navit_get_tracking(global_navit) : NULL;
+	int count=priv->latencies->len;
+	int *lat=(int *)priv->latencies->data;
+	double elapsed=(g_get_monotonic_time()-priv->start_time)/1000000.0;
+	long long total=0;
+	int i;
+
+	for (i = 0 ; i < count ; i++)
+		total+=lat[i];
+	qsort(lat, count, sizeof(int), vehicle_replay_compare_int);
+	printf("replay: %d fixes in %.3f s, %d matched to a street\n", count, elapsed, priv->matched);
+	if (count)
+		printf("replay: latency us: min %d avg %lld p50 %d p90 %d p99 %d max %d\n", lat[0], total/count,
+		       lat[count/2], lat[count*9/10], lat[count*99/100], lat[count-1]);
+	for (i = 0 ; i < REPLAY_HISTOGRAM_BUCKETS ; i++) {
+		if (priv->histogram[i])
+			printf("replay: latency < %8d us: %d\n", 1 << i, priv->histogram[i]);
+	}
+	if (tracking)
+		printf("replay: tracking refreshes: %d\n", tracking_get_refresh_count(tracking)-priv->start_refresh_count);
+	printf("replay: bytes decompressed: %lld\n", file_get_uncompressed_bytes()-priv->start_uncompressed_bytes);
+	fflush(stdout);
+}
+
+static void vehicle_replay_schedule(struct vehicle_priv *priv);
+
+/**
+ * @brief Reports the next fix to navit and records how long processing it took
+ */
+static void
+vehicle_replay_next(struct vehicle_priv *priv)
+{
+	struct tracking *tracking=global_navit ? navit_get_tracking(global_navit) : NULL;
+	struct trace_fix *fix;
+	struct attr maxspeed;
+	gint64 start;
+	int latency,bucket=0;
+
+	/* A single shot timeout is gone once it fired */
+	priv->timeout=NULL;
+	if (priv->idle) {
+		event_remove_idle(priv->idle);
+		priv->idle=NULL;
+	}
+	if (priv->curr+1 >= (int)priv->fixes->len) {
+		vehicle_replay_report(priv);
+		if (priv->on_eof && !strcmp(priv->on_eof, "quit"))
+			event_main_loop_quit();
+		return;
+	}
+	if (priv->curr < 0) {
+		priv->start_time=g_get_monotonic_time();
+		priv->start_refresh_count=tracking ? tracking_get_refresh_count(tracking) : 0;
+		priv->start_uncompressed_bytes=file_get_uncompressed_bytes();
+	}
+	priv->curr++;
+	fix=&g_array_index(priv->fixes, struct trace_fix, priv->curr);
+	start=g_get_monotonic_time();
+	callback_list_call_attr_0(priv->cbl, attr_position_speed);
+	callback_list_call_attr_0(priv->cbl, attr_position_coord_geo);
+	latency=g_get_monotonic_time()-start;
+	g_array_append_val(priv->latencies, latency);
+	while (bucket < REPLAY_HISTOGRAM_BUCKETS-1 && latency >= (1 << bucket))
+		bucket++;
+	priv->histogram[bucket]++;
+	if (tracking && tracking_get_current_flags(tracking))
+		priv->matched++;
+	else
+		tracking=NULL;
+	if (!tracking || !tracking_get_attr(tracking, attr_maxspeed, &maxspeed, NULL))
+		maxspeed.u.num=0;
+	printf("replay: fix %d %s %f %f latency %d us maxspeed %ld\n", priv->curr, fix->time, fix->geo.lat, fix->geo.lng,
+	       latency, maxspeed.u.num);
+	vehicle_replay_schedule(priv);
+}
+
+static void
+vehicle_replay_schedule(struct vehicle_priv *priv)
+{
+	struct trace_fix *curr,*next;
+	int delay;
+
+	if (priv->interval == 0) {
+		priv->idle=event_add_idle(100, priv->cb);
+		return;
+	}
+	delay=priv->interval;
+	if (delay < 0) {
+		delay=1000;
+		if (priv->curr >= 0 && priv->curr+1 < (int)priv->fixes->len) {
+			curr=&g_array_index(priv->fixes, struct trace_fix, priv->curr);
+			next=&g_array_index(priv->fixes, struct trace_fix, priv->curr+1);
+			delay=next->secs >= curr->secs ? (next->secs-curr->secs)*1000 : 0;
+		}
+	}
+	priv->timeout=event_add_timeout(delay, 0, priv->cb);
+}
+
+static void
+vehicle_replay_destroy(struct vehicle_priv *priv)
+{
+	if (priv->timeout)
+		event_remove_timeout(priv->timeout);
+	if (priv->idle)
+		event_remove_idle(priv->idle);
+	callback_destroy(priv->cb);
+	g_array_free(priv->fixes, TRUE);
+	g_array_free(priv->latencies, TRUE);
+	g_free(priv->source);
+	g_free(priv->on_eof);
+	g_free(priv);
+}
+
+static int
+vehicle_replay_position_attr_get(struct vehicle_priv *priv, enum attr_type type, struct attr *attr)
+{
+	struct trace_fix *fix;
+	struct attr *active;
+
+	if (priv->curr < 0 && type != attr_active)
+		return 0;
+	fix=&g_array_index(priv->fixes, struct trace_fix, MAX(priv->curr, 0));
+	switch (type) {
+	case attr_position_fix_type:
+		attr->u.num=2;
+		break;
+	case attr_position_height:
+		attr->u.numd=&fix->height;
+		break;
+	case attr_position_speed:
+		attr->u.numd=&fix->speed;
+		break;
+	case attr_position_direction:
+		attr->u.numd=&fix->direction;
+		break;
+	case attr_position_coord_geo:
+		attr->u.coord_geo=&fix->geo;
+		break;
+	case attr_position_time_iso8601:
+		attr->u.str=fix->time;
+		break;
+	case attr_active:
+		active=attr_search(priv->attrs, NULL, attr_active);
+		if (!active)
+			return 0;
+		attr->u.num=active->u.num;
+		break;
+	default:
+		return 0;
+	}
+	attr->type=type;
+	return 1;
+}
+
+static struct vehicle_methods vehicle_replay_methods = {
+	vehicle_replay_destroy,
+	vehicle_replay_position_attr_get,
+};
+
+static struct vehicle_priv *
+vehicle_replay_new(struct vehicle_methods *meth, struct callback_list *cbl, struct attr **attrs)
+{
+	struct vehicle_priv *ret;
+	struct attr *source,*interval,*on_eof;
+	char *name;
+	GArray *fixes;
+
+	source=attr_search(attrs, NULL, attr_source);
+	name=strchr(source->u.str, ':');
+	if (!name || !name[1]) {
+		dbg(lvl_error, "invalid source '%s', expected replay:<file>\n", source->u.str);
+		return NULL;
+	}
+	name++;
+	fixes=trace_load(name);
+	if (!fixes)
+		return NULL;
+	ret=g_new0(struct vehicle_priv, 1);
+	ret->source=g_strdup(source->u.str);
+	ret->fixes=fixes;
+	ret->latencies=g_array_new(FALSE, FALSE, sizeof(int));
+	interval=attr_search(attrs, NULL, attr_interval);
+	ret->interval=interval ? MAX(interval->u.num, 0) : -1;
+	on_eof=attr_search(attrs, NULL, attr_on_eof);
+	if (on_eof)
+		ret->on_eof=g_strdup(on_eof->u.str);
+	ret->curr=-1;
+	ret->cbl=cbl;
+	ret->attrs=attrs;
+	ret->cb=callback_new_1(callback_cast(vehicle_replay_next), ret);
+	*meth=vehicle_replay_methods;
+	vehicle_replay_schedule(ret);
+	return ret;
+}
+
+void
+plugin_init(void)
+{
+	dbg(lvl_debug, "enter\n");
+	plugin_register_category_vehicle("replay", vehicle_replay_new);
+}
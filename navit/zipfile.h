@@ -32,6 +32,9 @@ struct zip_split {
 #define zip_lfh_sig 0x04034b50
 #define zip_lfh_sig_rev 0x504b0304
 
+/* LZ4 block compression, not part of the ZIP specification and only understood by navit */
+#define zip_method_lz4 100
+
 
 //! ZIP local file header structure.
 
@@ -94,6 +97,12 @@ struct zip_cd {
 */
 #define zip_extra_header_id_zip64 0x0001
 
+/**
+* @brief Header ID for the extra field padding a local file header so the data is aligned.
+* The data of the field is the alignment as 16 bit value, followed by zeroes.
+*/
+#define zip_extra_header_id_align 0xd935
+
 //! ZIP extra field structure.
 
 //! See the documentation of the ZIP format for the meaning